@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bundle.h"
+
+#define HEAD_MAGIC "C2HBNDL1"
+#define TAIL_MAGIC "C2HBIDX1"
+#define RECORD_SIZE  32
+#define TRAILER_SIZE 32
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+    for(int i = 0; i < 4; i += 1)
+        p[i] = v >> (8 * i);
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+    for(int i = 0; i < 8; i += 1)
+        p[i] = v >> (8 * i);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    uint32_t v = 0;
+    for(int i = 0; i < 4; i += 1)
+        v |= (uint32_t) p[i] << (8 * i);
+    return v;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for(int i = 0; i < 8; i += 1)
+        v |= (uint64_t) p[i] << (8 * i);
+    return v;
+}
+
+#define FNV64_SEED 14695981039346656037u
+
+static uint64_t fnv64(const char *str, long len, uint64_t h)
+{
+    for(long i = 0; i < len; i += 1) {
+        h ^= (unsigned char) str[i];
+        h *= 1099511628211u;
+    }
+    return h;
+}
+
+uint64_t c2html_bundle_hash(const char *data, long len)
+{
+    return fnv64(data, len, FNV64_SEED);
+}
+
+static int compare_paths(const char *a, long a_len, const char *b, long b_len)
+{
+    int res = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if(res == 0)
+        res = (a_len > b_len) - (a_len < b_len);
+    return res;
+}
+
+typedef struct {
+    uint64_t offset;
+    uint64_t len;
+    uint64_t hash;
+    long     path_off; // In [paths] of the writer
+    long     path_len;
+} record_t;
+
+struct c2html_bundle_writer_t {
+    FILE     *fp;
+    uint64_t  offset;  // Where the next entry starts
+    record_t *records;
+    long      count;
+    long      capacity;
+    char     *paths;
+    long      paths_used;
+    long      paths_size;
+    bool      writing; // Between begin and end
+    bool      failed;  // Writing the current entry failed
+};
+
+c2html_bundle_writer_t *c2html_bundle_create(const char *file, const char **error)
+{
+    c2html_bundle_writer_t *w = calloc(1, sizeof(c2html_bundle_writer_t));
+    if(w == NULL) {
+        if(error != NULL)
+            *error = "Out of memory";
+        return NULL;
+    }
+
+    w->fp = fopen(file, "wb");
+    if(w->fp == NULL) {
+        if(error != NULL)
+            *error = "Couldn't open or create file";
+        free(w);
+        return NULL;
+    }
+
+    if(fwrite(HEAD_MAGIC, 1, 8, w->fp) < 8) {
+        if(error != NULL)
+            *error = "Failed to write to file";
+        fclose(w->fp);
+        free(w);
+        return NULL;
+    }
+    w->offset = 8;
+    return w;
+}
+
+static void writer_free(c2html_bundle_writer_t *w)
+{
+    free(w->records);
+    free(w->paths);
+    free(w);
+}
+
+int c2html_bundle_begin(c2html_bundle_writer_t *w, const char *path,
+                        const char **error)
+{
+    long path_len = strlen(path);
+
+    if(w->count == w->capacity) {
+        long new_capacity = w->capacity ? 2 * w->capacity : 64;
+        void *temp = realloc(w->records, new_capacity * sizeof(record_t));
+        if(temp == NULL)
+            goto oom;
+        w->records = temp;
+        w->capacity = new_capacity;
+    }
+
+    if(w->paths_used + path_len > w->paths_size) {
+        long new_size = w->paths_size ? 2 * w->paths_size : 4096;
+        while(w->paths_used + path_len > new_size)
+            new_size *= 2;
+        void *temp = realloc(w->paths, new_size);
+        if(temp == NULL)
+            goto oom;
+        w->paths = temp;
+        w->paths_size = new_size;
+    }
+
+    memcpy(w->paths + w->paths_used, path, path_len);
+    w->records[w->count] = (record_t) {
+        .offset   = w->offset,
+        .len      = 0,
+        .hash     = FNV64_SEED,
+        .path_off = w->paths_used,
+        .path_len = path_len,
+    };
+    w->paths_used += path_len;
+    w->writing = true;
+    w->failed  = false;
+    return 0;
+
+oom:
+    if(error != NULL)
+        *error = "Out of memory";
+    return -1;
+}
+
+int c2html_bundle_write(void *data, const char *str, long len)
+{
+    c2html_bundle_writer_t *w = data;
+    record_t *r = &w->records[w->count];
+
+    if(w->failed || len == 0)
+        return 0;
+
+    if((long) fwrite(str, 1, len, w->fp) < len) {
+        w->failed = true;
+        return -1;
+    }
+
+    r->len += len;
+    r->hash = fnv64(str, len, r->hash);
+    return 0;
+}
+
+int c2html_bundle_end(c2html_bundle_writer_t *w, const char **error)
+{
+    w->writing = false;
+    if(w->failed) {
+        if(error != NULL)
+            *error = "Failed to write to file";
+        return -1;
+    }
+    w->offset += w->records[w->count].len;
+    w->count += 1;
+    return 0;
+}
+
+int c2html_bundle_add(c2html_bundle_writer_t *w, const char *path,
+                      const char *data, long len, const char **error)
+{
+    if(c2html_bundle_begin(w, path, error))
+        return -1;
+    c2html_bundle_write(w, data, len);
+    return c2html_bundle_end(w, error);
+}
+
+/* Record being sorted, along with the paths its
+ * offset refers to, since qsort has no argument
+ * for them.
+ */
+typedef struct {
+    record_t    rec;
+    const char *paths;
+} sort_item_t;
+
+static int compare_items(const void *a, const void *b)
+{
+    const sort_item_t *x = a;
+    const sort_item_t *y = b;
+    return compare_paths(x->paths + x->rec.path_off, x->rec.path_len,
+                         y->paths + y->rec.path_off, y->rec.path_len);
+}
+
+int c2html_bundle_finish(c2html_bundle_writer_t *w, const char **error)
+{
+    const char *err = NULL;
+
+    if(w->writing)
+        err = "Unterminated entry";
+
+    // Entries are written in the order they're added,
+    // but they're listed in the index by path.
+    if(err == NULL && w->count > 0) {
+        sort_item_t *items = malloc(w->count * sizeof(sort_item_t));
+        if(items == NULL)
+            err = "Out of memory";
+        else {
+            for(long i = 0; i < w->count; i += 1)
+                items[i] = (sort_item_t) { .rec = w->records[i], .paths = w->paths };
+            qsort(items, w->count, sizeof(sort_item_t), compare_items);
+            for(long i = 0; i < w->count; i += 1) {
+                w->records[i] = items[i].rec;
+                if(err == NULL && i > 0 && compare_items(&items[i-1], &items[i]) == 0)
+                    err = "Duplicate path";
+            }
+            free(items);
+        }
+    }
+
+    uint64_t index_off = w->offset;
+    uint64_t paths_off = index_off + (uint64_t) w->count * RECORD_SIZE;
+
+    // Paths are stored in the order of the index.
+    long path_off = 0;
+    for(long i = 0; err == NULL && i < w->count; i += 1) {
+        const record_t *r = &w->records[i];
+        unsigned char rec[RECORD_SIZE];
+        put_u64(rec +  0, r->offset);
+        put_u64(rec +  8, r->len);
+        put_u64(rec + 16, r->hash);
+        put_u32(rec + 24, path_off);
+        put_u32(rec + 28, r->path_len);
+        if(fwrite(rec, 1, RECORD_SIZE, w->fp) < RECORD_SIZE)
+            err = "Failed to write to file";
+        path_off += r->path_len;
+    }
+
+    for(long i = 0; err == NULL && i < w->count; i += 1) {
+        const record_t *r = &w->records[i];
+        if((long) fwrite(w->paths + r->path_off, 1, r->path_len, w->fp) < r->path_len)
+            err = "Failed to write to file";
+    }
+
+    if(err == NULL) {
+        unsigned char trailer[TRAILER_SIZE];
+        put_u64(trailer +  0, index_off);
+        put_u64(trailer +  8, w->count);
+        put_u64(trailer + 16, paths_off);
+        memcpy(trailer + 24, TAIL_MAGIC, 8);
+        if(fwrite(trailer, 1, TRAILER_SIZE, w->fp) < TRAILER_SIZE)
+            err = "Failed to write to file";
+    }
+
+    if(fclose(w->fp) && err == NULL)
+        err = "Failed to write to file";
+
+    writer_free(w);
+
+    if(err != NULL) {
+        if(error != NULL)
+            *error = err;
+        return -1;
+    }
+    return 0;
+}
+
+struct c2html_bundle_t {
+    const char          *map;
+    long                 size;
+    const unsigned char *index;
+    const char          *paths;
+    long                 count;
+};
+
+static void get_entry(const c2html_bundle_t *b, long i, c2html_bundle_entry_t *entry)
+{
+    const unsigned char *rec = b->index + i * RECORD_SIZE;
+    entry->offset   = get_u64(rec);
+    entry->data     = b->map + entry->offset;
+    entry->len      = get_u64(rec + 8);
+    entry->hash     = get_u64(rec + 16);
+    entry->path     = b->paths + get_u32(rec + 24);
+    entry->path_len = get_u32(rec + 28);
+}
+
+c2html_bundle_t *c2html_bundle_open(const char *file, const char **error)
+{
+    const char *err = NULL;
+    c2html_bundle_t *b = NULL;
+    void *map = MAP_FAILED;
+    struct stat st;
+
+    int fd = open(file, O_RDONLY);
+    if(fd < 0) {
+        err = "Couldn't open file";
+        goto fail;
+    }
+
+    if(fstat(fd, &st)) {
+        err = "Couldn't open file";
+        goto fail;
+    }
+
+    if(st.st_size < 8 + TRAILER_SIZE) {
+        err = "Not a bundle";
+        goto fail;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        err = "Couldn't map file";
+        goto fail;
+    }
+
+    const unsigned char *trailer = (unsigned char*) map + st.st_size - TRAILER_SIZE;
+    if(memcmp(map, HEAD_MAGIC, 8) || memcmp(trailer + 24, TAIL_MAGIC, 8)) {
+        err = "Not a bundle";
+        goto fail;
+    }
+
+    uint64_t size      = st.st_size - TRAILER_SIZE;
+    uint64_t index_off = get_u64(trailer);
+    uint64_t count     = get_u64(trailer + 8);
+    uint64_t paths_off = get_u64(trailer + 16);
+
+    if(index_off < 8 || index_off > size || count > (size - index_off) / RECORD_SIZE
+        || paths_off != index_off + count * RECORD_SIZE) {
+        err = "Corrupted bundle index";
+        goto fail;
+    }
+
+    b = malloc(sizeof(c2html_bundle_t));
+    if(b == NULL) {
+        err = "Out of memory";
+        goto fail;
+    }
+    b->map   = map;
+    b->size  = st.st_size;
+    b->index = (unsigned char*) map + index_off;
+    b->paths = (char*) map + paths_off;
+    b->count = count;
+
+    // Everything is checked once here, so that the
+    // entries can be used without further checks.
+    for(uint64_t i = 0; i < count; i += 1) {
+        const unsigned char *rec = b->index + i * RECORD_SIZE;
+        uint64_t off      = get_u64(rec);
+        uint64_t len      = get_u64(rec + 8);
+        uint64_t path_off = get_u32(rec + 24);
+        uint64_t path_len = get_u32(rec + 28);
+        if(off < 8 || off > index_off || len > index_off - off
+            || path_off > size - paths_off || path_len > size - paths_off - path_off) {
+            err = "Corrupted bundle index";
+            goto fail;
+        }
+    }
+
+    close(fd);
+    return b;
+
+fail:
+    free(b);
+    if(map != MAP_FAILED)
+        munmap(map, st.st_size);
+    if(fd >= 0)
+        close(fd);
+    if(error != NULL)
+        *error = err;
+    return NULL;
+}
+
+void c2html_bundle_close(c2html_bundle_t *b)
+{
+    if(b == NULL)
+        return;
+    munmap((void*) b->map, b->size);
+    free(b);
+}
+
+long c2html_bundle_count(const c2html_bundle_t *b)
+{
+    return b->count;
+}
+
+bool c2html_bundle_entry(const c2html_bundle_t *b, long i,
+                         c2html_bundle_entry_t *entry)
+{
+    if(i < 0 || i >= b->count)
+        return false;
+    get_entry(b, i, entry);
+    return true;
+}
+
+bool c2html_bundle_find(const c2html_bundle_t *b, const char *path, long len,
+                        c2html_bundle_entry_t *entry)
+{
+    if(len < 0)
+        len = strlen(path);
+
+    long lo = 0;
+    long hi = b->count;
+    while(lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        get_entry(b, mid, entry);
+        int res = compare_paths(entry->path, entry->path_len, path, len);
+        if(res == 0)
+            return true;
+        if(res < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return false;
+}
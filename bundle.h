@@ -0,0 +1,103 @@
+#ifndef C2HTML_BUNDLE_H
+#define C2HTML_BUNDLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A bundle is a single file holding the output of many
+ * conversions, each one stored under a path. It's built
+ * by appending the entries one after the other and ends
+ * with an index sorted by path, so that it can be mapped
+ * in memory and each entry can be served as a slice of
+ * it without copying or parsing anything.
+ *
+ * The layout is:
+ *
+ *     "C2HBNDL1"
+ *     .. data of the entries ..
+ *     .. index, one record per entry:
+ *        offset, length, hash (64 bits each),
+ *        path offset, path length (32 bits each) ..
+ *     .. paths of the entries ..
+ *     .. trailer: index offset, number of entries,
+ *        offset of the paths (64 bits each), "C2HBIDX1" ..
+ *
+ * All numbers are little-endian. The hash is the 64 bit
+ * FNV-1a of the data, which can be used as an ETag.
+ */
+
+/* Writes a bundle. Entries can either be added all at
+ * once with [c2html_bundle_add] or a piece at a time by
+ * calling [c2html_bundle_begin], [c2html_bundle_write]
+ * any number of times and then [c2html_bundle_end].
+ */
+typedef struct c2html_bundle_writer_t c2html_bundle_writer_t;
+
+/* Creates (or truncates) the bundle [file]. Returns NULL
+ * on failure, in which case a description of the error is
+ * returned through [error] (if not NULL).
+ */
+c2html_bundle_writer_t *c2html_bundle_create(const char *file, const char **error);
+
+/* Writes the index and closes the file. The writer is
+ * freed even on failure. Returns 0 on success and -1 on
+ * failure, in which case [error] is set. Having two
+ * entries with the same path is an error.
+ */
+int c2html_bundle_finish(c2html_bundle_writer_t *w, const char **error);
+
+int c2html_bundle_add(c2html_bundle_writer_t *w, const char *path,
+                      const char *data, long len, const char **error);
+
+int c2html_bundle_begin(c2html_bundle_writer_t *w, const char *path,
+                        const char **error);
+
+/* Appends data to the current entry. Its signature is the
+ * one of [c2html_sink_t], so that it can be passed to
+ * [c2html_write] with the writer as data. It returns 0 on
+ * success. Errors are returned by [c2html_bundle_end].
+ */
+int c2html_bundle_write(void *w, const char *data, long len);
+
+int c2html_bundle_end(c2html_bundle_writer_t *w, const char **error);
+
+/* Returns the hash that's stored for an entry with the
+ * contents [data] of length [len].
+ */
+uint64_t c2html_bundle_hash(const char *data, long len);
+
+/* Bundle opened for reading. */
+typedef struct c2html_bundle_t c2html_bundle_t;
+
+typedef struct {
+    const char *path; // Not zero-terminated
+    long        path_len;
+    const char *data;
+    long        len;
+    long        offset; // Of [data] in the file
+    uint64_t    hash;
+} c2html_bundle_entry_t;
+
+/* Maps [file] in memory and checks that its index is
+ * consistent. Returns NULL on failure, in which case
+ * [error] is set. The entries point into the mapping,
+ * so they're valid until [c2html_bundle_close].
+ */
+c2html_bundle_t *c2html_bundle_open(const char *file, const char **error);
+void             c2html_bundle_close(c2html_bundle_t *b);
+
+/* Number of entries and the [i]-th entry, in order
+ * of path. Returns false if [i] is out of range.
+ */
+long c2html_bundle_count(const c2html_bundle_t *b);
+bool c2html_bundle_entry(const c2html_bundle_t *b, long i,
+                         c2html_bundle_entry_t *entry);
+
+/* Looks up the entry with the given [path] (of length
+ * [len], or zero-terminated if [len] is negative) with
+ * a binary search. Returns false if there isn't one.
+ */
+bool c2html_bundle_find(const c2html_bundle_t *b, const char *path, long len,
+                        c2html_bundle_entry_t *entry);
+
+#endif /* C2HTML_BUNDLE_H */
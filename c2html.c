@@ -37,8 +37,58 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
 #include "c2html.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Static tracepoints of the provider "c2html", for
+ * tools like perf and bpftrace to attach to running
+ * processes. They're only built when C2H_USDT is 
+ * defined, which needs <sys/sdt.h>, and cost a nop
+ * each when nothing is attached.
+ */
+#ifdef C2H_USDT
+#include <sys/sdt.h>
+#define PROBE2(name, a, b) DTRACE_PROBE2(c2html, name, a, b)
+#else
+#define PROBE2(name, a, b) ((void) 0)
+#endif
+
+const char c2html_err_input_limit[]  = "Input too large";
+const char c2html_err_output_limit[] = "Output too large";
+const char c2html_err_token_limit[]  = "Too many tokens";
+const char c2html_err_cancelled[]    = "Conversion cancelled";
+
+/* The cache is the only state that may be shared 
+ * and modified by more than one thread, apart from
+ * the pool of [c2html_pool_create]. Define
+ * C2H_NO_THREADS to build without pthreads, in
+ * which case there's no pool.
+ */
+#ifdef C2H_NO_THREADS
+typedef int mutex_t;
+#define mutex_init(m)    ((void) (m))
+#define mutex_free(m)    ((void) (m))
+#define mutex_lock(m)    ((void) (m))
+#define mutex_unlock(m)  ((void) (m))
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+typedef pthread_mutex_t mutex_t;
+#define mutex_init(m)    pthread_mutex_init(m, NULL)
+#define mutex_free(m)    pthread_mutex_destroy(m)
+#define mutex_lock(m)    pthread_mutex_lock(m)
+#define mutex_unlock(m)  pthread_mutex_unlock(m)
+#endif
+
 typedef enum {
     T_DONE = 256,
     T_COMMENT,
@@ -50,15 +100,18 @@ typedef enum {
     T_VINT,
     T_VFLT,
     T_KWORD,
+    T_UKWORD, // Keyword from a dictionary
+    T_TYPE,   // Type name from a dictionary
     T_FDECLNAME,
     T_FCALLNAME,
     T_IDENTIFIER,
     T_OPERATOR,
     T_DIRECTIVE,
+    T_TEXT, // Run of non-ASCII bytes
 } Kind;
 
 typedef struct { 
-    Kind kind; int off, len; 
+    Kind kind; long off, len; 
 } Token;
 
 static bool isoperat(char c)
@@ -99,400 +152,866 @@ static bool iskword(const char *str, long len)
     return false;
 }
 
-static Token *tokenize(const char *str, long len)
+#define ISALPHA(c) isalpha((unsigned char) (c))
+#define ISDIGIT(c) isdigit((unsigned char) (c))
+
+/* Returns the position of the first non-ASCII byte
+ * of [str], or [len] if there isn't one. It checks
+ * 16 bytes at a time with SSE2, or 8 otherwise, since
+ * most of the input is usually ASCII.
+ */
+static long skip_ascii(const char *str, long len)
+{
+    long i = 0;
+#ifdef __SSE2__
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (str + i));
+        if(_mm_movemask_epi8(v))
+            break;
+    }
+#else
+    for(; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, str + i, 8);
+        if(w & 0x8080808080808080u)
+            break;
+    }
+#endif
+    while(i < len && (unsigned char) str[i] < 0x80)
+        i += 1;
+    return i;
+}
+
+/* Returns the length of the UTF-8 sequence that 
+ * starts at [i], or 0 if it's not a valid one. 
+ * Overlong forms, surrogates and code points above
+ * U+10FFFF aren't valid. If [cp] isn't NULL, the 
+ * code point is returned through it.
+ */
+static int utf8_seq(const char *str, long len, long i, uint32_t *cp)
 {
-    Token *array = NULL;
-    int count = 0, capacity = 0;
+    const unsigned char *s = (const unsigned char*) str + i;
+    long avail = len - i;
+    uint32_t c;
+    int n;
+
+    if(s[0] < 0x80) {
+        c = s[0];
+        n = 1;
+    } else if(s[0] >= 0xC2 && s[0] <= 0xDF) {
+        if(avail < 2 || (s[1] & 0xC0) != 0x80)
+            return 0;
+        c = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+        n = 2;
+    } else if(s[0] >= 0xE0 && s[0] <= 0xEF) {
+        if(avail < 3 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80)
+            return 0;
+        c = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        if(c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))
+            return 0;
+        n = 3;
+    } else if(s[0] >= 0xF0 && s[0] <= 0xF4) {
+        if(avail < 4 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80
+                     || (s[3] & 0xC0) != 0x80)
+            return 0;
+        c = ((uint32_t) (s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12) 
+          | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+        if(c < 0x10000 || c > 0x10FFFF)
+            return 0;
+        n = 4;
+    } else
+        return 0;
+
+    if(cp != NULL)
+        *cp = c;
+    return n;
+}
 
+static bool utf8_valid(const char *str, long len)
+{
     long i = 0;
+    while(1) {
+        i += skip_ascii(str + i, len - i);
+        if(i == len)
+            return true;
+        int n = utf8_seq(str, len, i, NULL);
+        if(n == 0)
+            return false;
+        i += n;
+    }
+}
 
-    Token T;
-    long curly_bracket_depth = 0;
-    bool only_spaces_since_line_start = true;
-    bool prev_nonspace_was_directive = false;
+typedef struct {
+    uint32_t lo, hi;
+} urange_t;
+
+/* Blocks of non-ASCII code points that can't appear
+ * in identifiers. It's an approximation of the 
+ * complement of XID_Continue: spaces, punctuation,
+ * symbols, emoji and private use areas.
+ */
+static const urange_t not_ident[] = {
+    { 0x0080, 0x00A9 }, { 0x00AB, 0x00B4 }, { 0x00B6, 0x00B6 },
+    { 0x00B8, 0x00B9 }, { 0x00BB, 0x00BF }, { 0x00D7, 0x00D7 },
+    { 0x00F7, 0x00F7 }, { 0x037E, 0x037E }, { 0x0387, 0x0387 },
+    { 0x055A, 0x055F }, { 0x0589, 0x058A }, { 0x060C, 0x060D },
+    { 0x061B, 0x061F }, { 0x066A, 0x066D }, { 0x06D4, 0x06D4 },
+    { 0x0964, 0x0965 }, { 0x0E3F, 0x0E3F }, { 0x2000, 0x203E },
+    { 0x2041, 0x2053 }, { 0x2055, 0x206F }, { 0x20A0, 0x20CF },
+    { 0x2190, 0x2BFF }, { 0x2E00, 0x2E7F }, { 0x3000, 0x3004 },
+    { 0x3008, 0x3020 }, { 0x3030, 0x3030 }, { 0x303D, 0x303F },
+    { 0xE000, 0xF8FF }, { 0xFD3E, 0xFD3F }, { 0xFE10, 0xFE1F },
+    { 0xFE30, 0xFE32 }, { 0xFE35, 0xFE4C }, { 0xFE50, 0xFE6F },
+    { 0xFEFF, 0xFEFF }, { 0xFF01, 0xFF0F }, { 0xFF1A, 0xFF20 },
+    { 0xFF3B, 0xFF3E }, { 0xFF40, 0xFF40 }, { 0xFF5B, 0xFF65 },
+    { 0xFFF0, 0xFFFF }, { 0x1F000, 0x1FAFF }, { 0xE0000, 0x10FFFF },
+};
+
+/* Code points that can continue an identifier but
+ * not start it: combining marks and digits.
+ */
+static const urange_t not_ident_start[] = {
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD },
+    { 0x0660, 0x0669 }, { 0x06F0, 0x06F9 }, { 0x0966, 0x096F },
+    { 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF }, { 0x203F, 0x2040 },
+    { 0x2054, 0x2054 }, { 0x20D0, 0x20FF }, { 0xFE00, 0xFE0F },
+    { 0xFE20, 0xFE2F }, { 0xFE33, 0xFE34 }, { 0xFE4D, 0xFE4F },
+    { 0xFF10, 0xFF19 }, { 0xFF3F, 0xFF3F },
+};
+
+static bool in_ranges(const urange_t *ranges, int count, uint32_t c)
+{
+    int lo = 0, hi = count;
+    while(lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if(ranges[mid].hi < c)
+            lo = mid + 1;
+        else if(ranges[mid].lo > c)
+            hi = mid;
+        else
+            return true;
+    }
+    return false;
+}
 
-    do {
-        if(i == len) {
-            T.kind = T_DONE;
-            T.off = i;
-            T.len = 0;
-        } else if(i+1 < len && str[i] == '/' && str[i+1] == '/') {
-            T.kind = T_COMMENT;
-            T.off = i;
-            while(i < len && str[i] != '\n') // What about backslashes??
-                i += 1;
-            T.len = i - T.off;
-        } else if(i+1 < len && str[i] == '/' && str[i+1] == '*') {
-            T.kind = T_COMMENT;
-            T.off = i;
-            while(1) {
+/* Returns the length of the non-ASCII character at
+ * [i] if it can be part of an identifier (or start
+ * one, if [start] is true), else 0.
+ */
+static int ident_char(const char *str, long len, long i, bool start)
+{
+    uint32_t c;
+    int n = utf8_seq(str, len, i, &c);
+    if(n < 2)
+        return 0;
+
+    #define COUNT(a) ((int) (sizeof(a) / sizeof((a)[0])))
+    if(in_ranges(not_ident, COUNT(not_ident), c))
+        return 0;
+    if(start && in_ranges(not_ident_start, COUNT(not_ident_start), c))
+        return 0;
+    #undef COUNT
+    return n;
+}
+
+static int dict_find(const c2html_dict_t *dict, const char *str, long len);
 
-                while(i < len && str[i] != '*')
-                    i += 1;
+/* The lexer returns one token at a time, so that
+ * the input can be rendered while it's scanned.
+ *
+ * Multi-line comments are returned as one T_COMMENT
+ * for each line, so that every line can be started
+ * from a [c2html_state_t]. Newlines are returned one
+ * at a time for the same reason.
+ */
+typedef struct {
+    const char *str;
+    long len;
+    long i;
+    long curly_bracket_depth;
+    bool inside_comment; // The current line is the continuation
+                         // of a /* */ comment.
+    bool only_spaces_since_line_start;
+    bool prev_nonspace_was_directive;
+    const c2html_dict_t *dict; // Optional
+    bool utf8; // Non-ASCII identifiers are allowed
+} lexer_t;
+
+static void lex_init(lexer_t *lx, const char *str, long len, 
+                     const c2html_state_t *state)
+{
+    lx->str = str;
+    lx->len = len;
+    lx->i = state->offset;
+    lx->curly_bracket_depth = state->depth;
+    lx->inside_comment = state->comment;
+    lx->only_spaces_since_line_start = true;
+    lx->prev_nonspace_was_directive = false;
+    lx->dict = NULL;
+    lx->utf8 = false;
+}
 
-                if(i == len)
-                    break;
+/* Scans a block comment from [i] up to the end of the 
+ * line. If the comment continues on the next line
+ * [inside_comment] is set to true, else to false.
+ */
+static long scan_comment(const char *str, long len, long i, bool *inside_comment)
+{
+    *inside_comment = false;
+    while(1) {
 
-                assert(str[i] == '*');
-                i += 1;
+        while(i < len && str[i] != '*' && str[i] != '\n')
+            i += 1;
 
-                if(i == len)
-                    break;
+        if(i == len)
+            break;
 
-                if(str[i] == '/') {
-                    i += 1;
-                    break;
-                }
-            }
-            T.len = i - T.off;
-        } else if(str[i] == ' ') {
-            T.kind = T_SPACE;
-            T.off = i;
-            do
-                i += 1;
-            while(i < len && str[i] == ' ');
-            T.len = i - T.off;
-        } else if(str[i] == '\t') {
-            T.kind = T_TAB;
-            T.off = i;
-            do
-                i += 1;
-            while(i < len && str[i] == ' ');
-            T.len = i - T.off;
-        } else if(str[i] == '\n') {
-            T.kind = T_NEWL;
-            T.off = i;
-            do
-                i += 1;
-            while(i < len && str[i] == '\n');
-            T.len = i - T.off;
-        } else if(str[i] == '\'' || str[i] == '\"') {
-            
-            char f = str[i];
+        if(str[i] == '\n') {
+            *inside_comment = true;
+            break;
+        }
 
-            T.kind = f == '"' ? T_VSTR : T_VCHAR;
-            T.off = i;
+        assert(str[i] == '*');
+        i += 1;
 
-            i += 1; // Skip the '\'' or '"'.
-            
-            do {
-                while(i < len && str[i] != f && str[i] != '\\')
-                    i += 1;
+        if(i == len)
+            break;
+
+        if(str[i] == '/') {
+            i += 1;
+            break;
+        }
+    }
+    return i;
+}
 
-                if(i == len || str[i] == f)
-                    break;
+static void lex_next(lexer_t *lx, Token *T_)
+{
+    const char *str = lx->str;
+    long len = lx->len;
+    long i = lx->i;
+    Token T;
 
-                if(str[i] == '\\') {
-                    i += 1; // Skip the '\\'.
-                    if(i < len)
-                        i += 1; // ..and the character after it.
-                }
+    if(lx->inside_comment && lx->only_spaces_since_line_start) {
+        // The comment that started on a previous line
+        // goes on. Even if this line of the comment is
+        // empty, it's returned as a token.
+        T.kind = T_COMMENT;
+        T.off = i;
+        i = scan_comment(str, len, i, &lx->inside_comment);
+        T.len = i - T.off;
+    } else if(i == len) {
+        T.kind = T_DONE;
+        T.off = i;
+        T.len = 0;
+    } else if(i+1 < len && str[i] == '/' && str[i+1] == '/') {
+        T.kind = T_COMMENT;
+        T.off = i;
+        while(i < len && str[i] != '\n') // What about backslashes??
+            i += 1;
+        T.len = i - T.off;
+    } else if(i+1 < len && str[i] == '/' && str[i+1] == '*') {
+        T.kind = T_COMMENT;
+        T.off = i;
+        i = scan_comment(str, len, i, &lx->inside_comment);
+        T.len = i - T.off;
+    } else if(str[i] == ' ') {
+        T.kind = T_SPACE;
+        T.off = i;
+        do
+            i += 1;
+        while(i < len && str[i] == ' ');
+        T.len = i - T.off;
+    } else if(str[i] == '\t') {
+        T.kind = T_TAB;
+        T.off = i;
+        do
+            i += 1;
+        while(i < len && str[i] == ' ');
+        T.len = i - T.off;
+    } else if(str[i] == '\n') {
+        T.kind = T_NEWL;
+        T.off = i;
+        T.len = 1;
+        i += 1;
+    } else if(str[i] == '\'' || str[i] == '\"') {
+        
+        char f = str[i];
+
+        T.kind = f == '"' ? T_VSTR : T_VCHAR;
+        T.off = i;
 
-            } while(1);
+        i += 1; // Skip the '\'' or '"'.
+        
+        do {
+            while(i < len && str[i] != f && str[i] != '\\')
+                i += 1;
+
+            if(i == len || str[i] == f)
+                break;
 
-            if(i < len) {
-                assert(str[i] == f);
-                i += 1; // Skip the final '\'' or '"'.
+            if(str[i] == '\\') {
+                i += 1; // Skip the '\\'.
+                if(i < len)
+                    i += 1; // ..and the character after it.
             }
-            T.len = i - T.off;
 
-        } else if(isdigit(str[i])) {
+        } while(1);
 
-            T.off = i;
+        if(i < len) {
+            assert(str[i] == f);
+            i += 1; // Skip the final '\'' or '"'.
+        }
+        T.len = i - T.off;
+
+    } else if(ISDIGIT(str[i])) {
+
+        T.off = i;
 
-            // We allow an 'x' if it's after a '0'.
-            if(i+2 < len && str[i] == '0' && str[i+1] == 'x' && isdigit(str[i+2]))
-                i += 2; // Skip the '0x'.
+        // We allow an 'x' if it's after a '0'.
+        if(i+2 < len && str[i] == '0' && str[i+1] == 'x' && ISDIGIT(str[i+2]))
+            i += 2; // Skip the '0x'.
 
-            while(i < len && isdigit(str[i]))
+        while(i < len && ISDIGIT(str[i]))
+            i += 1;
+        
+        // If the next character is a dot followed
+        // by a digit, then we continue to scan.    
+        if(i+1 < len && str[i] == '.' && ISDIGIT(str[i+1])) {
+            i += 1; // Skip the '.'.
+            while(i < len && ISDIGIT(str[i]))
                 i += 1;
-            
-            // If the next character is a dot followed
-            // by a digit, then we continue to scan.    
-            if(i+1 < len && str[i] == '.' && isdigit(str[i+1])) {
-                i += 1; // Skip the '.'.
-                while(i < len && isdigit(str[i]))
-                    i += 1;
-                T.kind = T_VFLT;
-            } else T.kind = T_VINT;
-            
-            T.len = i - T.off;
+            T.kind = T_VFLT;
+        } else T.kind = T_VINT;
         
-        } else if(isalpha(str[i]) || str[i] == '_') {
-
-            T.off = i;
-            do
+        T.len = i - T.off;
+    
+    } else if(ISALPHA(str[i]) || str[i] == '_' || (lx->utf8 
+              && (unsigned char) str[i] >= 0x80 && ident_char(str, len, i, true))) {
+
+        T.off = i;
+        while(i < len) {
+            int n;
+            if(ISALPHA(str[i]) || ISDIGIT(str[i]) || str[i] == '_')
                 i += 1;
-            while(isalpha(str[i]) || 
-                  isdigit(str[i]) || str[i] == '_');
-            T.len = i - T.off;
+            else if(lx->utf8 && (unsigned char) str[i] >= 0x80 
+                    && (n = ident_char(str, len, i, false)) > 0)
+                i += n;
+            else
+                break;
+        }
+        T.len = i - T.off;
 
-            /* It may either be an identifier or a
-             * language keyword.
+        /* It may either be an identifier or a
+         * language keyword.
+         */
+        
+        int word = -1;
+
+        if(iskword(str + T.off, T.len))
+            T.kind = T_KWORD;
+        else if(lx->dict != NULL && (word = dict_find(lx->dict, str + T.off, T.len)) >= 0)
+            T.kind = (word == C2HTML_KWORD) ? T_UKWORD : T_TYPE;
+        else {
+
+            /* If the identifier is followed by a '(' and
+             * it's in the global scope, then it's for a
+             * function definiton. If it's not in the global
+             * scope then it's a function call.
+             * Between the identifier and the '(' there may
+             * be some whitespace. An exception is made if
+             * before the identifier comes a preprocessor
+             * directive, in which case the '(' must come
+             * right after the identifier.
              */
-            
-            if(iskword(str + T.off, T.len))
-                T.kind = T_KWORD;
-            else {
 
-                /* If the identifier is followed by a '(' and
-                 * it's in the global scope, then it's for a
-                 * function definiton. If it's not in the global
-                 * scope then it's a function call.
-                 * Between the identifier and the '(' there may
-                 * be some whitespace. An exception is made if
-                 * before the identifier comes a preprocessor
-                 * directive, in which case the '(' must come
-                 * right after the identifier.
-                 */
-
-                bool followed_by_parenthesis = false;
-                bool yes_and_immediately = false;
-                {
-                    long k = i;
-                    while(k < len && (str[k] == ' ' || str[k] == '\t'))
-                        k += 1;
-
-                    if(k < len && str[k] == '(') {
-                        followed_by_parenthesis = true;
-                        if(k == i)
-                            yes_and_immediately = true;
-                    }
+            bool followed_by_parenthesis = false;
+            bool yes_and_immediately = false;
+            {
+                long k = i;
+                while(k < len && (str[k] == ' ' || str[k] == '\t'))
+                    k += 1;
+
+                if(k < len && str[k] == '(') {
+                    followed_by_parenthesis = true;
+                    if(k == i)
+                        yes_and_immediately = true;
                 }
+            }
 
-                if(followed_by_parenthesis) {
-                    if(curly_bracket_depth == 0) {
-                        if(prev_nonspace_was_directive) {
-                            if(yes_and_immediately)
-                                T.kind = T_FDECLNAME;
-                            else
-                                T.kind = T_IDENTIFIER;
-                        } else
+            if(followed_by_parenthesis) {
+                if(lx->curly_bracket_depth == 0) {
+                    if(lx->prev_nonspace_was_directive) {
+                        if(yes_and_immediately)
                             T.kind = T_FDECLNAME;
+                        else
+                            T.kind = T_IDENTIFIER;
                     } else
-                        T.kind = T_FCALLNAME;
-                } else {
-                    T.kind = T_IDENTIFIER;
-                }
+                        T.kind = T_FDECLNAME;
+                } else
+                    T.kind = T_FCALLNAME;
+            } else {
+                T.kind = T_IDENTIFIER;
             }
-        
-        } else if(str[i] == '#' && only_spaces_since_line_start) {
-
-            // The first non-whitespace token of the line
-            // is a '#'. If it's followed by an alphabetical
-            // character, then it's a directive. (There may
-            // be whitespace between the '#' and the identifier)
-
-            long j = i; // Use a secondary cursor to explore
-                        // what's after the '#'.
-
-            j += 1; // Skip the '#'.
-
-            // Skip spaces after the '#', if there are any.
-            while(j < len && (str[j] == ' ' || str[j] == '\t'))
-                j += 1;
-
-            if(isalpha(str[j])) {
+        }
+    
+    } else if(str[i] == '#' && lx->only_spaces_since_line_start) {
 
-                // It's a preprocessor directive!
-                
-                T.kind = T_DIRECTIVE;
-                T.off = i;
-                
-                while(j < len && isalpha(str[j]))
-                    j += 1;
+        // The first non-whitespace token of the line
+        // is a '#'. If it's followed by an alphabetical
+        // character, then it's a directive. (There may
+        // be whitespace between the '#' and the identifier)
 
-                T.len = j - T.off;
-                
-                i = j;
+        long j = i; // Use a secondary cursor to explore
+                    // what's after the '#'.
 
-            } else {
-                // Wasn't a directive.. Just tokenize the '#'.
-                T.kind = '#';
-                T.off = i;
-                T.len = 1;
-                i += 1;
-            }
+        j += 1; // Skip the '#'.
 
-        } else if(str[i] == '<' && prev_nonspace_was_directive) {
+        // Skip spaces after the '#', if there are any.
+        while(j < len && (str[j] == ' ' || str[j] == '\t'))
+            j += 1;
 
-            T.kind = T_VSTR;
-            T.off = i;
-            while(i < len && str[i] != '>')
-                i += 1;
-            if(i < len)
-                i += 1; // Skip the '>'.
-            T.len = i - T.off;
+        if(j < len && ISALPHA(str[j])) {
 
-        } else if(isoperat(str[i])) {
-            T.kind = T_OPERATOR;
+            // It's a preprocessor directive!
+            
+            T.kind = T_DIRECTIVE;
             T.off = i;
-            while(i < len && isoperat(str[i]))
-                i += 1;
-            T.len = i - T.off;
-        } else {
+            
+            while(j < len && ISALPHA(str[j]))
+                j += 1;
 
-            switch(str[i]) {
-                case '{': curly_bracket_depth += 1; break;
-                case '}': curly_bracket_depth -= 1; break;
-            }
+            T.len = j - T.off;
+            
+            i = j;
 
-            T.kind = str[i];
+        } else {
+            // Wasn't a directive.. Just tokenize the '#'.
+            T.kind = '#';
             T.off = i;
             T.len = 1;
             i += 1;
         }
 
-        if(T.kind == T_NEWL)
-            only_spaces_since_line_start = true;
-        else
-            if(T.kind != T_TAB && T.kind != T_SPACE)
-                only_spaces_since_line_start = false;
+    } else if(str[i] == '<' && lx->prev_nonspace_was_directive) {
 
-        if(T.kind == T_DIRECTIVE)
-            prev_nonspace_was_directive = true;
-        else
-            if(T.kind != T_TAB && T.kind != T_SPACE)
-                prev_nonspace_was_directive = false;
+        T.kind = T_VSTR;
+        T.off = i;
+        while(i < len && str[i] != '>')
+            i += 1;
+        if(i < len)
+            i += 1; // Skip the '>'.
+        T.len = i - T.off;
+
+    } else if(isoperat(str[i])) {
+        T.kind = T_OPERATOR;
+        T.off = i;
+        while(i < len && isoperat(str[i]))
+            i += 1;
+        T.len = i - T.off;
+    } else if((unsigned char) str[i] >= 0x80) {
+
+        // Non-ASCII characters that aren't part of an
+        // identifier are copied as they are, so they're
+        // grouped instead of being returned one byte at
+        // a time.
+        T.kind = T_TEXT;
+        T.off = i;
+        do {
+            int n = lx->utf8 ? utf8_seq(str, len, i, NULL) : 0;
+            i += n > 0 ? n : 1;
+        } while(i < len && (unsigned char) str[i] >= 0x80
+                && !(lx->utf8 && ident_char(str, len, i, true)));
+        T.len = i - T.off;
 
-        if(count == capacity) {
-            int new_capacity;
-            if(capacity == 0)
-                new_capacity = 8;
-            else
-                new_capacity = 2 * capacity;
-        
-            void *temp = realloc(array, new_capacity * sizeof(Token));
-            if(temp == NULL) {
-                // Uoops! Out of memory.
-                free(array);
-                return NULL;
-            }
+    } else {
 
-            array = temp;
-            capacity = new_capacity;
+        switch(str[i]) {
+            case '{': lx->curly_bracket_depth += 1; break;
+            case '}': lx->curly_bracket_depth -= 1; break;
         }
 
-        array[count++] = T;
+        T.kind = (unsigned char) str[i];
+        T.off = i;
+        T.len = 1;
+        i += 1;
+    }
 
-    } while(T.kind != T_DONE);
-    return array;
+    if(T.kind == T_NEWL)
+        lx->only_spaces_since_line_start = true;
+    else
+        if(T.kind != T_TAB && T.kind != T_SPACE)
+            lx->only_spaces_since_line_start = false;
+
+    if(T.kind == T_DIRECTIVE)
+        lx->prev_nonspace_was_directive = true;
+    else
+        if(T.kind != T_TAB && T.kind != T_SPACE)
+            lx->prev_nonspace_was_directive = false;
+
+    lx->i = i;
+    *T_ = T;
 }
 
-typedef struct {
-    char *error;
-    char  *data;
-    long   size;
-    long   used;
-} buff_t;
+/* Returns the state of the lexer, which is only
+ * meaningful at the start of a line.
+ */
+static c2html_state_t lex_state(const lexer_t *lx, long lineno)
+{
+    return (c2html_state_t) {
+        .offset  = lx->i,
+        .lineno  = lineno,
+        .depth   = lx->curly_bracket_depth,
+        .comment = lx->inside_comment,
+    };
+}
 
-static void buff_init(buff_t *buff)
+/* Makes room in [*array] for at least [count+1] elements
+ * of [size] bytes, doubling its capacity when needed.
+ * Returns false if out of memory, in which case the
+ * array is left unchanged.
+ */
+static bool reserve(void *array, int *capacity, int count, size_t size)
 {
-    memset(buff, 0, sizeof(buff_t));
+    if(count < *capacity)
+        return true;
+
+    int new_capacity;
+    if(*capacity == 0)
+        new_capacity = 8;
+    else
+        new_capacity = 2 * *capacity;
+
+    void *temp = realloc(*(void**) array, new_capacity * size);
+    if(temp == NULL)
+        return false;
+
+    *(void**) array = temp;
+    *capacity = new_capacity;
+    return true;
 }
 
-static void buff_puts(buff_t *buff, const char *str, long len) {
+#define HASH_SEED 2166136261u
 
-    if(buff->error)
-        return;
+/* FNV-1a. The [h] argument allows to hash
+ * more than one string in sequence, starting
+ * with [HASH_SEED].
+ */
+static unsigned int hash_bytes(const char *str, long len, unsigned int h)
+{
+    for(long i = 0; i < len; i += 1) {
+        h ^= (unsigned char) str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
 
-    if(buff->used + len > buff->size) {
+/* Hashes 8 bytes at a time, since the inputs
+ * can be long and FNV-1a goes one at a time.
+ */
+static uint64_t hash_key(const char *str, long len, uint64_t h)
+{
+    const uint64_t k = 0x9E3779B97F4A7C15u;
 
-        int new_size;
-        if(buff->size == 0)
-            new_size = 32;
-        else
-            new_size = 2 * buff->size;
+    long i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, str + i, 8);
+        h = (h ^ w) * k;
+        h ^= h >> 29;
+    }
 
-        if(buff->used + len > new_size)
-            new_size = buff->used + len;
+    uint64_t w = 0;
+    memcpy(&w, str + i, len - i);
+    h = (h ^ w ^ (uint64_t) len) * k;
+    h ^= h >> 32;
+    return h;
+}
 
-        void *temp = realloc(buff->data, new_size+1);
-        if(temp == NULL) {
-            free(buff->data);
-            buff->error = "Out of memory";
-            return;
+/* Open addressing index. Each slot holds the index
+ * of an element of an external array plus one, so
+ * that zero means empty. The number of slots is
+ * a power of two and is kept at least twice the
+ * number of elements.
+ */
+typedef struct {
+    int *slots;
+    int  num_slots;
+} index_t;
+
+static void index_free(index_t *index)
+{
+    free(index->slots);
+}
+
+/* Returns the slot where the element with [hash]
+ * should be placed, given that [count] elements
+ * are in the index. Grows it if necessary. The
+ * [hash_of] callback gives the hash of the already
+ * inserted elements to rehash them.
+ */
+static int *index_slot_for_insert(index_t *index, int count, unsigned int hash,
+                                  unsigned int (*hash_of)(const void*, int),
+                                  const void *data)
+{
+    if(2 * (count + 1) > index->num_slots) {
+
+        int new_num_slots = index->num_slots ? 2 * index->num_slots : 16;
+        int *new_slots = calloc(new_num_slots, sizeof(int));
+        if(new_slots == NULL)
+            return NULL;
+
+        int mask = new_num_slots - 1;
+        for(int i = 0; i < index->num_slots; i += 1) {
+            int k = index->slots[i];
+            if(k == 0)
+                continue;
+            int j = hash_of(data, k-1) & mask;
+            while(new_slots[j] != 0)
+                j = (j + 1) & mask;
+            new_slots[j] = k;
         }
 
-        buff->data = temp;
-        buff->size = new_size;
+        free(index->slots);
+        index->slots = new_slots;
+        index->num_slots = new_num_slots;
     }
 
-    memcpy(buff->data + buff->used, str, len);
-    buff->used += len;
+    int mask = index->num_slots - 1;
+    int j = hash & mask;
+    while(index->slots[j] != 0)
+        j = (j + 1) & mask;
+    return &index->slots[j];
 }
 
-static void buff_printf(buff_t *buff, const char *fmt, ...)
+/* Set of interned strings. They are copied into
+ * [arena] and referred to by their position in
+ * [ents].
+ */
+typedef struct {
+    long off;
+    int  len;
+    unsigned int hash;
+} strent_t;
+
+typedef struct {
+    char     *arena;
+    long      arena_used;
+    long      arena_size;
+    strent_t *ents;
+    int       count;
+    int       capacity;
+    index_t   index;
+} strtab_t;
+
+static void strtab_free(strtab_t *tab)
 {
-    char maybe[512];
-    char *buffer;
-    va_list va, va2;
-    va_start(va, fmt);
-    va_copy(va2, va);
+    index_free(&tab->index);
+    free(tab->ents);
+    free(tab->arena);
+}
 
-    int n = vsnprintf(maybe, sizeof(maybe), fmt, va);
-    if(n < 0) {
-        free(buff->data);
-        buff->error = "Bad format";
-        return;
-    }
+static unsigned int strtab_hash_of(const void *data, int i)
+{
+    const strtab_t *tab = data;
+    return tab->ents[i].hash;
+}
 
-    if(n < (int) sizeof(maybe))
-        buffer = maybe;
-    else {
-        
-        buffer = malloc(n+1);
-        if(buffer == NULL) {
-            free(buff->data);
-            buff->error = "Out of memory";
-            goto done;
-        }
+static int strtab_find(const strtab_t *tab, const char *str, long len,
+                       unsigned int hash)
+{
+    if(tab->index.num_slots == 0)
+        return -1;
+
+    int mask = tab->index.num_slots - 1;
+    int j = hash & mask;
+    while(tab->index.slots[j] != 0) {
+        const strent_t *ent = &tab->ents[tab->index.slots[j]-1];
+        if(ent->hash == hash && ent->len == len
+            && !memcmp(tab->arena + ent->off, str, len))
+            return tab->index.slots[j]-1;
+        j = (j + 1) & mask;
+    }
+    return -1;
+}
 
-        int k = vsnprintf(buffer, n+1, fmt, va2);
-        assert(k >= 0 && k == n);
-        (void) k; // If asserts are deactivated by defining
-                  // NDEBUG, the compiler complains because
-                  // k is unused.
+/* Returns the position of the string, adding
+ * it if it wasn't already there, or -1 if out
+ * of memory.
+ */
+static int strtab_add(strtab_t *tab, const char *str, long len)
+{
+    unsigned int hash = hash_bytes(str, len, HASH_SEED);
+
+    int i = strtab_find(tab, str, len, hash);
+    if(i >= 0)
+        return i;
+
+    if(tab->arena == NULL || tab->arena_used + len > tab->arena_size) {
+        long new_size = tab->arena_size ? 2 * tab->arena_size : 1024;
+        if(tab->arena_used + len > new_size)
+            new_size = tab->arena_used + len;
+        void *temp = realloc(tab->arena, new_size);
+        if(temp == NULL)
+            return -1;
+        tab->arena = temp;
+        tab->arena_size = new_size;
     }
 
-    assert(buffer[n] == '\0');
-    buff_puts(buff, buffer, n);
+    if(!reserve(&tab->ents, &tab->capacity, tab->count, sizeof(strent_t)))
+        return -1;
 
-done:
-    if(buffer != maybe)
-        free(buffer);
-    va_end(va2);
-    va_end(va);
+    int *slot = index_slot_for_insert(&tab->index, tab->count, hash, 
+                                      strtab_hash_of, tab);
+    if(slot == NULL)
+        return -1;
+
+    memcpy(tab->arena + tab->arena_used, str, len);
+    tab->ents[tab->count] = (strent_t) { 
+        .off = tab->arena_used, .len = len, .hash = hash 
+    };
+    tab->arena_used += len;
+
+    *slot = tab->count + 1;
+    return tab->count++;
 }
 
-static void print_escaped(buff_t *buff, const char *str, long len)
+/* Definition of a function in a file. There's at
+ * most one for each (function, file) pair, which is
+ * the one that gets the anchor when the file is
+ * rendered.
+ */
+typedef struct {
+    int  sym;
+    int  file;
+    long offset;
+    bool body;
+} xdef_t;
+
+struct c2html_xref_t {
+    strtab_t syms;  // Function names
+    strtab_t files; // URLs of the scanned files
+    int     *best;  // Definition that calls from other files
+                    // link to, for each element of [syms].
+    int      cap_best;
+    xdef_t  *defs;
+    int      num_defs;
+    int      cap_defs;
+    index_t  index; // Of [defs], by (sym, file)
+};
+
+static unsigned int xdef_hash(int sym, int file)
 {
-    long j = 0;
-    while(1) {
+    unsigned int h = (unsigned int) sym * 2654435761u;
+    return h ^ ((unsigned int) file * 2246822519u);
+}
 
-        long off = j;
+static unsigned int xdef_hash_of(const void *data, int i)
+{
+    const c2html_xref_t *xref = data;
+    return xdef_hash(xref->defs[i].sym, xref->defs[i].file);
+}
 
-        while(j < len && str[j] != '<' && str[j] != '>')
-            j += 1;
+static int xref_find_def(const c2html_xref_t *xref, int sym, int file)
+{
+    if(xref->index.num_slots == 0)
+        return -1;
+
+    int mask = xref->index.num_slots - 1;
+    int j = xdef_hash(sym, file) & mask;
+    while(xref->index.slots[j] != 0) {
+        int k = xref->index.slots[j]-1;
+        if(xref->defs[k].sym == sym && xref->defs[k].file == file)
+            return k;
+        j = (j + 1) & mask;
+    }
+    return -1;
+}
 
-        long end = j;
-        buff_puts(buff, str + off, end - off);
+static bool xref_add_def(c2html_xref_t *xref, int sym, int file,
+                         long offset, bool body)
+{
+    int k = xref_find_def(xref, sym, file);
+    if(k < 0) {
+
+        if(!reserve(&xref->defs, &xref->cap_defs, xref->num_defs, sizeof(xdef_t)))
+            return false;
+
+        int *slot = index_slot_for_insert(&xref->index, xref->num_defs, 
+                                          xdef_hash(sym, file), 
+                                          xdef_hash_of, xref);
+        if(slot == NULL)
+            return false;
+
+        k = xref->num_defs++;
+        xref->defs[k] = (xdef_t) { .sym = sym, .file = file, 
+                                   .offset = offset, .body = body };
+        *slot = k + 1;
+
+    } else if(body && !xref->defs[k].body) {
+        // A prototype was found before the definition.
+        xref->defs[k].offset = offset;
+        xref->defs[k].body = true;
+    }
 
-        if(j == len)
-            break;
+    while(xref->cap_best < xref->syms.count) {
+        int old_cap = xref->cap_best;
+        if(!reserve(&xref->best, &xref->cap_best, old_cap, sizeof(int)))
+            return false;
+        for(int i = old_cap; i < xref->cap_best; i += 1)
+            xref->best[i] = -1;
+    }
 
-        switch(str[j]) {
-            case '<': buff_printf(buff, "&lt;"); break;
-            case '>': buff_printf(buff, "&gt;"); break;
-            default: assert(0); break;
-        }
+    int best = xref->best[sym];
+    if(best < 0 || (!xref->defs[best].body && xref->defs[k].body))
+        xref->best[sym] = k;
+    return true;
+}
 
-        j += 1;
+/* Tells whether the function name that ends at [i]
+ * is followed by a body, by skipping the parameter
+ * list.
+ */
+static bool followed_by_body(const char *str, long len, long i)
+{
+    long depth = 0;
+    while(i < len) {
+        char c = str[i++];
+        if(c == '(')
+            depth += 1;
+        else if(c == ')') {
+            depth -= 1;
+            if(depth == 0)
+                break;
+        } else if(c == ';' || c == '{' || c == '}')
+            return false;
     }
+
+    while(i < len && isspace((unsigned char) str[i]))
+        i += 1;
+
+    return i < len && str[i] == '{';
 }
 
-char *c2html(const char *str, long len, const char *prefix, 
-             long *output_len, const char **error)
+c2html_xref_t *c2html_xref_create(void)
+{
+    return calloc(1, sizeof(c2html_xref_t));
+}
+
+void c2html_xref_free(c2html_xref_t *xref)
+{
+    if(xref == NULL)
+        return;
+    strtab_free(&xref->syms);
+    strtab_free(&xref->files);
+    index_free(&xref->index);
+    free(xref->best);
+    free(xref->defs);
+    free(xref);
+}
+
+int c2html_xref_scan(c2html_xref_t *xref, const char *str, long len,
+                     const char *url, const char **error)
 {
     if(str == NULL)
         str = "";
@@ -500,158 +1019,2688 @@ char *c2html(const char *str, long len, const char *prefix,
     if(len < 0)
         len = strlen(str);
 
-    if(prefix == NULL)
-        prefix = "";
+    if(url == NULL)
+        url = "";
 
-    Token *tokens = tokenize(str, len);
-    if(tokens == NULL) {
+    int file = strtab_add(&xref->files, url, strlen(url));
+    if(file < 0) {
         if(error != NULL)
             *error = "Out of memory";
-        return NULL;
+        return -1;
     }
 
-    buff_t buff;
-    buff_init(&buff);
-    long lineno = 1;
+    lexer_t lx;
+    c2html_state_t start = { .offset = 0, .lineno = 1 };
+    lex_init(&lx, str, len, &start);
 
-    buff_printf(&buff,
-        "<div class=\"%scode\">\n"
+    Token T;
+    do {
+        lex_next(&lx, &T);
+
+        if(T.kind != T_FDECLNAME)
+            continue;
+
+        long end = T.off + T.len;
+
+        int sym = strtab_add(&xref->syms, str + T.off, T.len);
+        if(sym < 0 || !xref_add_def(xref, sym, file, T.off, 
+                                    followed_by_body(str, len, end))) {
+            if(error != NULL)
+                *error = "Out of memory";
+            return -1;
+        }
+
+    } while(T.kind != T_DONE);
+
+    return 0;
+}
+
+int c2html_xref_merge(c2html_xref_t *dst, const c2html_xref_t *src,
+                      const char **error)
+{
+    for(int i = 0; i < src->files.count; i += 1) {
+        const strent_t *ent = &src->files.ents[i];
+        if(strtab_add(&dst->files, src->files.arena + ent->off, ent->len) < 0)
+            goto oom;
+    }
+
+    for(int i = 0; i < src->num_defs; i += 1) {
+
+        const xdef_t   *def  = &src->defs[i];
+        const strent_t *name = &src->syms.ents[def->sym];
+        const strent_t *url  = &src->files.ents[def->file];
+
+        int sym  = strtab_add(&dst->syms,  src->syms.arena  + name->off, name->len);
+        int file = strtab_add(&dst->files, src->files.arena + url->off,  url->len);
+        if(sym < 0 || file < 0 || !xref_add_def(dst, sym, file, def->offset, def->body))
+            goto oom;
+    }
+    return 0;
+
+oom:
+    if(error != NULL)
+        *error = "Out of memory";
+    return -1;
+}
+
+struct c2html_dict_t {
+    strtab_t       words;
+    unsigned char *kinds; // Of each element of [words]
+    int            cap_kinds;
+    int            min_len; // Of the words, to reject most
+    int            max_len; // identifiers without hashing them.
+};
+
+c2html_dict_t *c2html_dict_create(void)
+{
+    return calloc(1, sizeof(c2html_dict_t));
+}
+
+void c2html_dict_free(c2html_dict_t *dict)
+{
+    if(dict == NULL)
+        return;
+    strtab_free(&dict->words);
+    free(dict->kinds);
+    free(dict);
+}
+
+static bool isident(const char *str, long len)
+{
+    if(len == 0 || ISDIGIT(str[0]))
+        return false;
+    for(long i = 0; i < len; i += 1)
+        if(!ISALPHA(str[i]) && !ISDIGIT(str[i]) && str[i] != '_')
+            return false;
+    return true;
+}
+
+int c2html_dict_add(c2html_dict_t *dict, const char *str, long len,
+                    c2html_word_t kind, const char **error)
+{
+    if(len < 0)
+        len = strlen(str);
+
+    if(len > INT_MAX || !isident(str, len)) {
+        if(error != NULL)
+            *error = "Dictionary names must be identifiers";
+        return -1;
+    }
+
+    // The kind is reserved first, so that a word is
+    // never added without one.
+    int i = -1;
+    if(reserve(&dict->kinds, &dict->cap_kinds, dict->words.count, 1))
+        i = strtab_add(&dict->words, str, len);
+    if(i < 0) {
+        if(error != NULL)
+            *error = "Out of memory";
+        return -1;
+    }
+    dict->kinds[i] = kind;
+
+    if(dict->words.count == 1 || len < dict->min_len)
+        dict->min_len = len;
+    if(len > dict->max_len)
+        dict->max_len = len;
+    return 0;
+}
+
+int c2html_dict_load(c2html_dict_t *dict, const char *str, long len,
+                     c2html_word_t kind, const char **error)
+{
+    if(str == NULL)
+        str = "";
+
+    if(len < 0)
+        len = strlen(str);
+
+    long i = 0;
+    while(i < len) {
+
+        if(str[i] == '#') {
+            while(i < len && str[i] != '\n')
+                i += 1;
+            continue;
+        }
+
+        if(isspace((unsigned char) str[i])) {
+            i += 1;
+            continue;
+        }
+
+        long start = i;
+        while(i < len && !isspace((unsigned char) str[i]))
+            i += 1;
+
+        if(c2html_dict_add(dict, str + start, i - start, kind, error))
+            return -1;
+    }
+    return 0;
+}
+
+/* Returns the kind of the word, or -1 if it's not 
+ * in the dictionary.
+ */
+static int dict_find(const c2html_dict_t *dict, const char *str, long len)
+{
+    if(len < dict->min_len || len > dict->max_len)
+        return -1;
+
+    int i = strtab_find(&dict->words, str, len, hash_bytes(str, len, HASH_SEED));
+    if(i < 0)
+        return -1;
+    return dict->kinds[i];
+}
+
+/* Output buffer. It either grows to hold the whole
+ * output or, if [sink] is set, it's a fixed size
+ * buffer that's passed to the sink when full.
+ */
+typedef struct {
+    const char *error;
+    char  *data;
+    long   size;
+    long   used;
+    long   written; // Bytes output so far
+    long   limit;   // Maximum of [written], or 0
+    c2html_sink_t sink;
+    void         *sink_data;
+} buff_t;
+
+static void buff_init(buff_t *buff)
+{
+    memset(buff, 0, sizeof(buff_t));
+}
+
+static void buff_init_sink(buff_t *buff, char *data, long size, 
+                           c2html_sink_t sink, void *sink_data)
+{
+    buff_init(buff);
+    buff->data = data;
+    buff->size = size;
+    buff->sink = sink;
+    buff->sink_data = sink_data;
+}
+
+static void buff_fail(buff_t *buff, const char *error)
+{
+    if(buff->sink == NULL) {
+        free(buff->data);
+        buff->data = NULL;
+    }
+    buff->error = error;
+}
+
+static void buff_flush(buff_t *buff)
+{
+    if(buff->error || buff->sink == NULL || buff->used == 0)
+        return;
+
+    if(buff->sink(buff->sink_data, buff->data, buff->used))
+        buff_fail(buff, "Output interrupted");
+    buff->used = 0;
+}
+
+static void buff_puts(buff_t *buff, const char *str, long len) {
+
+    if(buff->error)
+        return;
+
+    if(buff->limit > 0 && buff->written + len > buff->limit) {
+        buff_fail(buff, c2html_err_output_limit);
+        return;
+    }
+    buff->written += len;
+
+    if(buff->sink != NULL) {
+
+        if(buff->used + len > buff->size)
+            buff_flush(buff);
+
+        if(len > buff->size) {
+            // Doesn't fit in the buffer, so it's 
+            // passed to the sink directly.
+            if(!buff->error && buff->sink(buff->sink_data, str, len))
+                buff_fail(buff, "Output interrupted");
+            return;
+        }
+
+        if(buff->error)
+            return;
+
+    } else if(buff->used + len > buff->size) {
+
+        long new_size;
+        if(buff->size == 0)
+            new_size = 32;
+        else
+            new_size = 2 * buff->size;
+
+        if(buff->used + len > new_size)
+            new_size = buff->used + len;
+
+        PROBE2(buff__grow, buff->size, new_size);
+        void *temp = realloc(buff->data, new_size+1);
+        if(temp == NULL) {
+            buff_fail(buff, "Out of memory");
+            return;
+        }
+
+        buff->data = temp;
+        buff->size = new_size;
+    }
+
+    if(len > 0)
+        memcpy(buff->data + buff->used, str, len);
+    buff->used += len;
+}
+
+static void buff_printf(buff_t *buff, const char *fmt, ...)
+{
+    char maybe[512];
+    char *buffer;
+    va_list va, va2;
+    va_start(va, fmt);
+    va_copy(va2, va);
+
+    int n = vsnprintf(maybe, sizeof(maybe), fmt, va);
+    if(n < 0) {
+        buff_fail(buff, "Bad format");
+        buffer = maybe;
+        goto done;
+    }
+
+    if(n < (int) sizeof(maybe))
+        buffer = maybe;
+    else {
+        
+        buffer = malloc(n+1);
+        if(buffer == NULL) {
+            buff_fail(buff, "Out of memory");
+            buffer = maybe;
+            goto done;
+        }
+
+        int k = vsnprintf(buffer, n+1, fmt, va2);
+        assert(k >= 0 && k == n);
+        (void) k; // If asserts are deactivated by defining
+                  // NDEBUG, the compiler complains because
+                  // k is unused.
+    }
+
+    assert(buffer[n] == '\0');
+    buff_puts(buff, buffer, n);
+
+done:
+    if(buffer != maybe)
+        free(buffer);
+    va_end(va2);
+    va_end(va);
+}
+
+static void print_escaped(buff_t *buff, const char *str, long len)
+{
+    long j = 0;
+    while(1) {
+
+        long off = j;
+
+        while(j < len && str[j] != '<' && str[j] != '>')
+            j += 1;
+
+        long end = j;
+        buff_puts(buff, str + off, end - off);
+
+        if(j == len)
+            break;
+
+        switch(str[j]) {
+            case '<': buff_printf(buff, "&lt;"); break;
+            case '>': buff_printf(buff, "&gt;"); break;
+            default: assert(0); break;
+        }
+
+        j += 1;
+    }
+}
+
+/* Writes the href of a link to the definition [def]
+ * from the file [file]. [depth] is the number of
+ * directories in the URL of [file].
+ */
+/* Like [print_escaped], but for the value of an
+ * attribute, so quotes and ampersands are escaped
+ * too.
+ */
+static void print_attr(buff_t *buff, const char *str, long len)
+{
+    long off = 0;
+    for(long j = 0; j < len; j += 1) {
+        const char *entity;
+        switch(str[j]) {
+            case '<': entity = "&lt;";   break;
+            case '>': entity = "&gt;";   break;
+            case '&': entity = "&amp;";  break;
+            case '"': entity = "&quot;"; break;
+            default: continue;
+        }
+        buff_puts(buff, str + off, j - off);
+        buff_puts(buff, entity, strlen(entity));
+        off = j + 1;
+    }
+    buff_puts(buff, str + off, len - off);
+}
+
+static void print_xref_href(buff_t *buff, const c2html_xref_t *xref, 
+                            const xdef_t *def, int file, int depth, 
+                            const char *prefix)
+{
+    if(def->file != file) {
+        for(int i = 0; i < depth; i += 1)
+            buff_puts(buff, "../", 3);
+        const strent_t *url = &xref->files.ents[def->file];
+        print_attr(buff, xref->files.arena + url->off, url->len);
+    }
+    const strent_t *name = &xref->syms.ents[def->sym];
+    buff_printf(buff, "#%sdef-%.*s", prefix, name->len, xref->syms.arena + name->off);
+}
+
+/* State of the conversion of a string, which
+ * goes one line at a time.
+ */
+typedef struct {
+    lexer_t     lx;
+    buff_t     *buff;
+    const char *prefix;
+    long        lineno;
+    const c2html_xref_t *xref;
+    int         xref_file;  // Position of the rendered file in
+                            // [xref->files], or -1.
+    int         xref_depth; // Number of directories in its URL.
+    long        base;       // Position of [lx.str] in the whole input,
+                            // when it's converted in pieces.
+    long        last_line;  // Last line of the range, or -1
+    bool        no_line_numbers;
+    long        tokens;     // Scanned so far
+    long        max_tokens;
+    c2html_cancel_t cancel;
+    void       *cancel_data;
+    c2html_line_cache_t *line_cache; // Optional
+    buff_t      line_buff;  // Output of a line to be cached
+} render_t;
+
+static void render_init(render_t *r, buff_t *buff, const char *str, long len,
+                        const c2html_opts_t *opts, const c2html_state_t *state)
+{
+    lex_init(&r->lx, str, len, state);
+    r->lx.dict = opts->dict;
+    r->lx.utf8 = opts->utf8 && utf8_valid(str, len);
+    r->buff   = buff;
+    r->prefix = opts->prefix ? opts->prefix : "";
+    r->lineno = state->lineno;
+    r->base   = 0;
+    r->last_line = opts->last_line < 1 ? -1 : opts->last_line;
+    r->no_line_numbers = opts->no_line_numbers;
+
+    r->tokens      = 0;
+    r->max_tokens  = opts->max_tokens;
+    r->cancel      = opts->cancel;
+    r->cancel_data = opts->cancel_data;
+    if(buff != NULL)
+        buff->limit = opts->max_output;
+
+    r->line_cache = opts->xref ? NULL : opts->line_cache;
+    buff_init(&r->line_buff);
+
+    r->xref       = opts->xref;
+    r->xref_file  = -1;
+    r->xref_depth =  0;
+    if(opts->xref != NULL && opts->url != NULL) {
+        long url_len = strlen(opts->url);
+        r->xref_file = strtab_find(&opts->xref->files, opts->url, url_len,
+                                   hash_bytes(opts->url, url_len, HASH_SEED));
+        for(long k = 0; k < url_len; k += 1)
+            if(opts->url[k] == '/')
+                r->xref_depth += 1;
+    }
+}
+
+static void render_token(render_t *r, const Token *T)
+{
+    buff_t *buff = r->buff;
+    const char *prefix = r->prefix;
+    const char *str = r->lx.str;
+    const c2html_xref_t *xref = r->xref;
+    int len = T->len;
+
+    switch(T->kind) {
+
+        case T_DONE:
+        case T_NEWL:
+        assert(0);
+        break;
+
+        case T_SPACE:
+        buff_puts(buff, str + T->off, T->len);
+        break;
+
+        case T_TAB:
+        for(int j = 0; j < len; j += 1)
+            buff_printf(buff, "    ");
+        break;
+
+        case T_KWORD:
+        buff_printf(buff, "<span class=\"%skword %skword-%.*s\">%.*s</span>",
+            prefix, prefix,
+            len, str + T->off,
+            len, str + T->off);
+        break;
+
+        case T_UKWORD:
+        buff_printf(buff, "<span class=\"%skword %skword-%.*s %suser-kword\">%.*s</span>",
+            prefix, prefix,
+            len, str + T->off,
+            prefix,
+            len, str + T->off);
+        break;
+
+        case T_TYPE:
+        buff_printf(buff, "<span class=\"%sidentifier %stype\">%.*s</span>",
+            prefix, prefix, len, str + T->off);
+        break;
+
+        case T_VSTR:
+        buff_printf(buff, "<span class=\"%sval-str\">", prefix);
+        print_escaped(buff, str + T->off, T->len);
+        buff_printf(buff, "</span>");
+        break;
+
+        case T_VCHAR:
+        buff_printf(buff, "<span class=\"%sval-char\">", prefix);
+        print_escaped(buff, str + T->off, T->len);
+        buff_printf(buff, "</span>");
+        break;
+
+        case T_VINT:
+        buff_printf(buff, "<span class=\"%sval-int\">%.*s</span>",
+            prefix, len, str + T->off);
+        break;
+
+        case T_VFLT:
+        buff_printf(buff, "<span class=\"%sval-flt\">%.*s</span>",
+            prefix, len, str + T->off);
+        break;
+
+        case T_FDECLNAME:
+        {
+            int def = -1;
+            if(xref != NULL && r->xref_file >= 0) {
+                const char *name = str + T->off;
+                int sym = strtab_find(&xref->syms, name, T->len,
+                                      hash_bytes(name, T->len, HASH_SEED));
+                if(sym >= 0)
+                    def = xref_find_def(xref, sym, r->xref_file);
+            }
+
+            if(def >= 0 && xref->defs[def].offset == r->base + T->off)
+                buff_printf(buff, "<span class=\"%sidentifier %sfdeclname\" id=\"%sdef-%.*s\">%.*s</span>",
+                    prefix, prefix, prefix, 
+                    len, str + T->off,
+                    len, str + T->off);
+            else
+                buff_printf(buff, "<span class=\"%sidentifier %sfdeclname\">%.*s</span>",
+                    prefix, prefix, len, str + T->off);
+            break;
+        }
+
+        case T_FCALLNAME:
+        {
+            int def = -1;
+            if(xref != NULL) {
+                const char *name = str + T->off;
+                int sym = strtab_find(&xref->syms, name, T->len,
+                                      hash_bytes(name, T->len, HASH_SEED));
+                if(sym >= 0) {
+                    // Calls prefer the definition in the same file.
+                    if(r->xref_file >= 0)
+                        def = xref_find_def(xref, sym, r->xref_file);
+                    if(def < 0 && sym < xref->cap_best)
+                        def = xref->best[sym];
+                }
+            }
+
+            if(def >= 0) {
+                buff_printf(buff, "<a class=\"%sidentifier %sfcallname\" href=\"", prefix, prefix);
+                print_xref_href(buff, xref, &xref->defs[def], r->xref_file, r->xref_depth, prefix);
+                buff_printf(buff, "\">%.*s</a>", len, str + T->off);
+            } else
+                buff_printf(buff, "<span class=\"%sidentifier %sfcallname\">%.*s</span>",
+                    prefix, prefix, len, str + T->off);
+            break;
+        }
+
+        case T_IDENTIFIER:
+        buff_printf(buff, "<span class=\"%sidentifier\">%.*s</span>",
+            prefix, len, str + T->off);
+        break;
+
+        case T_COMMENT:
+        buff_printf(buff, "<span class=\"%scomment\">", prefix);
+        print_escaped(buff, str + T->off, T->len);
+        buff_printf(buff, "</span>");
+        break;
+
+        case T_OPERATOR:
+        buff_printf(buff, "<span class=\"%soperator\">", prefix);
+        print_escaped(buff, str + T->off, T->len);
+        buff_printf(buff, "</span>");
+        break;
+
+        case T_DIRECTIVE:
+        buff_printf(buff, "<span class=\"%sdirective\">", prefix);
+        print_escaped(buff, str + T->off, T->len);
+        buff_printf(buff, "</span>");
+        break;
+
+        case T_TEXT:
+        default:
+        buff_puts(buff, str + T->off, T->len);
+        break;
+    }
+}
+
+#define CHECK_INTERVAL 1024
+
+/* Renders the contents of the current line, or just 
+ * scans it if [emit] is false. Returns false if it 
+ * was the last one, or if the conversion failed.
+ */
+static bool render_line(render_t *r, bool emit)
+{
+    Token T;
+    while(1) {
+        lex_next(&r->lx, &T);
+
+        r->tokens += 1;
+        if(r->max_tokens > 0 && r->tokens > r->max_tokens) {
+            buff_fail(r->buff, c2html_err_token_limit);
+            return false;
+        }
+
+        // Calling back and checking the output for
+        // errors is only done every so often, so that
+        // it doesn't slow down the conversion.
+        if(r->tokens % CHECK_INTERVAL == 0) {
+            if(r->cancel != NULL && r->cancel(r->cancel_data)) {
+                buff_fail(r->buff, c2html_err_cancelled);
+                return false;
+            }
+            if(r->buff != NULL && r->buff->error)
+                return false;
+        }
+
+        if(T.kind == T_DONE)
+            return false;
+
+        if(T.kind == T_NEWL) {
+            r->lineno += 1;
+            return true;
+        }
+
+        if(emit)
+            render_token(r, &T);
+    }
+}
+
+/* Returns the checkpoint closest to [lineno] that 
+ * comes before it, or the start of the input if
+ * there isn't one.
+ */
+static c2html_state_t find_checkpoint(const c2html_state_t *checkpoints, 
+                                      long count, long lineno)
+{
+    c2html_state_t state = { .offset = 0, .lineno = 1 };
+
+    long lo = 0, hi = count;
+    while(lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if(checkpoints[mid].lineno <= lineno)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if(lo > 0)
+        state = checkpoints[lo-1];
+    return state;
+}
+
+char *c2html(const char *str, long len, const char *prefix, 
+             long *output_len, const char **error)
+{
+    c2html_opts_t opts = { .prefix = prefix };
+    return c2html_ex(str, len, &opts, output_len, error);
+}
+
+/* Finds the state to start from, writes the start of
+ * the table and skips the lines that come before the
+ * range of [opts]. Returns false if there are no rows
+ * to render.
+ */
+static bool render_start(render_t *r, buff_t *buff, const char *str, long len, 
+                         const c2html_opts_t *opts)
+{
+    long first_line = opts->first_line;
+    if(first_line < 1)
+        first_line = 1;
+
+    c2html_state_t start = find_checkpoint(opts->checkpoints, 
+                                           opts->num_checkpoints, 
+                                           first_line);
+    render_init(r, buff, str, len, opts, &start);
+    PROBE2(render__start, len, first_line);
+
+    buff_printf(buff,
+        "<div class=\"%scode\">\n"
         "  <div class=\"%scode-inner\">\n"
-        "    <table>\n"
-        "      <tr><td>1</td><td>",
-        prefix, prefix);
+        "    <table>\n",
+        r->prefix, r->prefix);
+
+    bool more = true;
+    while(more && r->lineno < first_line)
+        more = render_line(r, false);
+    PROBE2(emit__start, r->lineno, r->tokens);
+
+    return r->lineno >= first_line
+        && (r->last_line < 0 || r->lineno <= r->last_line);
+}
+
+/* Cached line. The key is its text, without the
+ * newline, and the state of the lexer at its start
+ * along with the settings that change how it's
+ * rendered. The value is the contents of its cell
+ * and the state at the start of the next line.
+ */
+typedef struct lentry_t lentry_t;
+struct lentry_t {
+    lentry_t *prev;  // Of the list of entries, from the most
+    lentry_t *next;  // recently used to the least.
+    lentry_t *chain; // Next entry of the same bucket
+    uint64_t  hash;
+    long      size;
+
+    long depth;
+    bool comment;
+    bool utf8;
+    const c2html_dict_t *dict;
+    const char *prefix;
+    const char *text;
+    long        text_len;
+
+    long depth_after;
+    bool comment_after;
+    long tokens;
+    const char *html;
+    long        html_len;
+};
+
+struct c2html_line_cache_t {
+    lentry_t  **buckets;
+    long        num_buckets; // Power of two
+    lentry_t   *head;
+    lentry_t   *tail;
+    long        max_bytes;
+    c2html_cache_stats_t stats;
+};
+
+c2html_line_cache_t *c2html_line_cache_create(long max_bytes)
+{
+    c2html_line_cache_t *cache = calloc(1, sizeof(c2html_line_cache_t));
+    if(cache == NULL)
+        return NULL;
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+void c2html_line_cache_free(c2html_line_cache_t *cache)
+{
+    if(cache == NULL)
+        return;
+    lentry_t *e = cache->head;
+    while(e) {
+        lentry_t *next = e->next;
+        free(e);
+        e = next;
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+void c2html_line_cache_stats(c2html_line_cache_t *cache, c2html_cache_stats_t *stats)
+{
+    *stats = cache->stats;
+}
+
+static void line_cache_unlink(c2html_line_cache_t *cache, lentry_t *e)
+{
+    if(e->prev) e->prev->next = e->next; else cache->head = e->next;
+    if(e->next) e->next->prev = e->prev; else cache->tail = e->prev;
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void line_cache_push_front(c2html_line_cache_t *cache, lentry_t *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if(cache->head) 
+        cache->head->prev = e;
+    else
+        cache->tail = e;
+    cache->head = e;
+}
+
+static void line_cache_evict(c2html_line_cache_t *cache)
+{
+    lentry_t *e = cache->tail;
+    line_cache_unlink(cache, e);
+
+    lentry_t **p = &cache->buckets[e->hash & (cache->num_buckets - 1)];
+    while(*p != e)
+        p = &(*p)->chain;
+    *p = e->chain;
+
+    cache->stats.bytes -= e->size;
+    cache->stats.entries -= 1;
+    cache->stats.evictions += 1;
+    free(e);
+}
+
+static uint64_t line_hash(const render_t *r, const char *text, long len)
+{
+    uint64_t h = hash_key(text, len, 0);
+    h = hash_key(r->prefix, strlen(r->prefix), h);
+    long fields[] = {
+        r->lx.curly_bracket_depth,
+        r->lx.inside_comment,
+        r->lx.utf8,
+        (long) (uintptr_t) r->lx.dict,
+    };
+    return hash_key((char*) fields, sizeof(fields), h);
+}
+
+static lentry_t *line_cache_get(c2html_line_cache_t *cache, uint64_t hash,
+                                const render_t *r, const char *text, long len)
+{
+    lentry_t *e = NULL;
+    if(cache->num_buckets > 0) {
+        e = cache->buckets[hash & (cache->num_buckets - 1)];
+        while(e && !(e->hash == hash
+                  && e->text_len == len
+                  && e->depth == r->lx.curly_bracket_depth
+                  && e->comment == r->lx.inside_comment
+                  && e->utf8 == r->lx.utf8
+                  && e->dict == r->lx.dict
+                  && !strcmp(e->prefix, r->prefix)
+                  && !memcmp(e->text, text, len)))
+            e = e->chain;
+    }
+
+    if(e == NULL)
+        cache->stats.misses += 1;
+    else {
+        cache->stats.hits += 1;
+        line_cache_unlink(cache, e);
+        line_cache_push_front(cache, e);
+    }
+    return e;
+}
+
+/* Adds a line rendered from the state [entry] to the
+ * cache, with [r] at the start of the next line.
+ * Failing to do so isn't an error.
+ */
+static void line_cache_put(c2html_line_cache_t *cache, uint64_t hash, 
+                           const render_t *r, const c2html_state_t *entry,
+                           const char *text, long len, long tokens,
+                           const char *html, long html_len)
+{
+    long prefix_size = strlen(r->prefix) + 1;
+    long size = sizeof(lentry_t) + prefix_size + len + html_len;
+    if(size > cache->max_bytes)
+        return;
+
+    if(cache->stats.entries >= cache->num_buckets) {
+        long new_num_buckets = cache->num_buckets ? 2 * cache->num_buckets : 1024;
+        lentry_t **new_buckets = calloc(new_num_buckets, sizeof(lentry_t*));
+        if(new_buckets == NULL)
+            return;
+        for(lentry_t *f = cache->head; f; f = f->next) {
+            lentry_t **b = &new_buckets[f->hash & (new_num_buckets - 1)];
+            f->chain = *b;
+            *b = f;
+        }
+        free(cache->buckets);
+        cache->buckets = new_buckets;
+        cache->num_buckets = new_num_buckets;
+    }
+
+    lentry_t *e = malloc(size);
+    if(e == NULL)
+        return;
+
+    char *p = (char*) (e + 1);
+    memcpy(p, r->prefix, prefix_size);
+    e->prefix = p;
+    p += prefix_size;
+
+    memcpy(p, text, len);
+    e->text = p;
+    e->text_len = len;
+    p += len;
+
+    if(html_len > 0)
+        memcpy(p, html, html_len);
+    e->html = p;
+    e->html_len = html_len;
+
+    e->hash    = hash;
+    e->size    = size;
+    e->depth   = entry->depth;
+    e->comment = entry->comment;
+    e->utf8    = r->lx.utf8;
+    e->dict    = r->lx.dict;
+    e->depth_after   = r->lx.curly_bracket_depth;
+    e->comment_after = r->lx.inside_comment;
+    e->tokens  = tokens;
+
+    while(cache->stats.bytes + size > cache->max_bytes)
+        line_cache_evict(cache);
+
+    lentry_t **b = &cache->buckets[hash & (cache->num_buckets - 1)];
+    e->chain = *b;
+    *b = e;
+    line_cache_push_front(cache, e);
+    cache->stats.bytes += size;
+    cache->stats.entries += 1;
+}
+
+/* Like [render_line], but the output is taken from
+ * the line cache if there's one and the line is in
+ * it. Only lines that end with a newline are cached.
+ */
+static bool render_line_cached(render_t *r)
+{
+    lexer_t *lx = &r->lx;
+    c2html_line_cache_t *cache = r->line_cache;
+    if(cache == NULL)
+        return render_line(r, true);
+
+    const char *text = lx->str + lx->i;
+    const char *newline = memchr(text, '\n', lx->len - lx->i);
+    if(newline == NULL)
+        return render_line(r, true);
+    long len = newline - text;
+
+    uint64_t hash = line_hash(r, text, len);
+    lentry_t *e = line_cache_get(cache, hash, r, text, len);
+    if(e != NULL) {
+        buff_puts(r->buff, e->html, e->html_len);
+        lx->i += len + 1;
+        lx->curly_bracket_depth = e->depth_after;
+        lx->inside_comment = e->comment_after;
+        r->lineno += 1;
+
+        // The tokens of the line count as if they 
+        // were scanned, including for the checks
+        // done every so often.
+        long before = r->tokens;
+        r->tokens += e->tokens;
+        if(r->max_tokens > 0 && r->tokens > r->max_tokens) {
+            buff_fail(r->buff, c2html_err_token_limit);
+            return false;
+        }
+        if(before / CHECK_INTERVAL != r->tokens / CHECK_INTERVAL) {
+            if(r->cancel != NULL && r->cancel(r->cancel_data)) {
+                buff_fail(r->buff, c2html_err_cancelled);
+                return false;
+            }
+            if(r->buff->error)
+                return false;
+        }
+        return true;
+    }
+
+    // Rendered on the side to be stored, then copied.
+    c2html_state_t entry = lex_state(lx, r->lineno);
+    long tokens = r->tokens;
+    buff_t *buff = r->buff;
+    r->line_buff.used = 0;
+    r->buff = &r->line_buff;
+    bool more = render_line(r, true);
+    r->buff = buff;
+
+    if(r->line_buff.error != NULL) {
+        buff_fail(buff, r->line_buff.error);
+        buff_init(&r->line_buff);
+        return false;
+    }
+    buff_puts(buff, r->line_buff.data, r->line_buff.used);
+
+    // A token spanning more lines, like an unterminated
+    // string, makes the line longer than its text.
+    if(more && lx->i == entry.offset + len + 1)
+        line_cache_put(cache, hash, r, &entry, text, len, r->tokens - tokens,
+                       r->line_buff.data, r->line_buff.used);
+    return more;
+}
+
+/* Renders the next row. Returns false if it was the
+ * last one of the range, or if the output failed.
+ */
+static bool render_row(render_t *r)
+{
+    buff_t *buff = r->buff;
+    if(r->no_line_numbers)
+        buff_printf(buff, "      <tr><td>");
+    else
+        buff_printf(buff, "      <tr><td>%ld</td><td>", r->lineno);
+    bool more = render_line_cached(r);
+    buff_printf(buff, "</td></tr>\n");
+    return more && !buff->error
+        && (r->last_line < 0 || r->lineno <= r->last_line);
+}
+
+static void render_end(render_t *r)
+{
+    buff_printf(r->buff, 
+            "    </table>\n"
+            "  </div>\n"
+            "</div>\n");
+    PROBE2(render__end, r->tokens, r->buff->written);
+    free(r->line_buff.data);
+    buff_init(&r->line_buff);
+}
+
+/* Renders [str] into [buff], which can either be a
+ * growing buffer or one with a sink.
+ */
+static void render(buff_t *buff, const char *str, long len, 
+                   const c2html_opts_t *opts)
+{
+    render_t r;
+    bool more = render_start(&r, buff, str, len, opts);
+    while(more)
+        more = render_row(&r);
+    render_end(&r);
+}
+
+/* Cached conversion. The key is the input along 
+ * with the options that change the output. Tables 
+ * and dictionaries are compared by address.
+ */
+typedef struct centry_t centry_t;
+struct centry_t {
+    centry_t *prev;  // Of the list of entries, from the most
+    centry_t *next;  // recently used to the least.
+    centry_t *chain; // Next entry of the same bucket
+    uint64_t  hash;
+    int       refs;  // Conversions using [output], plus one
+                     // while the entry is in the cache.
+    long      size;
+
+    const c2html_xref_t *xref;
+    const c2html_dict_t *dict;
+    long first_line;
+    long last_line;
+    bool no_line_numbers;
+    bool utf8;
+    const char *prefix;
+    const char *url;  // NULL if it wasn't provided
+    const char *input;
+    long        input_len;
+    const char *output;
+    long        output_len;
+};
+
+struct c2html_cache_t {
+    mutex_t     lock;
+    centry_t  **buckets;
+    long        num_buckets; // Power of two
+    centry_t   *head;
+    centry_t   *tail;
+    long        max_bytes;
+    c2html_cache_stats_t stats;
+};
+
+c2html_cache_t *c2html_cache_create(long max_bytes)
+{
+    c2html_cache_t *cache = calloc(1, sizeof(c2html_cache_t));
+    if(cache == NULL)
+        return NULL;
+    mutex_init(&cache->lock);
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+void c2html_cache_free(c2html_cache_t *cache)
+{
+    if(cache == NULL)
+        return;
+    centry_t *e = cache->head;
+    while(e) {
+        centry_t *next = e->next;
+        free(e);
+        e = next;
+    }
+    free(cache->buckets);
+    mutex_free(&cache->lock);
+    free(cache);
+}
+
+void c2html_cache_stats(c2html_cache_t *cache, c2html_cache_stats_t *stats)
+{
+    mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    mutex_unlock(&cache->lock);
+}
+
+static uint64_t cache_hash(const char *str, long len, const c2html_opts_t *opts)
+{
+    const char *prefix = opts->prefix ? opts->prefix : "";
+    const char *url = opts->xref ? opts->url : NULL;
+
+    uint64_t h = hash_key(str, len, 0);
+    h = hash_key(prefix, strlen(prefix), h);
+    if(url != NULL)
+        h = hash_key(url, strlen(url), h);
+
+    long fields[] = {
+        (long) (uintptr_t) opts->xref,
+        (long) (uintptr_t) opts->dict,
+        opts->first_line,
+        opts->last_line,
+        opts->no_line_numbers,
+        opts->utf8,
+    };
+    return hash_key((char*) fields, sizeof(fields), h);
+}
+
+static bool cache_match(const centry_t *e, uint64_t hash, const char *str,
+                        long len, const c2html_opts_t *opts)
+{
+    const char *prefix = opts->prefix ? opts->prefix : "";
+    const char *url = opts->xref ? opts->url : NULL;
+
+    return e->hash == hash
+        && e->input_len == len
+        && e->xref == opts->xref
+        && e->dict == opts->dict
+        && e->first_line == opts->first_line
+        && e->last_line == opts->last_line
+        && e->no_line_numbers == opts->no_line_numbers
+        && e->utf8 == opts->utf8
+        && !strcmp(e->prefix, prefix)
+        && (url == NULL ? e->url == NULL : (e->url != NULL && !strcmp(e->url, url)))
+        && !memcmp(e->input, str, len);
+}
+
+static void cache_unlink(c2html_cache_t *cache, centry_t *e)
+{
+    if(e->prev) e->prev->next = e->next; else cache->head = e->next;
+    if(e->next) e->next->prev = e->prev; else cache->tail = e->prev;
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void cache_push_front(c2html_cache_t *cache, centry_t *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if(cache->head) 
+        cache->head->prev = e;
+    else
+        cache->tail = e;
+    cache->head = e;
+}
+
+/* Removes the least recently used entry. It's only
+ * freed once no one is using it anymore.
+ */
+static void cache_evict(c2html_cache_t *cache)
+{
+    centry_t *e = cache->tail;
+    cache_unlink(cache, e);
+
+    centry_t **p = &cache->buckets[e->hash & (cache->num_buckets - 1)];
+    while(*p != e)
+        p = &(*p)->chain;
+    *p = e->chain;
+
+    cache->stats.bytes -= e->size;
+    cache->stats.entries -= 1;
+    cache->stats.evictions += 1;
+
+    e->refs -= 1;
+    if(e->refs == 0)
+        free(e);
+}
+
+/* Returns the entry with the given key, or NULL.
+ * The entry stays valid until [cache_release] is
+ * called on it, even if it's evicted.
+ */
+static centry_t *cache_get(c2html_cache_t *cache, uint64_t hash, 
+                           const char *str, long len, 
+                           const c2html_opts_t *opts)
+{
+    mutex_lock(&cache->lock);
+
+    centry_t *e = NULL;
+    if(cache->num_buckets > 0) {
+        e = cache->buckets[hash & (cache->num_buckets - 1)];
+        while(e && !cache_match(e, hash, str, len, opts))
+            e = e->chain;
+    }
+
+    if(e == NULL)
+        cache->stats.misses += 1;
+    else {
+        cache->stats.hits += 1;
+        cache_unlink(cache, e);
+        cache_push_front(cache, e);
+        e->refs += 1;
+    }
+
+    mutex_unlock(&cache->lock);
+    return e;
+}
+
+static void cache_release(c2html_cache_t *cache, centry_t *e)
+{
+    mutex_lock(&cache->lock);
+    e->refs -= 1;
+    bool unused = (e->refs == 0);
+    mutex_unlock(&cache->lock);
+
+    if(unused)
+        free(e);
+}
+
+/* Adds a copy of the conversion to the cache. Failing
+ * to do so isn't an error, since the output was already
+ * produced.
+ */
+static void cache_put(c2html_cache_t *cache, uint64_t hash, 
+                      const char *str, long len, 
+                      const c2html_opts_t *opts, 
+                      const char *output, long output_len)
+{
+    const char *prefix = opts->prefix ? opts->prefix : "";
+    const char *url = opts->xref ? opts->url : NULL;
+
+    long prefix_size = strlen(prefix) + 1;
+    long url_size = url ? (long) strlen(url) + 1 : 0;
+    long size = sizeof(centry_t) + prefix_size + url_size + len + output_len;
+    if(size > cache->max_bytes)
+        return;
+
+    centry_t *e = malloc(size);
+    if(e == NULL)
+        return;
+
+    char *p = (char*) (e + 1);
+    memcpy(p, prefix, prefix_size);
+    e->prefix = p;
+    p += prefix_size;
+
+    e->url = NULL;
+    if(url) {
+        memcpy(p, url, url_size);
+        e->url = p;
+        p += url_size;
+    }
+
+    memcpy(p, str, len);
+    e->input = p;
+    e->input_len = len;
+    p += len;
+
+    memcpy(p, output, output_len);
+    e->output = p;
+    e->output_len = output_len;
+
+    e->hash = hash;
+    e->refs = 1;
+    e->size = size;
+    e->xref = opts->xref;
+    e->dict = opts->dict;
+    e->first_line = opts->first_line;
+    e->last_line  = opts->last_line;
+    e->no_line_numbers = opts->no_line_numbers;
+    e->utf8 = opts->utf8;
+
+    mutex_lock(&cache->lock);
+
+    // Another thread may have converted the same
+    // input in the meantime.
+    if(cache->num_buckets > 0) {
+        centry_t *f = cache->buckets[hash & (cache->num_buckets - 1)];
+        while(f && !cache_match(f, hash, str, len, opts))
+            f = f->chain;
+        if(f != NULL) {
+            mutex_unlock(&cache->lock);
+            free(e);
+            return;
+        }
+    }
+
+    if(cache->stats.entries >= cache->num_buckets) {
+        long new_num_buckets = cache->num_buckets ? 2 * cache->num_buckets : 64;
+        centry_t **new_buckets = calloc(new_num_buckets, sizeof(centry_t*));
+        if(new_buckets == NULL) {
+            mutex_unlock(&cache->lock);
+            free(e);
+            return;
+        }
+        for(centry_t *f = cache->head; f; f = f->next) {
+            centry_t **b = &new_buckets[f->hash & (new_num_buckets - 1)];
+            f->chain = *b;
+            *b = f;
+        }
+        free(cache->buckets);
+        cache->buckets = new_buckets;
+        cache->num_buckets = new_num_buckets;
+    }
+
+    while(cache->stats.bytes + size > cache->max_bytes)
+        cache_evict(cache);
+
+    centry_t **b = &cache->buckets[hash & (cache->num_buckets - 1)];
+    e->chain = *b;
+    *b = e;
+    cache_push_front(cache, e);
+    cache->stats.bytes += size;
+    cache->stats.entries += 1;
+
+    mutex_unlock(&cache->lock);
+}
+
+char *c2html_ex(const char *str, long len, const c2html_opts_t *opts,
+                long *output_len, const char **error)
+{
+    if(str == NULL)
+        str = "";
+
+    if(len < 0)
+        len = strlen(str);
+
+    c2html_opts_t default_opts = {0};
+    if(opts == NULL)
+        opts = &default_opts;
+
+    if(opts->max_input > 0 && len > opts->max_input) {
+        if(error != NULL)
+            *error = c2html_err_input_limit;
+        return NULL;
+    }
+
+    c2html_cache_t *cache = opts->cache;
+    uint64_t hash = 0;
+    if(cache != NULL) {
+        hash = cache_hash(str, len, opts);
+        centry_t *e = cache_get(cache, hash, str, len, opts);
+        if(e != NULL && opts->max_output > 0 && e->output_len > opts->max_output) {
+            if(error != NULL)
+                *error = c2html_err_output_limit;
+            cache_release(cache, e);
+            return NULL;
+        }
+        if(e != NULL) {
+            char *res = malloc(e->output_len + 1);
+            if(res != NULL) {
+                memcpy(res, e->output, e->output_len);
+                res[e->output_len] = '\0';
+                if(output_len != NULL)
+                    *output_len = e->output_len;
+            } else if(error != NULL)
+                *error = "Out of memory";
+            cache_release(cache, e);
+            return res;
+        }
+    }
+
+    buff_t buff;
+    buff_init(&buff);
+
+    render(&buff, str, len, opts);
+
+    char *res;
+    if(buff.error == NULL) {
+        buff.data[buff.used] = '\0';
+        res = buff.data;
+        if(cache != NULL)
+            cache_put(cache, hash, str, len, opts, buff.data, buff.used);
+    } else {
+        if(error != NULL)
+            *error = buff.error;
+        res = NULL;
+    }
+
+    if(output_len != NULL)
+        *output_len = buff.used;
+
+    return res;
+}
+
+int c2html_write(const char *str, long len, const c2html_opts_t *opts,
+                 c2html_sink_t sink, void *data, const char **error)
+{
+    if(str == NULL)
+        str = "";
+
+    if(len < 0)
+        len = strlen(str);
+
+    c2html_opts_t default_opts = {0};
+    if(opts == NULL)
+        opts = &default_opts;
+
+    if(opts->max_input > 0 && len > opts->max_input) {
+        if(error != NULL)
+            *error = c2html_err_input_limit;
+        return -1;
+    }
+
+    // When caching, the output is converted as a whole
+    // and then passed to the sink like a cached one.
+    if(opts->cache != NULL) {
+
+        c2html_cache_t *cache = opts->cache;
+        uint64_t hash = cache_hash(str, len, opts);
+
+        centry_t *e = cache_get(cache, hash, str, len, opts);
+        if(e != NULL && opts->max_output > 0 && e->output_len > opts->max_output) {
+            if(error != NULL)
+                *error = c2html_err_output_limit;
+            cache_release(cache, e);
+            return -1;
+        }
+
+        const char *output;
+        long output_len;
+        char *converted = NULL;
+        if(e != NULL) {
+            output = e->output;
+            output_len = e->output_len;
+        } else {
+            const char *err;
+            c2html_opts_t uncached = *opts;
+            uncached.cache = NULL;
+            converted = c2html_ex(str, len, &uncached, &output_len, &err);
+            if(converted == NULL) {
+                if(error != NULL)
+                    *error = err;
+                return -1;
+            }
+            cache_put(cache, hash, str, len, opts, converted, output_len);
+            output = converted;
+        }
+
+        int res = 0;
+        if(output_len > 0 && sink(data, output, output_len)) {
+            if(error != NULL)
+                *error = "Output interrupted";
+            res = -1;
+        }
+
+        if(e != NULL)
+            cache_release(cache, e);
+        free(converted);
+        return res;
+    }
+
+    char staging[4096];
+    buff_t buff;
+    buff_init_sink(&buff, staging, sizeof(staging), sink, data);
+
+    render(&buff, str, len, opts);
+    buff_flush(&buff);
+
+    if(buff.error != NULL) {
+        if(error != NULL)
+            *error = buff.error;
+        return -1;
+    }
+    return 0;
+}
+
+long c2html_feed(c2html_state_t *state, const char *str, long len, bool final,
+                 const c2html_opts_t *opts, c2html_sink_t sink, void *data,
+                 const char **error)
+{
+    if(str == NULL)
+        str = "";
+
+    if(len < 0)
+        len = strlen(str);
+
+    c2html_opts_t default_opts = {0};
+    if(opts == NULL)
+        opts = &default_opts;
+
+    if(opts->max_input > 0 && len > opts->max_input) {
+        if(error != NULL)
+            *error = c2html_err_input_limit;
+        return -1;
+    }
+
+    bool first = (state->lineno == 0);
+
+    // The lexer works on [str], so the offset is
+    // relative to it.
+    c2html_state_t start = *state;
+    start.offset = 0;
+    if(first)
+        start.lineno = 1;
+
+    buff_t buff;
+    buff_init(&buff);
+
+    render_t r;
+    render_init(&r, &buff, str, len, opts, &start);
+    r.base = state->offset;
+    PROBE2(feed__start, len, start.lineno);
+
+    // A character may be cut at the end of [str], but
+    // the line it's in isn't committed anyway.
+    if(opts->utf8 && !final && !r.lx.utf8) {
+        long end = len;
+        while(end > 0 && str[end-1] != '\n')
+            end -= 1;
+        r.lx.utf8 = utf8_valid(str, end);
+    }
+
+    if(first)
+        buff_printf(&buff,
+            "<div class=\"%scode\">\n"
+            "  <div class=\"%scode-inner\">\n"
+            "    <table>\n",
+            r.prefix, r.prefix);
+
+    // Only complete lines are output. The output of
+    // the last line is dropped if its end isn't in
+    // [str], and it's converted again by the next
+    // call.
+    long committed = buff.used;
+    c2html_state_t next = start;
+    
+    while(!buff.error) {
+
+        if(opts->no_line_numbers)
+            buff_printf(&buff, "      <tr><td>");
+        else
+            buff_printf(&buff, "      <tr><td>%ld</td><td>", r.lineno);
+
+        bool more = render_line_cached(&r);
+        if(!more && !final)
+            break;
+
+        buff_printf(&buff, "</td></tr>\n");
+        next = lex_state(&r.lx, r.lineno);
+
+        if(!more) {
+            buff_printf(&buff, 
+                    "    </table>\n"
+                    "  </div>\n"
+                    "</div>\n");
+        }
+        committed = buff.used;
+
+        if(!more)
+            break;
+    }
+
+    if(buff.error == NULL && committed > 0 && sink(data, buff.data, committed))
+        buff_fail(&buff, "Output interrupted");
+
+    if(buff.error != NULL) {
+        if(error != NULL)
+            *error = buff.error;
+        free(r.line_buff.data);
+        return -1;
+    }
+    free(buff.data);
+    free(r.line_buff.data);
+
+    long consumed = next.offset;
+    PROBE2(feed__end, consumed, r.tokens);
+    *state = next;
+    state->offset = r.base + consumed;
+    return consumed;
+}
+
+typedef enum {
+    ITER_ROWS,
+    ITER_END,
+    ITER_DONE,
+} iter_stage_t;
+
+struct c2html_iter_t {
+    render_t     r;
+    buff_t       buff;  // Output of the current row
+    long         sent;  // Bytes of [buff] already read
+    iter_stage_t stage; // What comes after [buff]
+};
+
+c2html_iter_t *c2html_iter_create(const char *str, long len, 
+                                  const c2html_opts_t *opts,
+                                  const char **error)
+{
+    if(str == NULL)
+        str = "";
+
+    if(len < 0)
+        len = strlen(str);
+
+    c2html_opts_t default_opts = {0};
+    if(opts == NULL)
+        opts = &default_opts;
+
+    if(opts->max_input > 0 && len > opts->max_input) {
+        if(error != NULL)
+            *error = c2html_err_input_limit;
+        return NULL;
+    }
+
+    c2html_iter_t *it = malloc(sizeof(c2html_iter_t));
+    if(it == NULL) {
+        if(error != NULL)
+            *error = "Out of memory";
+        return NULL;
+    }
+
+    // The start of the table is the first output.
+    buff_init(&it->buff);
+    bool rows = render_start(&it->r, &it->buff, str, len, opts);
+    it->sent  = 0;
+    it->stage = rows ? ITER_ROWS : ITER_END;
+
+    if(it->buff.error != NULL) {
+        if(error != NULL)
+            *error = it->buff.error;
+        c2html_iter_free(it);
+        return NULL;
+    }
+    return it;
+}
+
+void c2html_iter_free(c2html_iter_t *it)
+{
+    if(it == NULL)
+        return;
+    free(it->buff.data);
+    free(it->r.line_buff.data);
+    free(it);
+}
+
+long c2html_iter_read(c2html_iter_t *it, char *buf, long cap, 
+                      const char **error)
+{
+    long n = 0;
+    while(n < cap) {
+
+        if(it->buff.error != NULL) {
+            if(error != NULL)
+                *error = it->buff.error;
+            return -1;
+        }
+
+        long left = it->buff.used - it->sent;
+        if(left > 0) {
+            if(left > cap - n)
+                left = cap - n;
+            memcpy(buf + n, it->buff.data + it->sent, left);
+            it->sent += left;
+            n += left;
+            continue;
+        }
+
+        if(it->stage == ITER_DONE)
+            break;
+
+        // Everything was read, so the buffer is 
+        // reused for what comes next.
+        it->buff.used = 0;
+        it->sent = 0;
+
+        if(it->stage == ITER_ROWS) {
+            if(!render_row(&it->r))
+                it->stage = ITER_END;
+        } else {
+            render_end(&it->r);
+            it->stage = ITER_DONE;
+        }
+    }
+    return n;
+}
+
+c2html_state_t *c2html_checkpoints(const char *str, long len, long every, 
+                                   long *count, const char **error)
+{
+    if(str == NULL)
+        str = "";
+
+    if(len < 0)
+        len = strlen(str);
+
+    if(every < 1)
+        every = 1;
+
+    c2html_state_t *array = NULL;
+    int num = 0, capacity = 0;
+
+    c2html_opts_t opts = {0};
+    c2html_state_t start = { .offset = 0, .lineno = 1 };
+
+    render_t r;
+    render_init(&r, NULL, str, len, &opts, &start);
+
+    bool more;
+    do {
+        if((r.lineno - 1) % every == 0) {
+            if(!reserve(&array, &capacity, num, sizeof(c2html_state_t))) {
+                if(error != NULL)
+                    *error = "Out of memory";
+                free(array);
+                return NULL;
+            }
+            array[num++] = lex_state(&r.lx, r.lineno);
+        }
+        more = render_line(&r, false);
+    } while(more);
+
+    if(count != NULL)
+        *count = num;
+    return array;
+}
 
-    for(int i = 0; tokens[i].kind != T_DONE; i += 1) {
+/* Line of an input of [c2html_diff], along with the
+ * state of the lexer at its start, which decides how
+ * it's rendered as much as its contents.
+ */
+typedef struct {
+    c2html_state_t state;
+    long     len;  // Without the newline
+    uint64_t hash;
+} dline_t;
+
+/* Scans the input of [r] and returns its lines, or
+ * NULL if the scan failed, in which case the buffer
+ * of [r] has the error.
+ */
+static dline_t *diff_lines(render_t *r, int *count)
+{
+    buff_t *buff = r->buff;
+    const char *str = r->lx.str;
+    long len = r->lx.len;
 
-        switch(tokens[i].kind) {
+    dline_t *lines = NULL;
+    int num = 0, capacity = 0;
 
-            case T_DONE:
-            assert(0);
+    bool more;
+    do {
+        if(!reserve(&lines, &capacity, num, sizeof(dline_t))) {
+            buff_fail(buff, "Out of memory");
             break;
+        }
+        lines[num].state = lex_state(&r->lx, r->lineno);
+        more = render_line(r, false);
+        num += 1;
+    } while(more);
+
+    if(buff->error != NULL) {
+        free(lines);
+        return NULL;
+    }
+
+    for(int i = 0; i < num; i += 1) {
+        dline_t *l = &lines[i];
+        long end = (i+1 < num) ? lines[i+1].state.offset - 1 : len;
+        long state[] = { l->state.depth, l->state.comment };
+        l->len  = end - l->state.offset;
+        l->hash = hash_key(str + l->state.offset, l->len, 0);
+        l->hash = hash_key((char*) state, sizeof(state), l->hash);
+    }
+
+    *count = num;
+    return lines;
+}
+
+typedef struct {
+    const char    *a_str;
+    const dline_t *a;
+    const char    *b_str;
+    const dline_t *b;
+} dpair_t;
+
+static bool dline_equal(const dpair_t *p, int i, int j)
+{
+    const dline_t *x = &p->a[i];
+    const dline_t *y = &p->b[j];
+    return x->hash == y->hash
+        && x->len  == y->len
+        && x->state.depth   == y->state.depth
+        && x->state.comment == y->state.comment
+        && !memcmp(p->a_str + x->state.offset, p->b_str + y->state.offset, x->len);
+}
+
+typedef enum {
+    DIFF_SAME = '=',
+    DIFF_DEL  = '-',
+    DIFF_ADD  = '+',
+} dop_t;
+
+/* Beyond this number of changes, the lines between
+ * the first and the last change are all considered
+ * changed instead of looking for a shorter script.
+ */
+#define MAX_EDITS 1024
+
+/* Writes in [ops] the edit script from the lines
+ * [a_off, a_off+n) to [b_off, b_off+m), using the
+ * greedy algorithm by Myers. The furthest points
+ * reached after each number of edits are kept to
+ * recover the script, which takes O(D^2) memory.
+ * Returns the number of operations, or -1 if out
+ * of memory.
+ */
+static long diff_middle(const dpair_t *p, int a_off, int n, int b_off, int m,
+                        char *ops)
+{
+    int max_d = n + m;
+    if(max_d > MAX_EDITS)
+        max_d = MAX_EDITS;
+
+    // V[k] is the furthest x reached on diagonal k, and
+    // trace holds V[-d..d] after [d] edits at offset d^2.
+    int *v = malloc((2 * (long) max_d + 3) * sizeof(int));
+    int *trace = malloc(((long) max_d + 1) * (max_d + 1) * sizeof(int));
+    if(v == NULL || trace == NULL) {
+        free(v);
+        free(trace);
+        return -1;
+    }
+    int *V = v + max_d + 1;
+    V[1] = 0;
+
+    int found = -1;
+    for(int d = 0; d <= max_d && found < 0; d += 1) {
+        for(int k = -d; k <= d; k += 2) {
+            int x;
+            if(k == -d || (k != d && V[k-1] < V[k+1]))
+                x = V[k+1];
+            else
+                x = V[k-1] + 1;
+            int y = x - k;
+            while(x < n && y < m && dline_equal(p, a_off + x, b_off + y))
+                x += 1, y += 1;
+            V[k] = x;
+            if(x >= n && y >= m)
+                found = d;
+        }
+        memcpy(trace + (long) d * d, V - d, (2 * d + 1) * sizeof(int));
+    }
 
-            case T_NEWL:
-            for(int j = 0; j < tokens[i].len; j += 1) {
-                lineno += 1;
-                buff_printf(&buff, "</td></tr>\n      <tr><td>%d</td><td>", lineno);
+    long count = n + m;
+    if(found < 0) {
+        for(int i = 0; i < n; i += 1)
+            ops[i] = DIFF_DEL;
+        for(int j = 0; j < m; j += 1)
+            ops[n + j] = DIFF_ADD;
+    } else {
+        // Walk back from the end, writing the
+        // operations from the last one.
+        long pos = count;
+        int x = n, y = m;
+        for(int d = found; d > 0; d -= 1) {
+            const int *P = trace + (long) (d - 1) * (d - 1) + (d - 1);
+            int k = x - y;
+            int prev_k;
+            if(k == -d || (k != d && P[k-1] < P[k+1]))
+                prev_k = k + 1;
+            else
+                prev_k = k - 1;
+            int prev_x = P[prev_k];
+            int prev_y = prev_x - prev_k;
+            while(x > prev_x && y > prev_y) {
+                ops[--pos] = DIFF_SAME;
+                x -= 1, y -= 1;
             }
-            break;
+            ops[--pos] = (x == prev_x) ? DIFF_ADD : DIFF_DEL;
+            x = prev_x;
+            y = prev_y;
+        }
+        while(x > 0) {
+            ops[--pos] = DIFF_SAME;
+            x -= 1;
+        }
+        count -= pos;
+        memmove(ops, ops + pos, count);
+    }
 
-            case T_SPACE:
-            buff_puts(&buff, str + tokens[i].off, tokens[i].len);
-            break;
+    free(v);
+    free(trace);
+    return count;
+}
 
-            case T_TAB:
-            for(int j = 0; j < tokens[i].len; j += 1)
-                buff_printf(&buff, "    ");
-            break;
+/* Moves [r] to the start of a line, keeping the
+ * settings of its lexer so that the input isn't
+ * validated again.
+ */
+static void render_seek(render_t *r, const c2html_state_t *state)
+{
+    const c2html_dict_t *dict = r->lx.dict;
+    bool utf8 = r->lx.utf8;
+    lex_init(&r->lx, r->lx.str, r->lx.len, state);
+    r->lx.dict = dict;
+    r->lx.utf8 = utf8;
+    r->lineno = state->lineno;
+}
 
-            case T_KWORD:
-            buff_printf(&buff, "<span class=\"%skword %skword-%.*s\">%.*s</span>",
-                prefix, prefix,
-                tokens[i].len, str + tokens[i].off,
-                tokens[i].len, str + tokens[i].off);
-            break;
+/* Renders the line at [state], which was already
+ * scanned, so that its tokens aren't counted again
+ * against [max_tokens].
+ */
+static void render_again(render_t *r, const c2html_state_t *state)
+{
+    long tokens = r->tokens;
+    long max_tokens = r->max_tokens;
+    r->max_tokens = 0;
+    render_seek(r, state);
+    render_line(r, true);
+    r->tokens = tokens;
+    r->max_tokens = max_tokens;
+}
 
-            case T_VSTR:
-            buff_printf(&buff, "<span class=\"%sval-str\">", prefix);
-            print_escaped(&buff, str + tokens[i].off, tokens[i].len);
-            buff_printf(&buff, "</span>");
-            break;
+/* Renders the row of [line], with the line numbers
+ * in the old and new input, or 0 if it's not in one.
+ */
+static void diff_row(render_t *r, const dline_t *line, dop_t op,
+                     long old_no, long new_no)
+{
+    buff_t *buff = r->buff;
+    const char *prefix = r->prefix;
 
-            case T_VCHAR:
-            buff_printf(&buff, "<span class=\"%sval-char\">", prefix);
-            print_escaped(&buff, str + tokens[i].off, tokens[i].len);
-            buff_printf(&buff, "</span>");
-            break;
+    switch(op) {
+        case DIFF_DEL: buff_printf(buff, "      <tr class=\"%sdel\">", prefix); break;
+        case DIFF_ADD: buff_printf(buff, "      <tr class=\"%sadd\">", prefix); break;
+        default:       buff_printf(buff, "      <tr>"); break;
+    }
 
-            case T_VINT:
-            buff_printf(&buff, "<span class=\"%sval-int\">%.*s</span>",
-                prefix, tokens[i].len, str + tokens[i].off);
-            break;
+    if(old_no > 0)
+        buff_printf(buff, "<td>%ld</td>", old_no);
+    else
+        buff_printf(buff, "<td></td>");
 
-            case T_VFLT:
-            buff_printf(&buff, "<span class=\"%sval-flt\">%.*s</span>",
-                prefix, tokens[i].len, str + tokens[i].off);
-            break;
+    if(new_no > 0)
+        buff_printf(buff, "<td>%ld</td><td>", new_no);
+    else
+        buff_printf(buff, "<td></td><td>");
 
-            case T_FDECLNAME:
-            buff_printf(&buff, "<span class=\"%sidentifier %sfdeclname\">%.*s</span>",
-                prefix, prefix, tokens[i].len, str + tokens[i].off);
-            break;
+    render_again(r, &line->state);
+    buff_printf(buff, "</td></tr>\n");
+}
+
+int c2html_diff(const char *old_str, long old_len, 
+                const char *new_str, long new_len, long context,
+                const c2html_opts_t *opts, c2html_sink_t sink, void *data, 
+                const char **error)
+{
+    if(old_str == NULL)
+        old_str = "";
+    if(new_str == NULL)
+        new_str = "";
+
+    if(old_len < 0)
+        old_len = strlen(old_str);
+    if(new_len < 0)
+        new_len = strlen(new_str);
+
+    if(context < 0)
+        context = 0;
+
+    c2html_opts_t diff_opts = {0};
+    if(opts != NULL)
+        diff_opts = *opts;
+
+    if(diff_opts.max_input > 0 && (old_len > diff_opts.max_input 
+                                || new_len > diff_opts.max_input)) {
+        if(error != NULL)
+            *error = c2html_err_input_limit;
+        return -1;
+    }
+
+    // Options that don't apply to diffs.
+    diff_opts.xref  = NULL;
+    diff_opts.cache = NULL;
+    diff_opts.first_line = 0;
+    diff_opts.last_line  = 0;
+    diff_opts.checkpoints = NULL;
+    diff_opts.num_checkpoints = 0;
 
-            case T_FCALLNAME:
-            buff_printf(&buff, "<span class=\"%sidentifier %sfcallname\">%.*s</span>",
-                prefix, prefix, tokens[i].len, str + tokens[i].off);
+    char staging[4096];
+    buff_t buff;
+    buff_init_sink(&buff, staging, sizeof(staging), sink, data);
+
+    c2html_state_t start = { .offset = 0, .lineno = 1 };
+    render_t ra, rb;
+    render_init(&ra, &buff, old_str, old_len, &diff_opts, &start);
+    render_init(&rb, &buff, new_str, new_len, &diff_opts, &start);
+    PROBE2(render__start, old_len + new_len, 0);
+
+    int n = 0, m = 0;
+    dline_t *a = diff_lines(&ra, &n);
+    dline_t *b = NULL;
+    char *ops  = NULL;
+    if(a != NULL)
+        b = diff_lines(&rb, &m);
+    if(b != NULL) {
+        ops = malloc(n + m);
+        if(ops == NULL)
+            buff_fail(&buff, "Out of memory");
+    }
+    if(ops == NULL)
+        goto done;
+
+    dpair_t p = { old_str, a, new_str, b };
+
+    // Only the lines between the first and the last
+    // change go through the diff.
+    int pre = 0;
+    while(pre < n && pre < m && dline_equal(&p, pre, pre))
+        pre += 1;
+
+    int suf = 0;
+    while(suf < n - pre && suf < m - pre && dline_equal(&p, n-1-suf, m-1-suf))
+        suf += 1;
+
+    memset(ops, DIFF_SAME, pre);
+    long mid = diff_middle(&p, pre, n - pre - suf, pre, m - pre - suf, ops + pre);
+    if(mid < 0) {
+        buff_fail(&buff, "Out of memory");
+        goto done;
+    }
+    memset(ops + pre + mid, DIFF_SAME, suf);
+    long total = pre + mid + suf;
+
+    const char *prefix = ra.prefix;
+    buff_printf(&buff,
+        "<div class=\"%scode %sdiff\">\n"
+        "  <div class=\"%scode-inner\">\n"
+        "    <table>\n",
+        prefix, prefix, prefix);
+
+    // Lines of the old and new input at [k]
+    long i = 0, j = 0;
+    long k = 0;
+    while(k < total && !buff.error) {
+
+        long change = k;
+        while(change < total && ops[change] == DIFF_SAME)
+            change += 1;
+        if(change == total)
             break;
 
-            case T_IDENTIFIER:
-            buff_printf(&buff, "<span class=\"%sidentifier\">%.*s</span>",
-                prefix, tokens[i].len, str + tokens[i].off);
+        // Changes closer than twice the context
+        // go in the same hunk.
+        long end = change;
+        while(1) {
+            while(end < total && ops[end] != DIFF_SAME)
+                end += 1;
+            long next = end;
+            while(next < total && ops[next] == DIFF_SAME)
+                next += 1;
+            if(next == total || next - end > 2 * context) {
+                end = (total - end < context) ? total : end + context;
+                break;
+            }
+            end = next;
+        }
+
+        long hunk = (change - k < context) ? k : change - context;
+        for(; k < hunk; k += 1)
+            i += 1, j += 1;
+
+        long old_count = 0, new_count = 0;
+        for(long h = hunk; h < end; h += 1) {
+            if(ops[h] != DIFF_ADD) old_count += 1;
+            if(ops[h] != DIFF_DEL) new_count += 1;
+        }
+        buff_printf(&buff, "      <tr class=\"%shunk\"><td colspan=\"3\">"
+                           "@@ -%ld,%ld +%ld,%ld @@</td></tr>\n",
+                    prefix, 
+                    old_count > 0 ? i+1 : i, old_count, 
+                    new_count > 0 ? j+1 : j, new_count);
+
+        for(; k < end && !buff.error; k += 1) {
+            switch(ops[k]) {
+                case DIFF_DEL:
+                diff_row(&ra, &a[i], DIFF_DEL, i+1, 0);
+                i += 1;
+                break;
+
+                case DIFF_ADD:
+                diff_row(&rb, &b[j], DIFF_ADD, 0, j+1);
+                j += 1;
+                break;
+
+                default:
+                diff_row(&rb, &b[j], DIFF_SAME, i+1, j+1);
+                i += 1, j += 1;
+                break;
+            }
+        }
+    }
+
+    render_end(&ra);
+    buff_flush(&buff);
+
+done:
+    free(a);
+    free(b);
+    free(ops);
+    if(buff.error != NULL) {
+        if(error != NULL)
+            *error = buff.error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns the offset of the first occurrence of [pat]
+ * in [str] at or after [i], or [len] if there isn't
+ * one. Only the positions where both the first and
+ * the last byte of [pat] match are compared, which
+ * SSE2 finds 16 at a time.
+ */
+static long find_pattern(const char *str, long len, long i,
+                         const char *pat, long pat_len)
+{
+    long last = len - pat_len; // Last position it can start at
+
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(pat[0]);
+    __m128i final = _mm_set1_epi8(pat[pat_len-1]);
+    for(; i + 15 <= last; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (str + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (str + i + pat_len - 1));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                   _mm_cmpeq_epi8(b, final)));
+        for(int j = 0; mask != 0; j += 1, mask >>= 1)
+            if((mask & 1) && !memcmp(str + i + j, pat, pat_len))
+                return i + j;
+    }
+#endif
+
+    while(i <= last) {
+        const char *p = memchr(str + i, pat[0], last - i + 1);
+        if(p == NULL)
             break;
+        i = p - str;
+        if(!memcmp(p, pat, pat_len))
+            return i;
+        i += 1;
+    }
+    return len;
+}
 
-            case T_COMMENT:
-            {
-                long j = tokens[i].off;
-                long end = j + tokens[i].len;
-                while(1) {
+/* Renders the line starting at [state] for [c2html_grep],
+ * preceded by an empty row if it doesn't follow the last
+ * rendered one, which is [*last_row].
+ */
+static void grep_row(render_t *r, const c2html_state_t *state, bool match,
+                     long *last_row)
+{
+    buff_t *buff = r->buff;
+    const char *prefix = r->prefix;
+
+    if(*last_row > 0 && state->lineno > *last_row + 1) {
+        if(r->no_line_numbers)
+            buff_printf(buff, "      <tr class=\"%sgap\"><td></td></tr>\n", prefix);
+        else
+            buff_printf(buff, "      <tr class=\"%sgap\"><td colspan=\"2\"></td></tr>\n", prefix);
+    }
+    *last_row = state->lineno;
 
-                    long line_off = j;
-                    while(j < end && str[j] != '\n')
-                        j += 1;
-                    long line_len = j - line_off;
+    if(match)
+        buff_printf(buff, "      <tr class=\"%smatch\">", prefix);
+    else
+        buff_printf(buff, "      <tr>");
 
-                    buff_printf(&buff, "<span class=\"%scomment\">", prefix);
-                    print_escaped(&buff, str + line_off, line_len);
-                    buff_printf(&buff, "</span>");
+    if(r->no_line_numbers)
+        buff_printf(buff, "<td>");
+    else
+        buff_printf(buff, "<td>%ld</td><td>", state->lineno);
 
-                    if(j == end)
-                        break;
+    render_again(r, state);
+    buff_printf(buff, "</td></tr>\n");
+}
+
+int c2html_grep(const char *str, long len, const char *pattern, long pattern_len,
+                long context, const c2html_opts_t *opts, 
+                c2html_sink_t sink, void *data, const char **error)
+{
+    if(str == NULL)
+        str = "";
+
+    if(len < 0)
+        len = strlen(str);
+
+    if(pattern == NULL)
+        pattern = "";
+
+    if(pattern_len < 0)
+        pattern_len = strlen(pattern);
+
+    if(pattern_len == 0) {
+        if(error != NULL)
+            *error = "Empty pattern";
+        return -1;
+    }
+
+    if(context < 0)
+        context = 0;
+
+    c2html_opts_t grep_opts = {0};
+    if(opts != NULL)
+        grep_opts = *opts;
+
+    if(grep_opts.max_input > 0 && len > grep_opts.max_input) {
+        if(error != NULL)
+            *error = c2html_err_input_limit;
+        return -1;
+    }
+
+    // Options that don't apply.
+    grep_opts.cache = NULL;
+    grep_opts.first_line = 0;
+    grep_opts.last_line  = 0;
+
+    char staging[4096];
+    buff_t buff;
+    buff_init_sink(&buff, staging, sizeof(staging), sink, data);
+
+    // States of the last [context] lines that were
+    // scanned but not rendered, from [ring_head].
+    c2html_state_t *ring = NULL;
+    long ring_head = 0;
+    long ring_used = 0;
+    if(context > 0) {
+        ring = malloc(context * sizeof(c2html_state_t));
+        if(ring == NULL) {
+            if(error != NULL)
+                *error = "Out of memory";
+            return -1;
+        }
+    }
+
+    c2html_state_t start = { .offset = 0, .lineno = 1 };
+    render_t r;
+    render_init(&r, &buff, str, len, &grep_opts, &start);
+    PROBE2(render__start, len, 0);
 
-                    j += 1; // Skip the '\n'.
+    buff_printf(&buff,
+        "<div class=\"%scode %sgrep\">\n"
+        "  <div class=\"%scode-inner\">\n"
+        "    <table>\n",
+        r.prefix, r.prefix, r.prefix);
+
+    long hit = find_pattern(str, len, 0, pattern, pattern_len);
+    long after    = 0; // Rows of context left to render
+    long last_row = 0;
+
+    bool more = true;
+    while(more && !buff.error && (hit < len || after > 0)) {
+
+        c2html_state_t state = lex_state(&r.lx, r.lineno);
+
+        // Far from the next hit, the lines in between
+        // don't need to be scanned if there's a
+        // checkpoint closer to it. The line of the hit
+        // comes after the last checkpoint before it, so
+        // [context] lines before that one are enough.
+        const c2html_state_t *checkpoints = grep_opts.checkpoints;
+        long num_checkpoints = grep_opts.num_checkpoints;
+        if(after == 0 && num_checkpoints > 0) {
+
+            long lo = 0, hi = num_checkpoints;
+            while(lo < hi) {
+                long mid = lo + (hi - lo) / 2;
+                if(checkpoints[mid].offset <= hit)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
 
-                    lineno += 1;
-                    buff_printf(&buff, "</td></tr>\n      <tr><td>%d</td><td>", lineno);
+            if(lo > 0) {
+                c2html_state_t cp = find_checkpoint(checkpoints, num_checkpoints,
+                                                    checkpoints[lo-1].lineno - context);
+                if(cp.offset > state.offset) {
+                    render_seek(&r, &cp);
+                    ring_used = 0;
+                    continue;
                 }
-                break;
             }
+        }
 
-            case T_OPERATOR:
-            buff_printf(&buff, "<span class=\"%soperator\">", prefix);
-            print_escaped(&buff, str + tokens[i].off, tokens[i].len);
-            buff_printf(&buff, "</span>");
-            break;
+        // Lines are scanned first to know whether they 
+        // have a hit, and rendered again if shown.
+        more = render_line(&r, false);
+        long end = more ? r.lx.i : len;
 
-            case T_DIRECTIVE:
-            buff_printf(&buff, "<span class=\"%sdirective\">", prefix);
-            print_escaped(&buff, str + tokens[i].off, tokens[i].len);
-            buff_printf(&buff, "</span>");
-            break;
+        if(hit < end) {
 
-            default:
-            buff_printf(&buff, "%c", str[tokens[i].off]);
-            break;
+            for(long i = 0; i < ring_used; i += 1)
+                grep_row(&r, &ring[(ring_head + i) % context], false, &last_row);
+            ring_used = 0;
+
+            grep_row(&r, &state, true, &last_row);
+            after = context;
+            hit = find_pattern(str, len, end, pattern, pattern_len);
+
+        } else if(after > 0) {
+
+            grep_row(&r, &state, false, &last_row);
+            after -= 1;
+
+        } else if(context > 0) {
+
+            if(ring_used < context)
+                ring_used += 1;
+            else
+                ring_head = (ring_head + 1) % context;
+            ring[(ring_head + ring_used - 1) % context] = state;
         }
     }
 
-    buff_printf(&buff, 
-                  "</td></tr>\n"
-            "    </table>\n"
-            "  </div>\n"
-            "</div>\n");
+    render_end(&r);
+    buff_flush(&buff);
+    free(ring);
 
-    char *res;
-    if(buff.error == NULL) {
-        buff.data[buff.used] = '\0';
-        res = buff.data;
-    } else {
+    if(buff.error != NULL) {
         if(error != NULL)
             *error = buff.error;
-        res = NULL;
+        return -1;
     }
+    return 0;
+}
 
-    if(output_len != NULL)
-        *output_len = buff.used;
+#ifndef C2H_NO_THREADS
+
+/* Jobs taken by a worker at once, as long as their
+ * inputs add up to no more than [POOL_BATCH_BYTES],
+ * so that tiny jobs don't each go through the lock.
+ */
+#define POOL_BATCH 32
+#define POOL_BATCH_BYTES (64 << 10)
+
+typedef struct pjob_t pjob_t;
+struct pjob_t {
+    pjob_t       *next;
+    const char   *str;
+    long          len;
+    c2html_opts_t opts;
+    c2html_done_t done;
+    void         *data;
+
+    // Result, when it's collected instead of
+    // passed to [done].
+    char       *output;
+    long        output_len;
+    const char *error;
+};
 
-    free(tokens);
-    return res;
-}
\ No newline at end of file
+typedef struct {
+    pjob_t *head;
+    pjob_t *tail;
+} pqueue_t;
+
+static void pqueue_append(pqueue_t *q, pjob_t *head, pjob_t *tail)
+{
+    if(q->tail)
+        q->tail->next = head;
+    else
+        q->head = head;
+    q->tail = tail;
+}
+
+struct c2html_pool_t {
+    mutex_t        lock;
+    pthread_cond_t cond;    // Signaled when jobs are added or
+    bool           stop;    // when the pool is stopping.
+    pqueue_t       jobs;
+    pqueue_t       results;
+    int            notify[2]; // Read and write ends, which are the
+                              // same eventfd on Linux.
+    pthread_t     *threads;
+    int            num_threads;
+};
+
+/* Makes [notify] readable. If it's full, it's
+ * already readable, so a failed write is fine.
+ */
+static void pool_notify(c2html_pool_t *pool)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+#else
+    char one = 1;
+#endif
+    ssize_t n = write(pool->notify[1], &one, sizeof(one));
+    (void) n;
+}
+
+static void pool_clear(c2html_pool_t *pool)
+{
+    char buf[64];
+    while(read(pool->notify[0], buf, sizeof(buf)) > 0);
+}
+
+/* Converts the input of [job] into [buff], which
+ * is kept by the worker across jobs.
+ */
+static void pool_run(pjob_t *job, buff_t *buff)
+{
+    const c2html_opts_t *opts = &job->opts;
+
+    const char *output = NULL;
+    char       *owned  = NULL;
+    long        output_len = 0;
+    const char *error  = NULL;
+
+    if(opts->max_input > 0 && job->len > opts->max_input)
+        error = c2html_err_input_limit;
+    else if(opts->cache != NULL) {
+        owned  = c2html_ex(job->str, job->len, opts, &output_len, &error);
+        output = owned;
+    } else {
+        buff->used    = 0;
+        buff->written = 0;
+        render(buff, job->str, job->len, opts);
+        if(buff->error != NULL) {
+            // The data was freed by the failure.
+            error = buff->error;
+            buff_init(buff);
+        } else {
+            buff->data[buff->used] = '\0';
+            output = buff->data;
+            output_len = buff->used;
+        }
+    }
+
+    if(job->done != NULL) {
+        job->done(job->data, output, output_len, error);
+        free(owned);
+        return;
+    }
+
+    // Collected results outlive the buffer.
+    if(output != NULL && owned == NULL) {
+        owned = malloc(output_len + 1);
+        if(owned == NULL)
+            error = "Out of memory";
+        else
+            memcpy(owned, output, output_len + 1);
+    }
+    job->output = owned;
+    job->output_len = owned ? output_len : 0;
+    job->error = error;
+}
+
+static void *pool_main(void *arg)
+{
+    c2html_pool_t *pool = arg;
+
+    buff_t buff;
+    buff_init(&buff);
+
+    while(1) {
+
+        mutex_lock(&pool->lock);
+        while(pool->jobs.head == NULL && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+
+        // Jobs submitted before stopping are done anyway.
+        pjob_t *batch = pool->jobs.head;
+        if(batch == NULL) {
+            mutex_unlock(&pool->lock);
+            break;
+        }
+
+        pjob_t *last = batch;
+        long bytes = batch->len;
+        for(int count = 1; count < POOL_BATCH && last->next != NULL
+                        && bytes + last->next->len <= POOL_BATCH_BYTES; count += 1) {
+            last = last->next;
+            bytes += last->len;
+        }
+        pool->jobs.head = last->next;
+        if(pool->jobs.head == NULL)
+            pool->jobs.tail = NULL;
+        last->next = NULL;
+        mutex_unlock(&pool->lock);
+
+        pqueue_t collected = {0};
+        pjob_t *job = batch;
+        while(job) {
+            pjob_t *next = job->next;
+            pool_run(job, &buff);
+            if(job->done != NULL)
+                free(job);
+            else {
+                job->next = NULL;
+                pqueue_append(&collected, job, job);
+            }
+            job = next;
+        }
+
+        if(collected.head != NULL) {
+            mutex_lock(&pool->lock);
+            pqueue_append(&pool->results, collected.head, collected.tail);
+            mutex_unlock(&pool->lock);
+            pool_notify(pool);
+        }
+    }
+
+    free(buff.data);
+    return NULL;
+}
+
+c2html_pool_t *c2html_pool_create(int threads)
+{
+    if(threads < 1)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1)
+        threads = 1;
+
+    c2html_pool_t *pool = calloc(1, sizeof(c2html_pool_t));
+    if(pool == NULL)
+        return NULL;
+
+    pool->threads = malloc(threads * sizeof(pthread_t));
+    if(pool->threads == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+#ifdef __linux__
+    pool->notify[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pool->notify[1] = pool->notify[0];
+    bool failed = (pool->notify[0] < 0);
+#else
+    bool failed = pipe(pool->notify) != 0;
+    if(!failed)
+        for(int i = 0; i < 2; i += 1) {
+            fcntl(pool->notify[i], F_SETFL, O_NONBLOCK);
+            fcntl(pool->notify[i], F_SETFD, FD_CLOEXEC);
+        }
+#endif
+    if(failed) {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    mutex_init(&pool->lock);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for(int i = 0; i < threads; i += 1) {
+        if(pthread_create(&pool->threads[i], NULL, pool_main, pool))
+            break;
+        pool->num_threads += 1;
+    }
+
+    if(pool->num_threads == 0) {
+        c2html_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void c2html_pool_free(c2html_pool_t *pool)
+{
+    if(pool == NULL)
+        return;
+
+    mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    mutex_unlock(&pool->lock);
+
+    for(int i = 0; i < pool->num_threads; i += 1)
+        pthread_join(pool->threads[i], NULL);
+
+    pjob_t *job = pool->results.head;
+    while(job) {
+        pjob_t *next = job->next;
+        free(job->output);
+        free(job);
+        job = next;
+    }
+
+    close(pool->notify[0]);
+    if(pool->notify[1] != pool->notify[0])
+        close(pool->notify[1]);
+    pthread_cond_destroy(&pool->cond);
+    mutex_free(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+int c2html_pool_submit(c2html_pool_t *pool, const char *str, long len,
+                       const c2html_opts_t *opts, c2html_done_t done,
+                       void *data, const char **error)
+{
+    pjob_t *job = calloc(1, sizeof(pjob_t));
+    if(job == NULL) {
+        if(error != NULL)
+            *error = "Out of memory";
+        return -1;
+    }
+
+    if(str == NULL)
+        str = "";
+
+    if(len < 0)
+        len = strlen(str);
+
+    job->str  = str;
+    job->len  = len;
+    job->done = done;
+    job->data = data;
+    if(opts != NULL)
+        job->opts = *opts;
+
+    // Workers run at the same time, while a line
+    // cache is for one thread at a time.
+    job->opts.line_cache = NULL;
+
+    mutex_lock(&pool->lock);
+    pqueue_append(&pool->jobs, job, job);
+    pthread_cond_signal(&pool->cond);
+    mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int c2html_pool_fd(c2html_pool_t *pool)
+{
+    return pool->notify[0];
+}
+
+int c2html_pool_collect(c2html_pool_t *pool, c2html_result_t *results, int max)
+{
+    // Cleared before taking the results, so that the
+    // ones added after this are notified again.
+    pool_clear(pool);
+
+    mutex_lock(&pool->lock);
+    int count = 0;
+    pjob_t *job = pool->results.head;
+    while(job && count < max) {
+        pjob_t *next = job->next;
+        results[count++] = (c2html_result_t) {
+            .data       = job->data,
+            .output     = job->output,
+            .output_len = job->output_len,
+            .error      = job->error,
+        };
+        free(job);
+        job = next;
+    }
+    pool->results.head = job;
+    if(job == NULL)
+        pool->results.tail = NULL;
+    else
+        pool_notify(pool);
+    mutex_unlock(&pool->lock);
+    return count;
+}
+
+#else
+
+c2html_pool_t *c2html_pool_create(int threads)
+{
+    (void) threads;
+    return NULL;
+}
+
+void c2html_pool_free(c2html_pool_t *pool)
+{
+    (void) pool;
+}
+
+int c2html_pool_submit(c2html_pool_t *pool, const char *str, long len,
+                       const c2html_opts_t *opts, c2html_done_t done,
+                       void *data, const char **error)
+{
+    (void) pool; (void) str; (void) len; (void) opts; (void) done; (void) data;
+    if(error != NULL)
+        *error = "Built without threads";
+    return -1;
+}
+
+int c2html_pool_fd(c2html_pool_t *pool)
+{
+    (void) pool;
+    return -1;
+}
+
+int c2html_pool_collect(c2html_pool_t *pool, c2html_result_t *results, int max)
+{
+    (void) pool; (void) results; (void) max;
+    return 0;
+}
+
+#endif /* C2H_NO_THREADS */
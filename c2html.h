@@ -1,3 +1,8 @@
+#ifndef C2HTML_H
+#define C2HTML_H
+
+#include <stdbool.h>
+
 /* Takes as input a string of C code [str] of length
  * [len] and returns the same C code but annotated
  * with HTML tags. The returned string's length is
@@ -23,3 +28,483 @@
  */
 char *c2html(const char *str, long len, const char *prefix, 
              long *output_len, const char **error);
+
+/* Cross-reference table. It maps function names
+ * to the files that define them, so that the names
+ * in function calls can be rendered as links to the
+ * definitions. It's built by scanning the files with
+ * [c2html_xref_scan] before any of them is rendered.
+ *
+ * Once built, a table is only read by the rendering
+ * functions, therefore it can be shared between
+ * threads as long as no one is scanning into it.
+ */
+typedef struct c2html_xref_t c2html_xref_t;
+
+/* Dictionary of names that are highlighted as types
+ * or keywords in addition to the ones of the language,
+ * like the typedefs of a project or of the headers it
+ * includes. Looking up a name takes constant time, so
+ * it can hold any number of them.
+ *
+ * Like the cross-reference table, once it's filled it
+ * can be shared between threads.
+ */
+typedef struct c2html_dict_t c2html_dict_t;
+
+typedef enum {
+    C2HTML_TYPE,  // Rendered with the "<prefix>type" class
+    C2HTML_KWORD, // Rendered like keywords, with the additional
+                  // "<prefix>user-kword" class
+} c2html_word_t;
+
+/* Cache of conversions, for when the same inputs
+ * are converted many times with the same options.
+ * It holds up to a given number of bytes, dropping
+ * the least recently used conversions when full.
+ * It can be used by many threads at the same time.
+ */
+typedef struct c2html_cache_t c2html_cache_t;
+
+/* Cache of rendered lines, for when the same lines
+ * appear in many files, like license headers and
+ * vendored code. Unlike [c2html_cache_t] it isn't
+ * locked, since it's looked up for every line, so
+ * it must only be used by one thread at a time.
+ */
+typedef struct c2html_line_cache_t c2html_line_cache_t;
+
+typedef struct {
+    long hits;      // Conversions that were found in the cache
+    long misses;    // ..and the ones that weren't
+    long evictions; // Conversions dropped to make room for new ones
+    long entries;   // Conversions currently in the cache
+    long bytes;     // Memory used by them
+} c2html_cache_stats_t;
+
+/* State of the highlighter at the start of a line.
+ * Rendering can start from any line as long as its
+ * state is known, without scanning what comes before.
+ * The states are obtained using [c2html_checkpoints]
+ * and they're only valid for the input they were
+ * computed from.
+ */
+typedef struct {
+    long offset;  // Position of the first character of the line
+    long lineno;  // Line number, starting from 1
+    long depth;   // Nesting level of curly brackets
+    bool comment; // The line starts inside a block comment
+} c2html_state_t;
+
+/* Called during a conversion to tell whether it
+ * should be stopped. */
+typedef bool (*c2html_cancel_t)(void *data);
+
+/* Options of [c2html_ex]. A zeroed structure
+ * results in the same output as [c2html].
+ *
+ * [prefix] is the class name prefix, as for [c2html].
+ *
+ * If [xref] isn't NULL, the function names of the
+ * definitions registered in it get an id attribute
+ * of the form "<prefix>def-<name>" and calls to them
+ * are rendered as <a> links. [url] is the URL the
+ * file was registered with when scanned. Links to
+ * other files are relative to it, so all URLs should
+ * be relative paths with a common root. If the file
+ * wasn't scanned, [url] can be NULL.
+ *
+ * If [dict] isn't NULL, the identifiers it contains
+ * are highlighted as types or keywords. The ones of 
+ * the language are never overridden.
+ *
+ * If [cache] isn't NULL, the output is looked up in it
+ * before converting the input, and stored there after.
+ * Since [xref] and [dict] are only compared by address,
+ * they must not change while in use with a cache.
+ *
+ * If [line_cache] isn't NULL, each line is looked up in
+ * it by its text and the state of the highlighter at
+ * its start, and stored there once rendered. It's not
+ * used when [xref] is set, since links depend on where
+ * the lines are.
+ *
+ * If [first_line] or [last_line] are greater than zero,
+ * only the lines in that range are rendered, with their
+ * original line numbers. The lines before the range still
+ * need to be scanned, unless an array of [num_checkpoints]
+ * states returned by [c2html_checkpoints] is provided
+ * through [checkpoints], in which case scanning starts 
+ * from the closest one.
+ *
+ * If [no_line_numbers] is true, the rows of the table
+ * only have the cell with the code.
+ *
+ * If [utf8] is true and the input is valid UTF-8, the
+ * non-ASCII characters that may appear in identifiers
+ * (roughly the letters and marks of C23's XID_Start and
+ * XID_Continue) are lexed as part of them. Invalid input
+ * is converted byte by byte as if [utf8] were false.
+ * Cross-references only cover ASCII names.
+ *
+ * [max_input], [max_output] and [max_tokens] limit the
+ * size of the input, the size of the output and the
+ * number of tokens scanned, if greater than zero. If 
+ * [cancel] isn't NULL, it's called with [cancel_data]
+ * every 1024 tokens and the conversion is stopped when
+ * it returns true, which can be used for deadlines.
+ * When a limit is exceeded or the conversion is
+ * cancelled, it fails with one of the errors below.
+ * Cache hits are only subject to the size limits.
+ */
+typedef struct {
+    const char *prefix;
+    const c2html_xref_t *xref;
+    const char *url;
+    const c2html_dict_t *dict;
+    c2html_cache_t *cache;
+    c2html_line_cache_t *line_cache;
+    long first_line;
+    long last_line;
+    const c2html_state_t *checkpoints;
+    long num_checkpoints;
+    bool no_line_numbers;
+    bool utf8;
+    long max_input;
+    long max_output;
+    long max_tokens;
+    c2html_cancel_t cancel;
+    void *cancel_data;
+} c2html_opts_t;
+
+/* Errors of the conversions that exceed the limits of 
+ * [c2html_opts_t] or are cancelled. They're returned
+ * through [error] as these pointers, so they can be 
+ * told apart from other errors by comparing them.
+ */
+extern const char c2html_err_input_limit[];
+extern const char c2html_err_output_limit[];
+extern const char c2html_err_token_limit[];
+extern const char c2html_err_cancelled[];
+
+/* Like [c2html], but the options are provided through
+ * [opts], which can be NULL.
+ */
+char *c2html_ex(const char *str, long len, const c2html_opts_t *opts,
+                long *output_len, const char **error);
+
+/* Receives the output of [c2html_write] in chunks. 
+ * [data] is the pointer provided to [c2html_write].
+ * Returning a value other than 0 stops the conversion.
+ */
+typedef int (*c2html_sink_t)(void *data, const char *str, long len);
+
+/* Like [c2html_ex], but instead of returning the output
+ * it's passed to [sink] as it's generated, a few KB at 
+ * a time. This avoids holding the whole output in memory.
+ *
+ * Returns 0 on success and -1 on failure, in which case
+ * [error] is set like for [c2html]. If the sink stops
+ * the conversion, that's also a failure.
+ *
+ * When using a cache, the output is passed to [sink] 
+ * all at once.
+ */
+int c2html_write(const char *str, long len, const c2html_opts_t *opts,
+                 c2html_sink_t sink, void *data, const char **error);
+
+/* Converts the input a piece at a time, for when it's
+ * not available all at once (like when it's being read
+ * from a file).
+ *
+ * The [state] must be zeroed before the first call. Each
+ * call converts the complete lines at the start of [str],
+ * passes their output to [sink] and returns how many
+ * bytes were consumed. The caller must then call it 
+ * again with the rest of [str] followed by more input.
+ * A return value of 0 means [str] doesn't contain a
+ * whole line yet. When [final] is true, [str] is assumed
+ * to be the end of the input and it's all converted.
+ *
+ * Returns -1 on failure, in which case [error] is set
+ * like for [c2html]. The line range and cache options 
+ * of [opts] are ignored. With [utf8], the lines of each
+ * call are checked to be valid UTF-8 on their own. The
+ * limits apply to each call.
+ */
+long c2html_feed(c2html_state_t *state, const char *str, long len, bool final,
+                 const c2html_opts_t *opts, c2html_sink_t sink, void *data,
+                 const char **error);
+
+/* Converts the input on demand, for when the caller wants
+ * to pull the output into its own buffers. */
+typedef struct c2html_iter_t c2html_iter_t;
+
+/* Creates an iterator over the output of [c2html_ex] for
+ * [str] (of length [len], or zero-terminated if [len] is
+ * negative) and [opts]. Nothing is converted until it's
+ * read. [str], and anything [opts] points to, must stay
+ * valid until the iterator is freed, but [opts] itself
+ * doesn't need to. The cache option is ignored.
+ *
+ * Returns NULL on failure, in which case [error] is set 
+ * like for [c2html]. It must be freed using 
+ * [c2html_iter_free].
+ */
+c2html_iter_t *c2html_iter_create(const char *str, long len, 
+                                  const c2html_opts_t *opts,
+                                  const char **error);
+void           c2html_iter_free(c2html_iter_t *it);
+
+/* Writes the next [cap] bytes of the output in [buf], or
+ * less if it ends before. [cap] must be greater than zero.
+ * Returns the number of bytes written, which is 0 once 
+ * the whole output was read, or -1 on failure, in which
+ * case [error] is set.
+ *
+ * The output is converted a line at a time, so at most
+ * the rest of the current line is held by the iterator 
+ * between calls.
+ */
+long c2html_iter_read(c2html_iter_t *it, char *buf, long cap, 
+                      const char **error);
+
+/* Creates an empty cross-reference table. Returns NULL
+ * if out of memory. It must be freed using
+ * [c2html_xref_free].
+ */
+c2html_xref_t *c2html_xref_create(void);
+void           c2html_xref_free(c2html_xref_t *xref);
+
+/* Registers in [xref] the function definitions of the
+ * C code [str] (of length [len], or zero-terminated if
+ * [len] is negative) that will be rendered with the
+ * given [url].
+ *
+ * If a function is defined in more than one file, links
+ * from other files point to the first definition that
+ * has a body. A prototype is only used if there isn't
+ * one. Scanning the same [url] twice has no effect on
+ * the definitions that were already registered.
+ *
+ * Returns 0 on success and -1 on failure, in which case
+ * [error] is set like for [c2html].
+ */
+int c2html_xref_scan(c2html_xref_t *xref, const char *str, long len,
+                     const char *url, const char **error);
+
+/* Adds the definitions of [src] to [dst], as if the files
+ * scanned into [src] had been scanned into [dst] after
+ * the ones already there. This makes it possible to scan
+ * batches of files into separate tables (for instance
+ * one per thread) and combine them at the end. [src] is
+ * left unchanged.
+ *
+ * Returns 0 on success and -1 on failure, in which case
+ * [error] is set like for [c2html].
+ */
+int c2html_xref_merge(c2html_xref_t *dst, const c2html_xref_t *src,
+                      const char **error);
+
+/* Creates an empty cache that holds conversions up to a
+ * total of [max_bytes], counting both their input and
+ * output. Returns NULL if out of memory. It must be freed
+ * using [c2html_cache_free] once no one is using it.
+ */
+c2html_cache_t *c2html_cache_create(long max_bytes);
+void            c2html_cache_free(c2html_cache_t *cache);
+
+/* Returns the counters of [cache] through [stats],
+ * which help choosing its size.
+ */
+void c2html_cache_stats(c2html_cache_t *cache, c2html_cache_stats_t *stats);
+
+/* Like [c2html_cache_create], [c2html_cache_free] and
+ * [c2html_cache_stats], but for a cache of lines. The
+ * counters are about lines instead of conversions.
+ */
+c2html_line_cache_t *c2html_line_cache_create(long max_bytes);
+void                 c2html_line_cache_free(c2html_line_cache_t *cache);
+void                 c2html_line_cache_stats(c2html_line_cache_t *cache, 
+                                             c2html_cache_stats_t *stats);
+
+/* Creates an empty dictionary. Returns NULL if out
+ * of memory. It must be freed using [c2html_dict_free].
+ */
+c2html_dict_t *c2html_dict_create(void);
+void           c2html_dict_free(c2html_dict_t *dict);
+
+/* Adds the name [str] of length [len] (or zero-terminated 
+ * if [len] is negative) to [dict] as a [kind]. If it was
+ * already there, its kind is changed. Names must be valid
+ * C identifiers.
+ *
+ * Returns 0 on success and -1 on failure, in which case
+ * [error] is set like for [c2html].
+ */
+int c2html_dict_add(c2html_dict_t *dict, const char *str, long len,
+                    c2html_word_t kind, const char **error);
+
+/* Adds to [dict] all of the names listed in [str] as a
+ * [kind]. Names are separated by whitespace and lines
+ * starting with '#' are ignored, so a list can be loaded
+ * as is from a file.
+ *
+ * Returns 0 on success and -1 on failure, in which case
+ * [error] is set like for [c2html]. The names before the
+ * one that caused the failure are added anyway.
+ */
+int c2html_dict_load(c2html_dict_t *dict, const char *str, long len,
+                     c2html_word_t kind, const char **error);
+
+/* Scans the C code [str] (of length [len], or zero-terminated
+ * if [len] is negative) and returns the state of the highlighter
+ * at the start of line 1 and then every [every] lines, so that
+ * they can be stored alongside the input and used to render
+ * ranges of lines with [c2html_ex]. The number of states is
+ * returned through [count]. The returned array must be freed
+ * using [free].
+ *
+ * If the function fails, NULL is returned and [error] is set
+ * like for [c2html].
+ */
+c2html_state_t *c2html_checkpoints(const char *str, long len, long every,
+                                   long *count, const char **error);
+
+/* Renders the lines that differ between two versions
+ * of the C code, [old_str] and [new_str] (of lengths
+ * [old_len] and [new_len], or zero-terminated if they
+ * are negative), passing the output to [sink] like
+ * [c2html_write] does.
+ *
+ * The changes are grouped in hunks along with up to
+ * [context] unchanged lines around them, and every
+ * hunk starts with a row of the form "@@ -a,b +c,d @@"
+ * as in a unified diff. Rows have the line number in
+ * the old version, the one in the new version and the
+ * code. Removed lines have the class "<prefix>del",
+ * added ones "<prefix>add" and hunk rows "<prefix>hunk".
+ * The whole table is in a div with the classes
+ * "<prefix>code" and "<prefix>diff".
+ *
+ * A line counts as changed if its text or the state
+ * of the highlighter at its start changed, as when a
+ * comment is opened above it, since then it's also
+ * rendered differently. Only the changed rows and
+ * their context are rendered.
+ *
+ * The [xref], [cache], line range and [checkpoints]
+ * fields of [opts] are ignored, as is [no_line_numbers].
+ * The limits apply to each version on its own, except
+ * for [max_output].
+ *
+ * Returns 0 on success and -1 on failure, in which case
+ * [error] is set like for [c2html].
+ */
+int c2html_diff(const char *old_str, long old_len, 
+                const char *new_str, long new_len, long context,
+                const c2html_opts_t *opts, c2html_sink_t sink, void *data, 
+                const char **error);
+
+/* Renders the lines of the C code [str] (of length [len],
+ * or zero-terminated if negative) that contain [pattern]
+ * (of length [pattern_len], or zero-terminated if negative),
+ * along with up to [context] lines before and after each
+ * of them, passing the output to [sink] like [c2html_write]
+ * does. Lines keep their original numbers.
+ *
+ * Rows with a match have the class "<prefix>match", and
+ * an empty row with the class "<prefix>gap" separates
+ * lines that aren't consecutive. The whole table is in
+ * a div with the classes "<prefix>code" and "<prefix>grep".
+ *
+ * The lines in between are scanned to know the state of
+ * the highlighter but not rendered. With [checkpoints],
+ * the ones far from any match aren't scanned either. The
+ * [cache] and line range of [opts] are ignored.
+ *
+ * Returns 0 on success and -1 on failure, in which case
+ * [error] is set like for [c2html]. An empty pattern is
+ * an error.
+ */
+int c2html_grep(const char *str, long len, const char *pattern, long pattern_len,
+                long context, const c2html_opts_t *opts, 
+                c2html_sink_t sink, void *data, const char **error);
+
+typedef struct c2html_pool_t c2html_pool_t;
+
+/* Called by a worker of a pool once a conversion is
+ * done, with the output [output] of length [output_len]
+ * or NULL and [error] if it failed. [data] is the one
+ * given to [c2html_pool_submit]. The output belongs to
+ * the worker and is only valid during the call. Calls
+ * for different jobs can happen at the same time.
+ */
+typedef void (*c2html_done_t)(void *data, const char *output,
+                              long output_len, const char *error);
+
+/* A conversion collected with [c2html_pool_collect]. 
+ * [output] must be freed using [free].
+ */
+typedef struct {
+    void       *data;   // As given to [c2html_pool_submit]
+    char       *output; // NULL on failure
+    long        output_len;
+    const char *error;
+} c2html_result_t;
+
+/* Creates a pool of [threads] threads that convert the
+ * inputs submitted with [c2html_pool_submit] in the
+ * background. If [threads] is less than 1, there's one
+ * per CPU. Returns NULL if the pool couldn't be created,
+ * which is always the case if the library was built with
+ * C2H_NO_THREADS.
+ *
+ * Each worker keeps its output buffer across jobs, and
+ * small jobs are taken from the queue a few at a time,
+ * so that submitting many small inputs is cheap.
+ */
+c2html_pool_t *c2html_pool_create(int threads);
+
+/* Waits for the submitted jobs to be done, then frees
+ * [pool] along with the results that weren't collected.
+ */
+void c2html_pool_free(c2html_pool_t *pool);
+
+/* Queues the conversion of the C code [str] (of length
+ * [len], or zero-terminated if [len] is negative) with
+ * the options [opts]. [str] isn't copied, so it must be
+ * left alone until the job is done. Only the [opts]
+ * struct is copied, so the same goes for what its
+ * pointers refer to: [prefix], [url], [xref], [dict],
+ * [cache], [checkpoints] and [cancel_data]. The
+ * [line_cache] of [opts] is ignored, since it can't be
+ * used by more than one thread, while [cache] can.
+ *
+ * If [done] isn't NULL, it's called with the result
+ * by the worker. Otherwise, the result is kept until
+ * it's taken with [c2html_pool_collect].
+ *
+ * Returns 0 on success and -1 on failure, in which case
+ * [error] is set like for [c2html].
+ */
+int c2html_pool_submit(c2html_pool_t *pool, const char *str, long len,
+                       const c2html_opts_t *opts, c2html_done_t done,
+                       void *data, const char **error);
+
+/* Returns a file descriptor that becomes readable when
+ * there are results to collect, so that it can be waited
+ * on with poll or an event loop along with other ones.
+ * It's an eventfd on Linux and a pipe elsewhere. It must
+ * not be read or closed by the caller.
+ */
+int c2html_pool_fd(c2html_pool_t *pool);
+
+/* Moves up to [max] of the results of the jobs submitted
+ * without a [done] callback into [results], in the order
+ * they were done, and returns how many there were. It
+ * doesn't wait, so it returns 0 if none is ready.
+ */
+int c2html_pool_collect(c2html_pool_t *pool, c2html_result_t *results, int max);
+
+#endif /* C2HTML_H */
@@ -0,0 +1,223 @@
+/* C++ interface of c2html. It's header-only and built
+ * on top of [c2html_write], so you only need to compile
+ * c2html.c as usual and include this file.
+ *
+ * The output is written directly into a sink, without
+ * materializing it in an intermediate buffer. A sink is
+ * any type with a method
+ *
+ *     bool write(const char *str, std::size_t len);
+ *
+ * which returns false to stop the conversion. If it
+ * throws, the conversion is stopped too and the
+ * exception is thrown again by [highlight]. The ones
+ * provided here write into a std::string, a fixed size
+ * buffer, a std::ostream or a callable.
+ *
+ * Everything is in the c2h namespace, since c2html is
+ * already the name of the C function.
+ *
+ * The options that are usually fixed for a program are
+ * template parameters of [basic_options], so that they
+ * are resolved at compile time:
+ *
+ *     static constexpr char prefix[] = "c2h-";
+ *     using opts = c2h::basic_options<prefix, false>;
+ *
+ *     std::string html;
+ *     c2h::string_sink sink(html);
+ *     c2h::highlight<opts>(code, sink);
+ *
+ * Reusing the same std::string for many conversions
+ * (after clearing it) avoids any allocation once its
+ * capacity is big enough.
+ */
+
+#ifndef C2HTML_HPP
+#define C2HTML_HPP
+
+#include <string>
+#include <string_view>
+#include <ostream>
+#include <cstddef>
+#include <exception>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "c2html.h"
+}
+
+namespace c2h {
+
+/* Compile-time options. [Prefix] must point to a
+ * zero-terminated string with static storage duration,
+ * or be nullptr for no prefix.
+ */
+template<const char *Prefix = nullptr, bool LineNumbers = true>
+struct basic_options {
+    static constexpr const char *prefix = Prefix;
+    static constexpr bool line_numbers = LineNumbers;
+};
+
+using default_options = basic_options<>;
+
+/* Appends the output to a string. */
+class string_sink {
+public:
+    explicit string_sink(std::string &out) : out_(out) {}
+
+    bool write(const char *str, std::size_t len)
+    {
+        out_.append(str, len);
+        return true;
+    }
+
+private:
+    std::string &out_;
+};
+
+/* Writes the output into a fixed size buffer. If
+ * the output doesn't fit, the conversion is stopped
+ * and [overflow] returns true.
+ */
+class buffer_sink {
+public:
+    buffer_sink(char *buf, std::size_t cap) : buf_(buf), cap_(cap) {}
+
+    bool write(const char *str, std::size_t len)
+    {
+        if(len > cap_ - used_) {
+            overflow_ = true;
+            return false;
+        }
+        std::memcpy(buf_ + used_, str, len);
+        used_ += len;
+        return true;
+    }
+
+    std::size_t size() const { return used_; }
+    bool overflow() const { return overflow_; }
+    std::string_view view() const { return { buf_, used_ }; }
+
+private:
+    char       *buf_;
+    std::size_t cap_;
+    std::size_t used_ = 0;
+    bool        overflow_ = false;
+};
+
+/* Writes the output to a stream. */
+class stream_sink {
+public:
+    explicit stream_sink(std::ostream &os) : os_(os) {}
+
+    bool write(const char *str, std::size_t len)
+    {
+        os_.write(str, static_cast<std::streamsize>(len));
+        return static_cast<bool>(os_);
+    }
+
+private:
+    std::ostream &os_;
+};
+
+/* Passes the output to a callable that takes a
+ * std::string_view and returns either nothing or
+ * a bool (false to stop the conversion).
+ */
+template<class F>
+class callback_sink {
+public:
+    explicit callback_sink(F f) : f_(std::move(f)) {}
+
+    bool write(const char *str, std::size_t len)
+    {
+        if constexpr (std::is_same_v<decltype(f_(std::string_view())), void>) {
+            f_(std::string_view(str, len));
+            return true;
+        } else
+            return f_(std::string_view(str, len));
+    }
+
+private:
+    F f_;
+};
+
+namespace detail {
+
+/* Sink passed to [c2html_write], along with the exception
+ * thrown by it, since exceptions can't go through C code.
+ */
+template<class Sink>
+struct sink_call {
+    Sink &sink;
+    std::exception_ptr error;
+};
+
+template<class Sink>
+int sink_write(void *data, const char *str, long len)
+{
+    auto *call = static_cast<sink_call<Sink>*>(data);
+    try {
+        return call->sink.write(str, static_cast<std::size_t>(len)) ? 0 : 1;
+    } catch(...) {
+        call->error = std::current_exception();
+        return 1;
+    }
+}
+
+template<class Options>
+c2html_opts_t make_opts(const c2html_opts_t *base)
+{
+    c2html_opts_t opts = {};
+    if(base != nullptr)
+        opts = *base;
+    opts.prefix = Options::prefix;
+    opts.no_line_numbers = !Options::line_numbers;
+    return opts;
+}
+
+} // namespace detail
+
+/* Highlights [code], writing the output into [sink].
+ * Options that aren't part of [Options], like the
+ * line range, can be provided through [extra]. Its
+ * prefix and line number fields are ignored.
+ *
+ * Returns true on success. On failure the error is
+ * returned through [error], if not null. Exceptions
+ * thrown by the sink, like std::bad_alloc, are thrown
+ * again once the conversion has been stopped.
+ */
+template<class Options = default_options, class Sink>
+bool highlight(std::string_view code, Sink &sink,
+               const char **error = nullptr,
+               const c2html_opts_t *extra = nullptr)
+{
+    c2html_opts_t opts = detail::make_opts<Options>(extra);
+    detail::sink_call<Sink> call{sink, nullptr};
+    bool ok = c2html_write(code.data(), static_cast<long>(code.size()), &opts,
+                           detail::sink_write<Sink>, &call, error) == 0;
+    if(call.error)
+        std::rethrow_exception(call.error);
+    return ok;
+}
+
+/* Convenience function that returns the output as
+ * a new string. Returns an empty string on failure.
+ */
+template<class Options = default_options>
+std::string to_string(std::string_view code, const char **error = nullptr)
+{
+    std::string out;
+    string_sink sink(out);
+    if(!highlight<Options>(code, sink, error))
+        out.clear();
+    return out;
+}
+
+} // namespace c2h
+
+#endif /* C2HTML_HPP */
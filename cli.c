@@ -3,10 +3,42 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
 #include "c2html.h"
+#include "bundle.h"
+#include "reference.h"
+#if defined(C2H_SERVE) || defined(C2H_WATCH)
+#include <unistd.h>
+#endif
+#ifdef C2H_SERVE
+#include "serve.h"
+#endif
+#ifdef C2H_WATCH
+#include "watch.h"
+#endif
+
+#ifdef C2H_ZLIB
+#include <zlib.h>
+#endif
+
+/* Tracepoints of the steps of a conversion, in the
+ * same "c2html" provider as the ones of the library
+ * (see c2html.c). Defining C2H_USDT builds them.
+ */
+#ifdef C2H_USDT
+#include <sys/sdt.h>
+#define PROBE1(name, a)    DTRACE_PROBE1(c2html, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(c2html, name, a, b)
+#else
+#define PROBE1(name, a)    ((void) 0)
+#define PROBE2(name, a, b) ((void) 0)
+#endif
 
 #ifdef C2H_TIMING
-#include <time.h>
 char *timed_c2html(const char *str, long len, 
                    const char *prefix, const char **error)
 {
@@ -83,6 +115,7 @@ static char *load_from_stream(FILE *fp, long *out_size, const char **err)
         }
     }
     data[size] = '\0';
+    PROBE1(cli__read, size);
 
     if(out_size)
         *out_size = size;
@@ -111,14 +144,158 @@ static long find_substr_or_end(const char *str, long len, long i, const char *su
     return i;
 }
 
-static int tmplconv(FILE *in_fp, FILE *out_fp,
-                    const char *prefix, 
+/* Destination of the output of a conversion. If
+ * [gzip] is true, it's compressed while being
+ * written to [fp]. If [fp] is NULL, the output
+ * is accumulated in [mem] instead.
+ */
+typedef struct {
+    FILE *fp;
+    bool  gzip;
+    bool  failed;
+    char *mem;
+    long  mem_used;
+    long  mem_size;
+#ifdef C2H_ZLIB
+    z_stream zs;
+#endif
+} output_t;
+
+static int out_emit(output_t *out, const char *str, long len)
+{
+    if(out->fp != NULL)
+        return (long) fwrite(str, 1, len, out->fp) < len ? -1 : 0;
+
+    if(out->mem_used + len > out->mem_size) {
+        long new_size = out->mem_size ? 2 * out->mem_size : 1 << 16;
+        if(out->mem_used + len > new_size)
+            new_size = out->mem_used + len;
+        void *temp = realloc(out->mem, new_size);
+        if(temp == NULL)
+            return -1;
+        out->mem = temp;
+        out->mem_size = new_size;
+    }
+    memcpy(out->mem + out->mem_used, str, len);
+    out->mem_used += len;
+    return 0;
+}
+
+#ifdef C2H_ZLIB
+static int out_deflate(output_t *out, const char *str, long len, int flush)
+{
+    char chunk[1 << 14];
+    
+    out->zs.next_in  = (Bytef*) str;
+    out->zs.avail_in = len;
+
+    int res;
+    do {
+        out->zs.next_out  = (Bytef*) chunk;
+        out->zs.avail_out = sizeof(chunk);
+
+        res = deflate(&out->zs, flush);
+        if(res == Z_STREAM_ERROR)
+            return -1;
+
+        size_t produced = sizeof(chunk) - out->zs.avail_out;
+        if(out_emit(out, chunk, produced))
+            return -1;
+
+    } while(out->zs.avail_out == 0 || (flush == Z_FINISH && res != Z_STREAM_END));
+
+    return 0;
+}
+#endif
+
+static int out_open(output_t *out, FILE *fp, bool gzip)
+{
+    out->fp = fp;
+    out->gzip = gzip;
+    out->failed = false;
+    out->mem = NULL;
+    out->mem_used = 0;
+    out->mem_size = 0;
+
+    if(gzip) {
+#ifdef C2H_ZLIB
+        memset(&out->zs, 0, sizeof(out->zs));
+        // The 16 added to the window bits selects the gzip format.
+        if(deflateInit2(&out->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 
+                        15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+#else
+        return -1;
+#endif
+    }
+    return 0;
+}
+
+static int out_write(output_t *out, const char *str, long len)
+{
+    if(out->failed)
+        return -1;
+
+    PROBE1(cli__write, len);
+
+#ifdef C2H_ZLIB
+    if(out->gzip) {
+        // [avail_in] may be smaller than a long.
+        while(len > 0 && !out->failed) {
+            long n = len < (1L << 30) ? len : (1L << 30);
+            if(out_deflate(out, str, n, Z_NO_FLUSH))
+                out->failed = true;
+            str += n;
+            len -= n;
+        }
+        return out->failed ? -1 : 0;
+    }
+#endif
+
+    if(out_emit(out, str, len))
+        out->failed = true;
+    return out->failed ? -1 : 0;
+}
+
+/* Terminates the compressed stream. The file 
+ * itself must be closed by the caller, and so
+ * must [mem] be freed.
+ */
+static int out_close(output_t *out)
+{
+#ifdef C2H_ZLIB
+    if(out->gzip) {
+        if(!out->failed && out_deflate(out, NULL, 0, Z_FINISH))
+            out->failed = true;
+        deflateEnd(&out->zs);
+    }
+#endif
+    if(out->fp != NULL && fflush(out->fp))
+        out->failed = true;
+    return out->failed ? -1 : 0;
+}
+
+static int output_sink(void *data, const char *str, long len)
+{
+    return out_write(data, str, len);
+}
+
+typedef struct {
+    const char *style_data;  // Contents of the --style file, or NULL.
+    const char *templ_begin;
+    const char *templ_end;
+    bool        template;
+    bool        gzip;
+    bool        pipeline;
+    const char *grep;        // Pattern of --grep, or NULL.
+    long        context;     // Lines around the matches of --grep
+} config_t;
+
+static int tmplconv(const char *input, long input_size, output_t *out,
+                    const c2html_opts_t *opts,
                     const char *token_begin, 
                     const char *token_end)
 {
-    if(prefix == NULL)
-        prefix = "c2h-";
-
     if(token_begin == NULL)
         token_begin = "<c2html>";
 
@@ -127,13 +304,6 @@ static int tmplconv(FILE *in_fp, FILE *out_fp,
 
     const char *err;
 
-    long  input_size;
-    char *input = load_from_stream(in_fp, &input_size, &err);
-    if(input == NULL) {
-        fprintf(stderr, "Error: Failed to read input (%s)\n", err);
-        return -1;
-    }
-
     long i = 0;
     while(1) {
         
@@ -143,13 +313,9 @@ static int tmplconv(FILE *in_fp, FILE *out_fp,
         i = find_substr_or_end(input, input_size, i, token_begin);
         long len = i - off;
 
-        {
-            long written = fwrite(input + off, 1, len, out_fp);
-            if(written < len) {
-                fprintf(stderr, "Error: Failed to write to output\n");
-                free(input);
-                return -1;
-            }
+        if(out_write(out, input + off, len)) {
+            fprintf(stderr, "Error: Failed to write to output\n");
+            return -1;
         }
 
         if(i == input_size)
@@ -163,25 +329,15 @@ static int tmplconv(FILE *in_fp, FILE *out_fp,
         i = find_substr_or_end(input, input_size, i, token_end);
         len = i - off;
 
-        {
-            long  output_size;
-            char *output = c2html(input + off, len, prefix, 
-                                  &output_size, &err);
-            if(output == NULL) {
-                fprintf(stderr, "Error: %s\n", err);
-                free(input);
-                return -1;
-            }
-
-            long written = fwrite(output, 1, output_size, out_fp);
-            
-            free(output);
+        PROBE1(cli__convert__start, len);
+        int res = c2html_write(input + off, len, opts, output_sink, out, &err);
+        PROBE2(cli__convert__end, len, res);
 
-            if(written < len) {
-                fprintf(stderr, "Error: Failed to write to output\n");
-                free(input);
-                return -1;
-            }
+        if(res) {
+            if(out->failed)
+                err = "Failed to write to output";
+            fprintf(stderr, "Error: %s\n", err);
+            return -1;
         }
 
         if(i == input_size)
@@ -191,230 +347,1976 @@ static int tmplconv(FILE *in_fp, FILE *out_fp,
         assert(i <= input_size);
     }
 
-    free(input);
     return 0;
 }
 
-static int fileconv(FILE *in_fp, FILE *out_fp, 
-                    const char *style_file, 
-                    const char *prefix)
+static int fileconv(const char *input, long input_size, output_t *out,
+                    const config_t *conf, 
+                    const c2html_opts_t *opts)
 {
-    if(prefix == NULL)
-        prefix = "c2h-";
-
     const char *err;
+    const char *style_data = conf->style_data;
 
-    long  input_size;
-    char *input = load_from_stream(in_fp, &input_size, &err);
-    if(input == NULL) {
-        fprintf(stderr, "Error: Failed to read input (%s)\n", err);
-        return -1;
+    if(style_data != NULL) {
+
+        bool failed = out_write(out, "<style>", 7)
+                   || out_write(out, style_data, strlen(style_data))
+                   || out_write(out, "</style>", 8);
+
+        if(failed) {
+            fprintf(stderr, "Error: Failed to write to output\n");
+            return -1;
+        }
     }
 
-    long  output_size;
-    char *output = c2html(input, input_size, prefix, 
-                          &output_size, &err);
-    if(output == NULL) {
+    PROBE1(cli__convert__start, input_size);
+    int res;
+    if(conf->grep != NULL)
+        res = c2html_grep(input, input_size, conf->grep, -1, conf->context,
+                          opts, output_sink, out, &err);
+    else
+        res = c2html_write(input, input_size, opts, output_sink, out, &err);
+    PROBE2(cli__convert__end, input_size, res);
+
+    if(res) {
+        if(out->failed)
+            err = "Failed to write to output";
         fprintf(stderr, "Error: %s\n", err);
-        free(input);
         return -1;
     }
 
-    if(style_file != NULL) {
+    return 0;
+}
 
-        char *style_data = load_file(style_file, NULL);
-        if(style_data == NULL) {
-            fprintf(stderr, "Error: Failed to open file %s\n", style_file);
-            free(output);
-            free(input);
-            return -1;
-        }
+static int diffconv(const char *old_input, long old_size,
+                    const char *new_input, long new_size, long context,
+                    output_t *out, const char *style_data,
+                    const c2html_opts_t *opts)
+{
+    const char *err;
 
-        bool failed = fputs("<style>",  out_fp) < 0
-                   || fputs(style_data, out_fp) < 0
-                   || fputs("</style>", out_fp) < 0;
+    if(style_data != NULL) {
 
-        free(style_data);
+        bool failed = out_write(out, "<style>", 7)
+                   || out_write(out, style_data, strlen(style_data))
+                   || out_write(out, "</style>", 8);
 
         if(failed) {
             fprintf(stderr, "Error: Failed to write to output\n");
-            free(output);
-            free(input);
             return -1;
         }
     }
 
-    long written = fwrite(output, 1, output_size, out_fp);
-
-    free(output);
-    free(input);
-
-    if(written < output_size) {
-        fprintf(stderr, "Error: Failed to write to output\n");
+    if(c2html_diff(old_input, old_size, new_input, new_size, context, 
+                   opts, output_sink, out, &err)) {
+        if(out->failed)
+            err = "Failed to write to output";
+        fprintf(stderr, "Error: %s\n", err);
         return -1;
     }
 
     return 0;
 }
 
-static void print_help(FILE *fp, char *name) {
-    fprintf(fp, 
-        "\n"
-        " c2html is a tool to add HTML syntax highlighting to C code.\n"
-        "\n"
-        " Basically you give  c2html  some C code  as input and  it classifies \n"
-        " all the keywords, identifiers etc using <span> elements, associating \n"
-        " them with the appropriate  class names. By applying a CSS stylesheet \n"
-        " to the generated output, you get the highliting!\n"
-        "\n"
-        " The usage is:\n"
-        "     $ %s [-i file.c] [-o file.html] [--style file.css] [-p <prefix>] [-t [-s <token>] [-e <token>]]\n" 
-        "\n"
-        " ..and here's a table of all available options:\n"
-        "\n"
-        "     -h,   --help             Show this message\n"
-        "\n"
-        "     -i,  --input     file.c  File containing C code that needs\n"
-        "                              to be converted\n"
-        "\n"
-        "     -o, --output  file.html  HTML file where the output will be\n"
-        "                              written to\n"
-        "\n"
-        "          --style  style.css  CSS stylesheet that will be added\n"
-        "                              to the HTML output\n"
-        "\n"
-        "     -p, --prefix   <prefix>  The prefix of the HTML element's\n"
-        "                              class names. The default is \"c2h-\"\n"
-        "\n"
-        "     -t, --template           Only highlight the substrings of the\n"
-        "                              input between the <c2html> and </c2html>\n"
-        "                              tokens. The rest is copied unchanged.\n"
-        "                              It's possible to change these tokens\n"
-        "                              with --begin and --end.\n"
-        "                              When using this mode, --style is ignored\n"
-        "\n"
-        "     -b, --begin    <string>  Specify the start of each substring to\n"
-        "                              be converted. It only work when --template\n"
-        "                              is also specified\n"
-        "\n"
-        "     -e, --end      <string>  Specify the end of each substring to be\n"
-        "                              be converted. It only works when --template\n"
-        "                              is also specified\n"
-        "\n", name);
+static int convert_to(const config_t *conf, const char *input, long input_size, 
+                      output_t *out, const c2html_opts_t *opts)
+{
+    if(conf->template)
+        return tmplconv(input, input_size, out, opts, 
+                        conf->templ_begin, conf->templ_end);
+    else
+        return fileconv(input, input_size, out, conf, opts);
 }
 
-int main(int argc, char **argv)
+static int convert(const config_t *conf, const char *input, long input_size, 
+                   FILE *out_fp, const c2html_opts_t *opts)
 {
-    /* Parse command-line arguments */
-    char *input_file = NULL, 
-        *output_file = NULL,
-         *style_file = NULL,
-        *templ_begin = NULL,
-          *templ_end = NULL,
-             *prefix = NULL;
-    bool    template = 0;
-
-    for(int i = 1; i < argc; i += 1) {
-        if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
-
-            print_help(stdout, argv[0]);
-            return -1;
-
-        } else if(!strcmp(argv[i], "-i") || !strcmp(argv[i], "--input")) {
-            i += 1;
-            if(i == argc || argv[i][0] == '-') {
-                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
-                return -1;
-            }
-            input_file = argv[i];
-        } else if(!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
-            i += 1;
-            if(i == argc || argv[i][0] == '-') {
-                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
-                return -1;
-            }
-            output_file = argv[i];
-        } else if(!strcmp(argv[i], "-p") || !strcmp(argv[i], "--prefix")) {
-            i += 1;
-            if(i == argc || argv[i][0] == '-') {
-                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
-                return -1;
-            }
-            prefix = argv[i];
-        } else if(!strcmp(argv[i], "-t") || !strcmp(argv[i], "--template")) {
+    output_t out;
+    if(out_open(&out, out_fp, conf->gzip)) {
+        fprintf(stderr, "Error: Couldn't initialize the compressor\n");
+        return -1;
+    }
 
-            template = 1;
+    int rescode = convert_to(conf, input, input_size, &out, opts);
 
-        } else if(!strcmp(argv[i], "-b") || !strcmp(argv[i], "--begin")) {
+    if(out_close(&out) && rescode == 0) {
+        fprintf(stderr, "Error: Failed to write to output\n");
+        rescode = -1;
+    }
+    return rescode;
+}
 
-            i += 1;
-            if(i == argc || argv[i][0] == '-') {
-                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
-                return -1;
-            }
-            templ_begin = argv[i];
+/* Returns the URL of the HTML file generated from the
+ * source file [path], relative to the output directory.
+ * It's the path itself with the ".html" extension added,
+ * without any leading "/" or "./". The returned string
+ * must be freed using [free].
+ */
+static char *file_url(const char *path)
+{
+    while(1) {
+        if(path[0] == '/')
+            path += 1;
+        else if(path[0] == '.' && path[1] == '/')
+            path += 2;
+        else
+            break;
+    }
 
-        } else if(!strcmp(argv[i], "-e") || !strcmp(argv[i], "--end")) {
+    long len = strlen(path);
+    char *url = malloc(len + sizeof(".html"));
+    if(url == NULL)
+        return NULL;
+    memcpy(url, path, len);
+    memcpy(url + len, ".html", sizeof(".html"));
+    return url;
+}
 
-            i += 1;
-            if(i == argc || argv[i][0] == '-') {
-                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
-                return -1;
-            }
-            templ_end = argv[i];
+/* Creates the parent directories of [path], 
+ * ignoring the ones that already exist.
+ */
+static int make_parent_dirs(char *path)
+{
+    for(char *p = path + 1; *p != '\0'; p += 1) {
+        if(*p != '/')
+            continue;
+        *p = '\0';
+        int res = mkdir(path, 0777);
+        *p = '/';
+        if(res < 0 && errno != EEXIST)
+            return -1;
+    }
+    return 0;
+}
 
-        } else if(!strcmp(argv[i], "--style")) {
-            i += 1;
-            if(i == argc || argv[i][0] == '-') {
-                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
-                return -1;
-            }
-            style_file = argv[i];
-        } else {
-            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+/* Stores the output of a file in batch mode, either 
+ * as the file [path] or, if [bundle] isn't NULL, as
+ * an entry of the bundle.
+ */
+static int store_output(c2html_bundle_writer_t *bundle, char *path, 
+                        const char *data, long len)
+{
+    const char *err;
+    if(bundle != NULL) {
+        if(c2html_bundle_add(bundle, path, data, len, &err)) {
+            fprintf(stderr, "Error: %s (while storing %s)\n", err, path);
             return -1;
         }
+        return 0;
     }
 
-    bool use_stdin = (input_file == NULL);
-    bool use_stdout = (output_file == NULL);
- 
-    FILE *in_fp, *out_fp;
+    FILE *fp = NULL;
+    if(make_parent_dirs(path) == 0)
+        fp = fopen(path, "wb");
 
-    if(use_stdin)
-        in_fp = stdin;
-    else {
-        in_fp = fopen(input_file, "rb");
-        if(in_fp == NULL) {
-            fprintf(stderr, "Error: Couldn't open file %s\n", input_file);
-            return -1;
-        }
+    if(fp == NULL) {
+        fprintf(stderr, "Error: Couldn't open or create file %s\n", path);
+        return -1;
     }
 
-    if(output_file == NULL)
-        out_fp = stdout;
-    else {
-        out_fp = fopen(output_file, "wb");
-        if(out_fp == NULL) {
-            if(!use_stdin)
-                fclose(in_fp);
-            fprintf(stderr, "Error: Couldn't open or create file %s\n", output_file);
+    bool failed = (long) fwrite(data, 1, len, fp) < len;
+    if(fclose(fp) || failed) {
+        fprintf(stderr, "Error: Failed to write to %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* The pipelined mode overlaps reading the input, 
+ * converting it and writing the output by running
+ * them in different threads, connected by queues
+ * of buffers. A full queue blocks the thread that
+ * pushes into it, so a slow stage slows down the
+ * others instead of making the buffers pile up.
+ */
+
+#define QUEUE_SIZE 4
+#define CHUNK_SIZE (1 << 20)
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    void *items[QUEUE_SIZE];
+    int   head;
+    int   count;
+} queue_t;
+
+static void queue_init(queue_t *q)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->head  = 0;
+    q->count = 0;
+}
+
+static void queue_free(queue_t *q)
+{
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+}
+
+static void queue_push(queue_t *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while(q->count == QUEUE_SIZE)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count) % QUEUE_SIZE] = item;
+    q->count += 1;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *queue_pop(queue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while(q->count == 0)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    void *item = q->items[q->head];
+    q->head = (q->head + 1) % QUEUE_SIZE;
+    q->count -= 1;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+typedef struct {
+    char *data;
+    long  used;
+    int   file;   // Index of the file in batch mode.
+    bool  last;   // No chunks come after this one.
+    bool  failed; // The input couldn't be read.
+} chunk_t;
+
+/* Stage that moves chunks from [full] to the
+ * file, recycling them through [empty].
+ */
+typedef struct {
+    queue_t   full;
+    queue_t   empty;
+    output_t *out;
+    bool      failed;
+} writer_t;
+
+static void *writer_main(void *arg)
+{
+    writer_t *w = arg;
+    bool last;
+    do {
+        chunk_t *chunk = queue_pop(&w->full);
+        if(!w->failed && out_write(w->out, chunk->data, chunk->used))
+            w->failed = true;
+        last = chunk->last;
+        queue_push(&w->empty, chunk);
+    } while(!last);
+    return NULL;
+}
+
+/* Stage that reads [fp] into chunks, taking 
+ * them from [empty] and pushing them into [full].
+ */
+typedef struct {
+    queue_t full;
+    queue_t empty;
+    FILE   *fp;
+} reader_t;
+
+static void *reader_main(void *arg)
+{
+    reader_t *rd = arg;
+    bool last;
+    do {
+        chunk_t *chunk = queue_pop(&rd->empty);
+        chunk->used   = fread(chunk->data, 1, CHUNK_SIZE, rd->fp);
+        chunk->failed = ferror(rd->fp);
+        chunk->last   = chunk->used < CHUNK_SIZE;
+        last = chunk->last;
+        queue_push(&rd->full, chunk);
+    } while(!last);
+    return NULL;
+}
+
+/* Sink of [c2html_feed] that copies the output
+ * into the chunks of the writer.
+ */
+typedef struct {
+    writer_t *w;
+    chunk_t  *chunk;
+} pipe_out_t;
+
+static int pipe_sink(void *data, const char *str, long len)
+{
+    pipe_out_t *po = data;
+    while(len > 0) {
+
+        chunk_t *chunk = po->chunk;
+
+        long n = CHUNK_SIZE - chunk->used;
+        if(n > len)
+            n = len;
+        memcpy(chunk->data + chunk->used, str, n);
+        chunk->used += n;
+        str += n;
+        len -= n;
+
+        if(chunk->used == CHUNK_SIZE) {
+            chunk->last = false;
+            queue_push(&po->w->full, chunk);
+            po->chunk = queue_pop(&po->w->empty);
+            po->chunk->used = 0;
+        }
+    }
+    return 0;
+}
+
+static chunk_t *chunks_alloc(int count)
+{
+    chunk_t *chunks = calloc(count, sizeof(chunk_t));
+    if(chunks == NULL)
+        return NULL;
+    for(int i = 0; i < count; i += 1) {
+        chunks[i].data = malloc(CHUNK_SIZE);
+        if(chunks[i].data == NULL) {
+            for(int j = 0; j < i; j += 1)
+                free(chunks[j].data);
+            free(chunks);
+            return NULL;
+        }
+    }
+    return chunks;
+}
+
+static void chunks_free(chunk_t *chunks, int count)
+{
+    for(int i = 0; i < count; i += 1)
+        free(chunks[i].data);
+    free(chunks);
+}
+
+/* Pipelined version of [fileconv] that reads the 
+ * input from [in_fp] while it's being converted.
+ * The input is converted a few lines at a time 
+ * using [c2html_feed].
+ */
+static int fileconv_pipelined(FILE *in_fp, FILE *out_fp, const config_t *conf,
+                              const c2html_opts_t *opts)
+{
+    output_t out;
+    if(out_open(&out, out_fp, conf->gzip)) {
+        fprintf(stderr, "Error: Couldn't initialize the compressor\n");
+        return -1;
+    }
+
+    // There are as many chunks as slots in a queue,
+    // so pushing a chunk back into the queue of the
+    // empty ones never blocks.
+    chunk_t *in_chunks  = chunks_alloc(QUEUE_SIZE);
+    chunk_t *out_chunks = chunks_alloc(QUEUE_SIZE);
+    if(in_chunks == NULL || out_chunks == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        if(in_chunks)  chunks_free(in_chunks,  QUEUE_SIZE);
+        if(out_chunks) chunks_free(out_chunks, QUEUE_SIZE);
+        out_close(&out);
+        return -1;
+    }
+
+    reader_t rd = { .fp = in_fp };
+    writer_t w  = { .out = &out, .failed = false };
+    queue_init(&rd.full);
+    queue_init(&rd.empty);
+    queue_init(&w.full);
+    queue_init(&w.empty);
+
+    for(int i = 0; i < QUEUE_SIZE; i += 1) {
+        queue_push(&rd.empty, &in_chunks[i]);
+        queue_push(&w.empty,  &out_chunks[i]);
+    }
+
+    // The writer goes first since it's stopped by
+    // the last chunk if the reader doesn't start.
+    pthread_t reader, writer;
+    bool started = !pthread_create(&writer, NULL, writer_main, &w);
+    if(started && pthread_create(&reader, NULL, reader_main, &rd)) {
+        chunk_t *chunk = queue_pop(&w.empty);
+        chunk->used = 0;
+        chunk->last = true;
+        queue_push(&w.full, chunk);
+        pthread_join(writer, NULL);
+        started = false;
+    }
+    if(!started) {
+        fprintf(stderr, "Error: Couldn't start threads\n");
+        out_close(&out);
+        queue_free(&w.empty);
+        queue_free(&w.full);
+        queue_free(&rd.empty);
+        queue_free(&rd.full);
+        chunks_free(in_chunks,  QUEUE_SIZE);
+        chunks_free(out_chunks, QUEUE_SIZE);
+        return -1;
+    }
+
+    pipe_out_t po = { .w = &w, .chunk = queue_pop(&w.empty) };
+    po.chunk->used = 0;
+
+    if(conf->style_data != NULL) {
+        pipe_sink(&po, "<style>", 7);
+        pipe_sink(&po, conf->style_data, strlen(conf->style_data));
+        pipe_sink(&po, "</style>", 8);
+    }
+
+    int rescode = 0;
+    const char *err = NULL;
+
+    char *window = NULL;
+    long  window_used = 0;
+    long  window_size = 0;
+    long  retry_at = 0;
+    c2html_state_t state = {0};
+
+    bool last;
+    do {
+        chunk_t *chunk = queue_pop(&rd.full);
+        last = chunk->last;
+
+        if(rescode == 0 && chunk->failed) {
+            err = "Failed to read input";
+            rescode = -1;
+        }
+
+        if(rescode == 0 && window_used + chunk->used > window_size) {
+            long new_size = 2 * (window_used + chunk->used);
+            void *temp = realloc(window, new_size);
+            if(temp == NULL) {
+                err = "Out of memory";
+                rescode = -1;
+            } else {
+                window = temp;
+                window_size = new_size;
+            }
+        }
+
+        if(rescode == 0) {
+            memcpy(window + window_used, chunk->data, chunk->used);
+            window_used += chunk->used;
+        }
+
+        // The chunk goes back to the reader right away,
+        // so that it can read the next one while this
+        // is converted.
+        queue_push(&rd.empty, chunk);
+
+        // If the last try didn't find a whole line, wait 
+        // for the window to double before trying again, 
+        // or very long lines would be scanned over and 
+        // over.
+        if(rescode == 0 && (last || window_used >= retry_at)) {
+            long consumed = c2html_feed(&state, window, window_used, last,
+                                        opts, pipe_sink, &po, &err);
+            if(consumed < 0)
+                rescode = -1;
+            else {
+                memmove(window, window + consumed, window_used - consumed);
+                window_used -= consumed;
+                retry_at = consumed == 0 ? 2 * window_used : 0;
+            }
+        }
+
+    } while(!last);
+
+    po.chunk->last = true;
+    queue_push(&w.full, po.chunk);
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+
+    if(out_close(&out) || w.failed) {
+        if(rescode == 0)
+            err = "Failed to write to output";
+        rescode = -1;
+    }
+
+    if(rescode)
+        fprintf(stderr, "Error: %s\n", err);
+
+    free(window);
+    queue_free(&w.empty);
+    queue_free(&w.full);
+    queue_free(&rd.empty);
+    queue_free(&rd.full);
+    chunks_free(in_chunks,  QUEUE_SIZE);
+    chunks_free(out_chunks, QUEUE_SIZE);
+    return rescode;
+}
+
+/* In batch mode each chunk is a whole file. Its
+ * data is allocated by the reader and freed by 
+ * the writer.
+ */
+typedef struct {
+    queue_t      queue;
+    chunk_t     *chunks; // One for each file, plus the last one.
+    char *const *files;
+    int          num_files;
+} batch_reader_t;
+
+static void *batch_reader_main(void *arg)
+{
+    batch_reader_t *rd = arg;
+    for(int i = 0; i <= rd->num_files; i += 1) {
+        chunk_t *chunk = &rd->chunks[i];
+        chunk->file = i;
+        chunk->last = (i == rd->num_files);
+        if(!chunk->last) {
+            chunk->data = load_file(rd->files[i], &chunk->used);
+            chunk->failed = (chunk->data == NULL);
+        }
+        queue_push(&rd->queue, chunk);
+    }
+    return NULL;
+}
+
+typedef struct {
+    queue_t      queue;
+    char *const *paths;
+    c2html_bundle_writer_t *bundle;
+    bool         failed;
+} batch_writer_t;
+
+static void *batch_writer_main(void *arg)
+{
+    batch_writer_t *w = arg;
+    while(1) {
+        chunk_t *chunk = queue_pop(&w->queue);
+        if(chunk->last)
+            break;
+
+        if(store_output(w->bundle, w->paths[chunk->file], chunk->data, chunk->used))
+            w->failed = true;
+
+        free(chunk->data);
+    }
+    return NULL;
+}
+
+static int batchconv_pipelined(const config_t *conf, char **files, char **paths, 
+                               char **urls, int num_files, 
+                               const c2html_opts_t *base_opts,
+                               c2html_bundle_writer_t *bundle)
+{
+    chunk_t *chunks = calloc(num_files + 1, sizeof(chunk_t));
+    if(chunks == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+
+    batch_reader_t rd = { .chunks = chunks, .files = files, .num_files = num_files };
+    batch_writer_t w  = { .paths = paths, .bundle = bundle, .failed = false };
+    queue_init(&rd.queue);
+    queue_init(&w.queue);
+
+    pthread_t reader, writer;
+    bool started = !pthread_create(&writer, NULL, batch_writer_main, &w);
+    if(started && pthread_create(&reader, NULL, batch_reader_main, &rd)) {
+        chunks[num_files].last = true;
+        queue_push(&w.queue, &chunks[num_files]);
+        pthread_join(writer, NULL);
+        started = false;
+    }
+    if(!started) {
+        fprintf(stderr, "Error: Couldn't start threads\n");
+        queue_free(&w.queue);
+        queue_free(&rd.queue);
+        free(chunks);
+        return -1;
+    }
+
+    int rescode = 0;
+    while(1) {
+
+        chunk_t *chunk = queue_pop(&rd.queue);
+        if(chunk->last) {
+            queue_push(&w.queue, chunk);
+            break;
+        }
+
+        int i = chunk->file;
+        if(chunk->failed) {
+            fprintf(stderr, "Error: Couldn't open file %s\n", files[i]);
+            rescode = -1;
+            continue;
+        }
+
+        c2html_opts_t opts = *base_opts;
+        opts.url = urls[i];
+
+        output_t out;
+        if(out_open(&out, NULL, conf->gzip)) {
+            fprintf(stderr, "Error: Couldn't initialize the compressor\n");
+            free(chunk->data);
+            rescode = -1;
+            continue;
+        }
+
+        int res = convert_to(conf, chunk->data, chunk->used, &out, &opts);
+        if(out_close(&out) && res == 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            res = -1;
+        }
+        free(chunk->data);
+
+        if(res == 0) {
+            chunk->data = out.mem;
+            chunk->used = out.mem_used;
+            queue_push(&w.queue, chunk);
+        } else {
+            free(out.mem);
+            rescode = -1;
+        }
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    queue_free(&w.queue);
+    queue_free(&rd.queue);
+    free(chunks);
+
+    if(w.failed)
+        rescode = -1;
+    return rescode;
+}
+
+/* Converts each of the [num_files] source files, writing
+ * the result of "dir/file.c" to "<outdir>/dir/file.c.html",
+ * or "<outdir>/dir/file.c.html.gz" when compressing.
+ * If [xref] is true, all of the files are scanned before
+ * being converted so that function calls link to their
+ * definitions in any of them.
+ */
+static int batchconv(const config_t *conf, char **files, int num_files,
+                     const char *outdir, const char *bundle_file,
+                     const c2html_opts_t *base_opts, bool xref)
+{
+    if(outdir == NULL)
+        outdir = ".";
+
+    const char *err;
+    int rescode = 0;
+    c2html_xref_t *table = NULL;
+    c2html_bundle_writer_t *bundle = NULL;
+
+    char **urls  = calloc(num_files, sizeof(char*));
+    char **paths = calloc(num_files, sizeof(char*));
+    if(urls == NULL || paths == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        rescode = -1;
+        goto done;
+    }
+
+    for(int i = 0; i < num_files; i += 1) {
+
+        urls[i] = file_url(files[i]);
+
+        // Links keep pointing to the .html files when compressing,
+        // since servers usually map them to the .html.gz ones.
+        // In a bundle, entries are stored by their URL.
+        if(urls[i] != NULL)
+            paths[i] = malloc(strlen(outdir) + strlen(urls[i]) + 5);
+
+        if(paths[i] == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            rescode = -1;
+            goto done;
+        }
+        if(bundle_file != NULL)
+            sprintf(paths[i], "%s%s", urls[i], conf->gzip ? ".gz" : "");
+        else
+            sprintf(paths[i], "%s/%s%s", outdir, urls[i], conf->gzip ? ".gz" : "");
+    }
+
+    if(bundle_file != NULL) {
+        bundle = c2html_bundle_create(bundle_file, &err);
+        if(bundle == NULL) {
+            fprintf(stderr, "Error: %s (%s)\n", err, bundle_file);
+            rescode = -1;
+            goto done;
+        }
+    }
+
+    if(xref) {
+
+        table = c2html_xref_create();
+        if(table == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            rescode = -1;
+            goto done;
+        }
+
+        for(int i = 0; i < num_files; i += 1) {
+
+            long  input_size;
+            char *input = load_file(files[i], &input_size);
+            if(input == NULL)
+                continue; // Reported when converting.
+
+            if(c2html_xref_scan(table, input, input_size, urls[i], &err)) {
+                fprintf(stderr, "Error: %s\n", err);
+                free(input);
+                rescode = -1;
+                goto done;
+            }
+
+            free(input);
+        }
+    }
+
+    c2html_opts_t opts = *base_opts;
+    opts.xref = table;
+
+    if(conf->pipeline) {
+        rescode = batchconv_pipelined(conf, files, paths, urls, num_files, &opts, bundle);
+        goto done;
+    }
+
+    for(int i = 0; i < num_files; i += 1) {
+
+        long  input_size;
+        char *input = load_file(files[i], &input_size);
+        if(input == NULL) {
+            fprintf(stderr, "Error: Couldn't open file %s\n", files[i]);
+            rescode = -1;
+            continue;
+        }
+
+        opts.url = urls[i];
+
+        if(bundle != NULL) {
+
+            output_t out;
+            if(out_open(&out, NULL, conf->gzip)) {
+                fprintf(stderr, "Error: Couldn't initialize the compressor\n");
+                rescode = -1;
+            } else {
+                int res = convert_to(conf, input, input_size, &out, &opts);
+                if(out_close(&out) && res == 0) {
+                    fprintf(stderr, "Error: Out of memory\n");
+                    res = -1;
+                }
+                if(res == 0)
+                    res = store_output(bundle, paths[i], out.mem, out.mem_used);
+                if(res)
+                    rescode = -1;
+                free(out.mem);
+            }
+
+            free(input);
+            continue;
+        }
+
+        FILE *out_fp = NULL;
+        if(make_parent_dirs(paths[i]) == 0)
+            out_fp = fopen(paths[i], "wb");
+
+        if(out_fp == NULL) {
+            fprintf(stderr, "Error: Couldn't open or create file %s\n", paths[i]);
+            rescode = -1;
+        } else {
+            if(convert(conf, input, input_size, out_fp, &opts))
+                rescode = -1;
+            if(fclose(out_fp)) {
+                fprintf(stderr, "Error: Failed to write to %s\n", paths[i]);
+                rescode = -1;
+            }
+        }
+
+        free(input);
+    }
+
+done:
+    if(bundle != NULL && c2html_bundle_finish(bundle, &err)) {
+        fprintf(stderr, "Error: %s (%s)\n", err, bundle_file);
+        rescode = -1;
+    }
+    c2html_xref_free(table);
+    for(int i = 0; i < num_files; i += 1) {
+        if(urls)  free(urls[i]);
+        if(paths) free(paths[i]);
+    }
+    free(paths);
+    free(urls);
+    return rescode;
+}
+
+#ifdef C2H_WATCH
+typedef struct {
+    const config_t      *conf;
+    const c2html_opts_t *opts;
+    const char          *outdir;
+} watch_data_t;
+
+/* Converts a file for --watch, to the same path 
+ * as in batch mode.
+ */
+static int watch_convert(void *data, const char *file)
+{
+    const watch_data_t *wd = data;
+
+    long  input_size;
+    char *input = load_file(file, &input_size);
+    if(input == NULL) {
+        fprintf(stderr, "Error: Couldn't open file %s\n", file);
+        return -1;
+    }
+
+    char *url = file_url(file);
+    char *path = NULL;
+    if(url != NULL)
+        path = malloc(strlen(wd->outdir) + strlen(url) + 5);
+    if(path == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(input);
+        free(url);
+        return -1;
+    }
+    sprintf(path, "%s/%s%s", wd->outdir, url, wd->conf->gzip ? ".gz" : "");
+
+    int rescode = 0;
+    FILE *out_fp = NULL;
+    if(make_parent_dirs(path) == 0)
+        out_fp = fopen(path, "wb");
+
+    if(out_fp == NULL) {
+        fprintf(stderr, "Error: Couldn't open or create file %s\n", path);
+        rescode = -1;
+    } else {
+        if(convert(wd->conf, input, input_size, out_fp, wd->opts))
+            rescode = -1;
+        if(fclose(out_fp)) {
+            fprintf(stderr, "Error: Failed to write to %s\n", path);
+            rescode = -1;
+        }
+    }
+
+    free(path);
+    free(url);
+    free(input);
+    return rescode;
+}
+#endif
+
+/* The checkpoints of a file are stored in a text 
+ * file with a header line, followed by one line 
+ * for each checkpoint:
+ *
+ *   c2html-index 2 <input size> <input hash> <count>
+ *   <offset> <line number> <depth> <comment>
+ *   ...
+ *
+ * The hash is the 64 bit FNV-1a of the input, in
+ * hexadecimal. The index is out of date if either
+ * the size or the hash differ, and so are those of
+ * version 1, which only had the size.
+ */
+static int save_index(const char *file, const char *input, long input_size, 
+                      long every)
+{
+    const char *err;
+    long count;
+    c2html_state_t *checkpoints = c2html_checkpoints(input, input_size, every, 
+                                                     &count, &err);
+    if(checkpoints == NULL) {
+        fprintf(stderr, "Error: %s\n", err);
+        return -1;
+    }
+
+    FILE *fp = fopen(file, "wb");
+    if(fp == NULL) {
+        fprintf(stderr, "Error: Couldn't open or create file %s\n", file);
+        free(checkpoints);
+        return -1;
+    }
+
+    // The hash tells apart versions of the input
+    // that have the same size.
+    bool failed = fprintf(fp, "c2html-index 2 %ld %016llx %ld\n", input_size,
+                          (unsigned long long) c2html_bundle_hash(input, input_size),
+                          count) < 0;
+    for(long i = 0; i < count && !failed; i += 1)
+        failed = fprintf(fp, "%ld %ld %ld %d\n", 
+                         checkpoints[i].offset, checkpoints[i].lineno,
+                         checkpoints[i].depth,  checkpoints[i].comment) < 0;
+
+    failed = fclose(fp) || failed;
+    free(checkpoints);
+
+    if(failed) {
+        fprintf(stderr, "Error: Failed to write to %s\n", file);
+        return -1;
+    }
+    return 0;
+}
+
+static c2html_state_t *load_index(const char *file, const char *input, long input_size, 
+                                  long *count)
+{
+    FILE *fp = fopen(file, "rb");
+    if(fp == NULL) {
+        fprintf(stderr, "Error: Couldn't open file %s\n", file);
+        return NULL;
+    }
+
+    int version;
+    long size, num;
+    unsigned long long hash;
+    if(fscanf(fp, "c2html-index %d", &version) != 1
+        || (version == 2 && (fscanf(fp, "%ld %llx %ld", &size, &hash, &num) != 3 || num < 0))) {
+        fprintf(stderr, "Error: %s isn't a valid index\n", file);
+        fclose(fp);
+        return NULL;
+    }
+
+    // Indexes of older versions didn't store a hash.
+    if(version != 2 || size != input_size 
+        || hash != c2html_bundle_hash(input, input_size)) {
+        fprintf(stderr, "Error: %s is out of date\n", file);
+        fclose(fp);
+        return NULL;
+    }
+
+    c2html_state_t *checkpoints = malloc((num + 1) * sizeof(c2html_state_t));
+    if(checkpoints == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        fclose(fp);
+        return NULL;
+    }
+
+    for(long i = 0; i < num; i += 1) {
+        int comment;
+        c2html_state_t *state = &checkpoints[i];
+        if(fscanf(fp, "%ld %ld %ld %d", &state->offset, &state->lineno,
+                  &state->depth, &comment) != 4
+            || state->offset < 0 || state->offset > input_size 
+            || (state->offset > 0 && input[state->offset-1] != '\n')
+            || (i > 0 && state->lineno <= checkpoints[i-1].lineno)) {
+            fprintf(stderr, "Error: %s isn't a valid index\n", file);
+            free(checkpoints);
+            fclose(fp);
+            return NULL;
+        }
+        state->comment = comment;
+    }
+
+    fclose(fp);
+    *count = num;
+    return checkpoints;
+}
+
+/* Prints the entries of a bundle, one per line,
+ * as "<offset> <length> <hash> <path>".
+ */
+static int bundle_list(const char *file)
+{
+    const char *err;
+    c2html_bundle_t *b = c2html_bundle_open(file, &err);
+    if(b == NULL) {
+        fprintf(stderr, "Error: %s (%s)\n", err, file);
+        return -1;
+    }
+
+    for(long i = 0; i < c2html_bundle_count(b); i += 1) {
+        c2html_bundle_entry_t entry;
+        c2html_bundle_entry(b, i, &entry);
+        printf("%ld %ld %016llx %.*s\n", entry.offset, entry.len,
+               (unsigned long long) entry.hash, (int) entry.path_len, entry.path);
+    }
+
+    c2html_bundle_close(b);
+    return 0;
+}
+
+/* Writes the entry [path] of a bundle to [fp]. */
+static int bundle_extract(const char *file, const char *path, FILE *fp)
+{
+    const char *err;
+    c2html_bundle_t *b = c2html_bundle_open(file, &err);
+    if(b == NULL) {
+        fprintf(stderr, "Error: %s (%s)\n", err, file);
+        return -1;
+    }
+
+    int rescode = 0;
+    c2html_bundle_entry_t entry;
+    if(!c2html_bundle_find(b, path, -1, &entry)) {
+        fprintf(stderr, "Error: No entry %s in %s\n", path, file);
+        rescode = -1;
+    } else if((long) fwrite(entry.data, 1, entry.len, fp) < entry.len) {
+        fprintf(stderr, "Error: Failed to write to output\n");
+        rescode = -1;
+    }
+
+    c2html_bundle_close(b);
+    return rescode;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Converts [input] with [engine] as many times as 
+ * needed to take at least 10 ms, and adds the time
+ * of a single conversion to [*seconds].
+ */
+static char *timed_convert(char *(*engine)(const char*, long, const char*, long*, const char**),
+                           const char *input, long input_size, const char *prefix,
+                           long *output_len, double *seconds)
+{
+    const char *err;
+    char *output = NULL;
+    int runs = 0;
+    double beg = now_seconds();
+    double elapsed;
+    do {
+        free(output);
+        output = engine(input, input_size, prefix, output_len, &err);
+        if(output == NULL) {
+            fprintf(stderr, "Error: %s\n", err);
+            return NULL;
+        }
+        runs += 1;
+        elapsed = now_seconds() - beg;
+    } while(elapsed < 0.01);
+    *seconds += elapsed / runs;
+    return output;
+}
+
+/* Converts [input] with the library and with the
+ * reference engine, reporting the first byte where
+ * their outputs differ. The time each one took is
+ * added to [times].
+ */
+static int check_engines(const char *name, const char *input, long input_size,
+                         const char *prefix, double times[2])
+{
+    long out_len, ref_len;
+    char *out = timed_convert(c2html, input, input_size, prefix, &out_len, &times[0]);
+    char *ref = timed_convert(c2html_reference, input, input_size, prefix, &ref_len, &times[1]);
+
+    int rescode = 0;
+    if(out == NULL || ref == NULL)
+        rescode = -1;
+    else {
+        long i = 0;
+        while(i < out_len && i < ref_len && out[i] == ref[i])
+            i += 1;
+
+        if(i < out_len || i < ref_len) {
+
+            long line = 1;
+            long line_off = 0;
+            for(long k = 0; k < i; k += 1)
+                if(out[k] == '\n') {
+                    line += 1;
+                    line_off = k + 1;
+                }
+
+            fprintf(stderr, "Error: The engines differ on %s at byte %ld of the output (line %ld)\n",
+                    name, i, line);
+            fprintf(stderr, "  optimized: %.*s\n", (int) strcspn(out + line_off, "\n"), out + line_off);
+            fprintf(stderr, "  reference: %.*s\n", (int) strcspn(ref + line_off, "\n"), ref + line_off);
+            rescode = -1;
+        }
+    }
+
+    free(out);
+    free(ref);
+    return rescode;
+}
+
+static void print_throughput(long bytes, int count, const double times[2])
+{
+    double mb = bytes / 1e6;
+    fprintf(stdout, "Checked %d file%s (%.2f MB)\n", count, count == 1 ? "" : "s", mb);
+    if(times[0] > 0 && times[1] > 0)
+        fprintf(stdout, "  optimized: %8.1f MB/s\n"
+                        "  reference: %8.1f MB/s (%.2fx)\n",
+                        mb / times[0], mb / times[1], times[1] / times[0]);
+}
+
+/* Reports how well the --line-cache worked, since
+ * it's only worth its memory for repeated lines.
+ */
+static void print_line_cache_stats(c2html_line_cache_t *cache)
+{
+    if(cache == NULL)
+        return;
+
+    c2html_cache_stats_t stats;
+    c2html_line_cache_stats(cache, &stats);
+
+    long lookups = stats.hits + stats.misses;
+    fprintf(stderr, "Line cache: %ld hits, %ld misses (%.1f%% hit rate), "
+                    "%ld evictions, %ld lines in %ld KB\n",
+            stats.hits, stats.misses, lookups ? 100.0 * stats.hits / lookups : 0.0,
+            stats.evictions, stats.entries, stats.bytes / 1024);
+}
+
+/* Adds the names listed in [file] to [*dict] as
+ * a [kind], creating it if it's NULL.
+ */
+static int load_dict(c2html_dict_t **dict, const char *file, c2html_word_t kind)
+{
+    if(*dict == NULL) {
+        *dict = c2html_dict_create();
+        if(*dict == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return -1;
+        }
+    }
+
+    long  size;
+    char *data = load_file(file, &size);
+    if(data == NULL) {
+        fprintf(stderr, "Error: Failed to open file %s\n", file);
+        return -1;
+    }
+
+    const char *err;
+    int res = c2html_dict_load(*dict, data, size, kind, &err);
+    if(res)
+        fprintf(stderr, "Error: %s (in %s)\n", err, file);
+
+    free(data);
+    return res;
+}
+
+/* Parses a line range of the form "A-B", "A-" or "A".
+ * A missing end means up to the end of the file.
+ */
+static bool parse_lines(const char *str, long *first, long *last)
+{
+    char *end;
+    *first = strtol(str, &end, 10);
+    if(end == str || *first < 1)
+        return false;
+
+    if(*end == '\0') {
+        *last = *first;
+        return true;
+    }
+
+    if(*end != '-')
+        return false;
+    str = end + 1;
+
+    if(*str == '\0') {
+        *last = 0;
+        return true;
+    }
+
+    *last = strtol(str, &end, 10);
+    return end != str && *end == '\0' && *last >= *first;
+}
+
+static void print_help(FILE *fp, char *name) {
+    fprintf(fp, 
+        "\n"
+        " c2html is a tool to add HTML syntax highlighting to C code.\n"
+        "\n"
+        " Basically you give  c2html  some C code  as input and  it classifies \n"
+        " all the keywords, identifiers etc using <span> elements, associating \n"
+        " them with the appropriate  class names. By applying a CSS stylesheet \n"
+        " to the generated output, you get the highliting!\n"
+        "\n"
+        " The usage is:\n"
+        "     $ %s [-i file.c] [-o file.html] [--style file.css] [-p <prefix>] [-t [-s <token>] [-e <token>]]\n" 
+        "     $ %s [options] [-d <dir>] file1.c file2.c ...\n" 
+        "     $ %s --bundle <file.c2hb> [--list | --extract <path> [-o file.html]]\n" 
+        "     $ %s --watch [options] [-d <dir>] file1.c dir ...\n" 
+        "     $ %s --diff [options] [-C <N>] [-o file.html] old.c new.c\n" 
+        "\n"
+        " ..and here's a table of all available options:\n"
+        "\n"
+        "     -h,   --help             Show this message\n"
+        "\n"
+        "     -i,  --input     file.c  File containing C code that needs\n"
+        "                              to be converted\n"
+        "\n"
+        "     -o, --output  file.html  HTML file where the output will be\n"
+        "                              written to\n"
+        "\n"
+        "          --style  style.css  CSS stylesheet that will be added\n"
+        "                              to the HTML output\n"
+        "\n"
+        "     -p, --prefix   <prefix>  The prefix of the HTML element's\n"
+        "                              class names. The default is \"c2h-\"\n"
+        "\n"
+        "     -t, --template           Only highlight the substrings of the\n"
+        "                              input between the <c2html> and </c2html>\n"
+        "                              tokens. The rest is copied unchanged.\n"
+        "                              It's possible to change these tokens\n"
+        "                              with --begin and --end.\n"
+        "                              When using this mode, --style is ignored\n"
+        "\n"
+        "     -b, --begin    <string>  Specify the start of each substring to\n"
+        "                              be converted. It only work when --template\n"
+        "                              is also specified\n"
+        "\n"
+        "     -e, --end      <string>  Specify the end of each substring to be\n"
+        "                              be converted. It only works when --template\n"
+        "                              is also specified\n"
+        "\n"
+        "     -d, --outdir      <dir>  When a list of files is given, each file\n"
+        "                              is converted to <dir>/<file>.html. The\n"
+        "                              default is the current directory\n"
+        "\n"
+        "     -x, --xref               Link function calls to the definitions\n"
+        "                              of the functions. With a list of files,\n"
+        "                              calls link to definitions in any of them\n"
+        "\n"
+        "          --lines        A-B  Only convert the lines from A to B. If B\n"
+        "                              is omitted, up to the end of the file\n"
+        "\n"
+        "          --index   file.idx  Use the checkpoints stored in file.idx\n"
+        "                              to start from the line closest to the\n"
+        "                              range of --lines\n"
+        "\n"
+        "          --make-index file.idx\n"
+        "                              Don't convert the input but store its\n"
+        "                              checkpoints in file.idx, to be used with\n"
+        "                              --index\n"
+        "\n"
+        "          --every        <N>  Store a checkpoint every N lines when\n"
+        "                              using --make-index. The default is 1000\n"
+        "\n"
+        "     -z, --gzip               Compress the output with gzip. With a\n"
+        "                              list of files, the .gz extension is added\n"
+        "                              to the output files\n"
+        "\n"
+        "          --types  types.txt  Highlight the names listed in types.txt,\n"
+        "                              separated by whitespace, as types\n"
+        "\n"
+        "       --keywords  words.txt  Highlight the names listed in words.txt\n"
+        "                              as keywords\n"
+        "\n"
+        "           --utf8             Allow non-ASCII letters in identifiers\n"
+        "                              when the input is valid UTF-8\n"
+        "\n"
+        "         --bundle  file.c2hb  With a list of files, store all of the\n"
+        "                              outputs in file.c2hb instead of one\n"
+        "                              file each. Entries are named like the\n"
+        "                              files of --outdir\n"
+        "\n"
+        "          --list              List the entries of the --bundle as\n"
+        "                              <offset> <length> <hash> <path>\n"
+        "\n"
+        "          --extract   <path>  Write the entry <path> of the --bundle\n"
+        "                              to the output\n"
+        "\n"
+        "          --serve      <dir>  Serve the files in <dir> as highlighted\n"
+        "                              pages on http://127.0.0.1:<port>/\n"
+        "\n"
+        "          --port         <N>  Port of --serve. The default is 8080\n"
+        "\n"
+        "          --threads      <N>  Number of threads converting files for\n"
+        "                              --serve or --watch. The default is one\n"
+        "                              per CPU\n"
+        "\n"
+        "          --check             Compare the output with the one of the\n"
+        "                              reference engine, and the time each one\n"
+        "                              takes, for the input or a list of files\n"
+        "\n"
+        "          --watch             Convert the listed files, and the .c and\n"
+        "                              .h files in the listed directories, each\n"
+        "                              time they change\n"
+        "\n"
+        "          --diff              Given two versions of a file, only\n"
+        "                              convert the lines that changed, marked\n"
+        "                              as removed or added, and the ones\n"
+        "                              around them\n"
+        "\n"
+        "          --grep   <pattern>  Only convert the lines containing the\n"
+        "                              pattern, and the ones around them\n"
+        "\n"
+        "     -C, --context       <N>  Number of lines shown around the changes\n"
+        "                              of --diff or the matches of --grep. The\n"
+        "                              default is 3\n"
+        "\n"
+        "     --line-cache       <MB>  Reuse the output of the lines that were\n"
+        "                              already converted, up to MB megabytes,\n"
+        "                              and report how many were found\n"
+        "\n"
+        "          --pipeline          Read the input, convert it and write the\n"
+        "                              output at the same time using multiple\n"
+        "                              threads. A single file is converted as\n"
+        "                              it's read\n"
+        "\n", name, name, name, name, name);
+}
+
+int main(int argc, char **argv)
+{
+    /* Parse command-line arguments */
+    char *input_file = NULL, 
+        *output_file = NULL,
+         *style_file = NULL,
+        *templ_begin = NULL,
+          *templ_end = NULL,
+             *prefix = NULL,
+             *outdir = NULL,
+         *index_file = NULL,
+         *make_index = NULL,
+             *bundle = NULL,
+               *grep = NULL,
+            *extract = NULL,
+          *serve_dir = NULL;
+    bool    template = 0,
+                xref = 0,
+                gzip = 0,
+            pipeline = 0,
+                utf8 = 0,
+          watch_mode = 0,
+           diff_mode = 0,
+               check = 0,
+                list = 0;
+    long  first_line = 0,
+           last_line = 0,
+               every = 1000,
+             context = 3,
+                port = 8080,
+             threads = 0,
+          line_cache = 0;
+    c2html_dict_t *dict = NULL;
+
+    char **files = malloc(argc * sizeof(char*));
+    int num_files = 0;
+    if(files == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+
+    for(int i = 1; i < argc; i += 1) {
+        if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+
+            print_help(stdout, argv[0]);
+            return -1;
+
+        } else if(!strcmp(argv[i], "-i") || !strcmp(argv[i], "--input")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            input_file = argv[i];
+        } else if(!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            output_file = argv[i];
+        } else if(!strcmp(argv[i], "-p") || !strcmp(argv[i], "--prefix")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            prefix = argv[i];
+        } else if(!strcmp(argv[i], "-t") || !strcmp(argv[i], "--template")) {
+
+            template = 1;
+
+        } else if(!strcmp(argv[i], "-b") || !strcmp(argv[i], "--begin")) {
+
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            templ_begin = argv[i];
+
+        } else if(!strcmp(argv[i], "-e") || !strcmp(argv[i], "--end")) {
+
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            templ_end = argv[i];
+
+        } else if(!strcmp(argv[i], "--style")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            style_file = argv[i];
+        } else if(!strcmp(argv[i], "-d") || !strcmp(argv[i], "--outdir")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            outdir = argv[i];
+        } else if(!strcmp(argv[i], "-x") || !strcmp(argv[i], "--xref")) {
+
+            xref = 1;
+
+        } else if(!strcmp(argv[i], "--types") || !strcmp(argv[i], "--keywords")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            c2html_word_t kind = strcmp(argv[i-1], "--types") ? C2HTML_KWORD : C2HTML_TYPE;
+            if(load_dict(&dict, argv[i], kind))
+                return -1;
+        } else if(!strcmp(argv[i], "--utf8")) {
+
+            utf8 = 1;
+
+        } else if(!strcmp(argv[i], "-z") || !strcmp(argv[i], "--gzip")) {
+
+            gzip = 1;
+
+        } else if(!strcmp(argv[i], "--bundle")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            bundle = argv[i];
+        } else if(!strcmp(argv[i], "--list")) {
+
+            list = 1;
+
+        } else if(!strcmp(argv[i], "--extract")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            extract = argv[i];
+        } else if(!strcmp(argv[i], "--serve")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            serve_dir = argv[i];
+        } else if(!strcmp(argv[i], "--port") || !strcmp(argv[i], "--threads")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            long value = atol(argv[i]);
+            if(value < 1 || value > 65535) {
+                fprintf(stderr, "Error: Invalid argument %s for %s\n", argv[i], argv[i-1]);
+                return -1;
+            }
+            if(!strcmp(argv[i-1], "--port"))
+                port = value;
+            else
+                threads = value;
+        } else if(!strcmp(argv[i], "--line-cache")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            // Given in MB, and stored in bytes.
+            line_cache = atol(argv[i]);
+            if(line_cache < 1 || line_cache > (LONG_MAX >> 20)) {
+                fprintf(stderr, "Error: Invalid argument %s for %s\n", argv[i], argv[i-1]);
+                return -1;
+            }
+        } else if(!strcmp(argv[i], "--pipeline")) {
+
+            pipeline = 1;
+
+        } else if(!strcmp(argv[i], "--watch")) {
+
+            watch_mode = 1;
+
+        } else if(!strcmp(argv[i], "--diff")) {
+
+            diff_mode = 1;
+
+        } else if(!strcmp(argv[i], "--grep")) {
+            // Patterns can start with '-', as in "->next".
+            i += 1;
+            if(i == argc) {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            grep = argv[i];
+            if(grep[0] == '\0') {
+                fprintf(stderr, "Error: Empty pattern for %s\n", argv[i-1]);
+                return -1;
+            }
+        } else if(!strcmp(argv[i], "-C") || !strcmp(argv[i], "--context")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            char *end;
+            context = strtol(argv[i], &end, 10);
+            if(end == argv[i] || *end != '\0' || context < 0) {
+                fprintf(stderr, "Error: Invalid argument %s for %s\n", argv[i], argv[i-1]);
+                return -1;
+            }
+        } else if(!strcmp(argv[i], "--check")) {
+
+            check = 1;
+
+        } else if(!strcmp(argv[i], "--lines")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            if(!parse_lines(argv[i], &first_line, &last_line)) {
+                fprintf(stderr, "Error: Invalid line range %s\n", argv[i]);
+                return -1;
+            }
+        } else if(!strcmp(argv[i], "--index")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            index_file = argv[i];
+        } else if(!strcmp(argv[i], "--make-index")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            make_index = argv[i];
+        } else if(!strcmp(argv[i], "--every")) {
+            i += 1;
+            if(i == argc || argv[i][0] == '-') {
+                fprintf(stderr, "Error: Missing argument after %s\n", argv[i-1]);
+                return -1;
+            }
+            every = atol(argv[i]);
+            if(every < 1) {
+                fprintf(stderr, "Error: Invalid argument %s for %s\n", argv[i], argv[i-1]);
+                return -1;
+            }
+        } else if(argv[i][0] != '-') {
+            files[num_files++] = argv[i];
+        } else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
             return -1;
         }
     }
 
-    int rescode;
+    if(list || extract != NULL) {
+
+        free(files);
+
+        if(bundle == NULL) {
+            fprintf(stderr, "Error: --list and --extract need a --bundle\n");
+            return -1;
+        }
+
+        if(list)
+            return bundle_list(bundle);
+
+        FILE *fp = stdout;
+        if(output_file != NULL) {
+            fp = fopen(output_file, "wb");
+            if(fp == NULL) {
+                fprintf(stderr, "Error: Couldn't open or create file %s\n", output_file);
+                return -1;
+            }
+        }
+
+        int rescode = bundle_extract(bundle, extract, fp);
+        if(fp != stdout && fclose(fp)) {
+            fprintf(stderr, "Error: Failed to write to %s\n", output_file);
+            rescode = -1;
+        }
+        return rescode;
+    }
+
+    if(prefix == NULL)
+        prefix = "c2h-";
+
+    if(check) {
+
+        if(template || xref || dict != NULL || utf8 || first_line > 0 || last_line > 0
+        || line_cache > 0)
+            fprintf(stderr, "Warning: Only --prefix is used with --check\n");
+
+        int rescode = 0;
+        long bytes = 0;
+        double times[2] = {0, 0};
+
+        if(num_files == 0) {
+            FILE *fp = stdin;
+            if(input_file != NULL && (fp = fopen(input_file, "rb")) == NULL) {
+                fprintf(stderr, "Error: Couldn't open file %s\n", input_file);
+                return -1;
+            }
+            const char *err;
+            long  input_size;
+            char *input = load_from_stream(fp, &input_size, &err);
+            if(fp != stdin)
+                fclose(fp);
+            if(input == NULL) {
+                fprintf(stderr, "Error: Failed to read input (%s)\n", err);
+                return -1;
+            }
+            rescode = check_engines(input_file ? input_file : "stdin", 
+                                    input, input_size, prefix, times);
+            bytes = input_size;
+            free(input);
+        }
+
+        for(int i = 0; i < num_files; i += 1) {
+            long  input_size;
+            char *input = load_file(files[i], &input_size);
+            if(input == NULL) {
+                fprintf(stderr, "Error: Couldn't open file %s\n", files[i]);
+                rescode = -1;
+                continue;
+            }
+            if(check_engines(files[i], input, input_size, prefix, times))
+                rescode = -1;
+            bytes += input_size;
+            free(input);
+        }
+
+        print_throughput(bytes, num_files ? num_files : 1, times);
+        c2html_dict_free(dict);
+        free(files);
+        return rescode;
+    }
+
+    config_t conf = {
+        .style_data  = NULL,
+        .templ_begin = templ_begin,
+        .templ_end   = templ_end,
+        .template    = template,
+        .gzip        = gzip,
+        .pipeline    = pipeline,
+        .grep        = grep,
+        .context     = context,
+    };
+
+#ifndef C2H_ZLIB
+    if(gzip) {
+        fprintf(stderr, "Error: --gzip isn't available since c2html was built without zlib\n");
+        return -1;
+    }
+#endif
+    c2html_opts_t opts = { 
+        .prefix     = prefix,
+        .dict       = dict,
+        .first_line = first_line,
+        .last_line  = last_line,
+        .utf8       = utf8,
+    };
+
     if(template) {
         if(style_file != NULL)
             fprintf(stderr, "Warning: --style is ignored when using --template or -t\n");
-        rescode = tmplconv(in_fp, out_fp, prefix, templ_begin, templ_end);
     } else {
         if(templ_begin != NULL || templ_end != NULL)
             fprintf(stderr, "Warning: --begin and --end are ignored when not using --template\n");
-        rescode = fileconv(in_fp, out_fp, style_file, prefix);
+        if(style_file != NULL) {
+            conf.style_data = load_file(style_file, NULL);
+            if(conf.style_data == NULL) {
+                fprintf(stderr, "Error: Failed to open file %s\n", style_file);
+                return -1;
+            }
+        }
+    }
+
+    if(grep != NULL) {
+        if(template) {
+            fprintf(stderr, "Warning: --grep is ignored when using --template\n");
+            conf.grep = NULL;
+        } else if(first_line > 0 || last_line > 0)
+            fprintf(stderr, "Warning: --lines is ignored when using --grep\n");
+    }
+
+    if(serve_dir != NULL) {
+#ifdef C2H_SERVE
+        if(template || grep != NULL || line_cache > 0)
+            fprintf(stderr, "Warning: --template, --grep and --line-cache are ignored when using --serve\n");
+
+        // Each request converts a whole file, so there's
+        // no use for the line range.
+        opts.first_line = 0;
+        opts.last_line  = 0;
+
+        if(threads == 0)
+            threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        serve_config_t serve_config = {
+            .root       = serve_dir,
+            .port       = port,
+            .threads    = threads,
+            .style_data = conf.style_data,
+            .opts       = &opts,
+        };
+        serve(&serve_config);
+        return -1;
+#else
+        (void) port;
+        fprintf(stderr, "Error: --serve isn't available on this platform\n");
+        return -1;
+#endif
+    }
+
+    if(watch_mode) {
+#ifdef C2H_WATCH
+        if(num_files == 0) {
+            fprintf(stderr, "Error: --watch needs a list of files or directories\n");
+            return -1;
+        }
+
+        if(input_file != NULL || output_file != NULL) {
+            fprintf(stderr, "Error: --input and --output can't be used with --watch\n");
+            return -1;
+        }
+
+        // Changing a file can change the links of all of
+        // the others, so cross-references aren't updated.
+        if(xref || bundle != NULL || index_file != NULL || make_index != NULL)
+            fprintf(stderr, "Warning: --xref, --bundle and the index options are ignored when using --watch\n");
+
+        // Files are converted by many threads, while
+        // the line cache is for one thread at a time.
+        if(line_cache > 0)
+            fprintf(stderr, "Warning: --line-cache is ignored when using --watch\n");
+        opts.checkpoints = NULL;
+
+        if(threads == 0)
+            threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        watch_data_t data = {
+            .conf   = &conf,
+            .opts   = &opts,
+            .outdir = outdir ? outdir : ".",
+        };
+        watch_config_t watch_config = {
+            .paths     = files,
+            .num_paths = num_files,
+            .threads   = threads,
+            .debounce  = 100,
+            .convert   = watch_convert,
+            .data      = &data,
+        };
+        watch(&watch_config);
+        return -1;
+#else
+        (void) threads;
+        fprintf(stderr, "Error: --watch isn't available on this platform\n");
+        return -1;
+#endif
+    }
+
+    if(diff_mode) {
+
+        if(num_files != 2) {
+            fprintf(stderr, "Error: --diff needs two files, the old version and the new one\n");
+            return -1;
+        }
+
+        if(template || xref || grep != NULL || first_line > 0 || last_line > 0 
+        || input_file != NULL || bundle != NULL || index_file != NULL || make_index != NULL)
+            fprintf(stderr, "Warning: --template, --xref, --grep, --lines, --input, --bundle and the index options are ignored when using --diff\n");
+
+        long  old_size, new_size;
+        char *old_input = load_file(files[0], &old_size);
+        char *new_input = load_file(files[1], &new_size);
+        if(old_input == NULL || new_input == NULL) {
+            fprintf(stderr, "Error: Couldn't open file %s\n", old_input ? files[1] : files[0]);
+            free(old_input);
+            free(new_input);
+            return -1;
+        }
+
+        FILE *out_fp = stdout;
+        if(output_file != NULL && (out_fp = fopen(output_file, "wb")) == NULL) {
+            fprintf(stderr, "Error: Couldn't open or create file %s\n", output_file);
+            free(old_input);
+            free(new_input);
+            return -1;
+        }
+
+        int rescode = 0;
+        output_t out;
+        if(out_open(&out, out_fp, gzip)) {
+            fprintf(stderr, "Error: Couldn't initialize the compressor\n");
+            rescode = -1;
+        } else {
+            rescode = diffconv(old_input, old_size, new_input, new_size, context,
+                               &out, conf.style_data, &opts);
+            if(out_close(&out) && rescode == 0) {
+                fprintf(stderr, "Error: Failed to write to output\n");
+                rescode = -1;
+            }
+        }
+
+        if(out_fp != stdout && fclose(out_fp) && rescode == 0) {
+            fprintf(stderr, "Error: Failed to write to %s\n", output_file);
+            rescode = -1;
+        }
+
+        free(old_input);
+        free(new_input);
+        free((char*) conf.style_data);
+        c2html_dict_free(dict);
+        free(files);
+        return rescode;
+    }
+
+    // Lines are converted by one thread at a time from
+    // here on, so the line cache can be used.
+    if(line_cache > 0) {
+        opts.line_cache = c2html_line_cache_create(line_cache << 20);
+        if(opts.line_cache == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return -1;
+        }
+        if(xref)
+            fprintf(stderr, "Warning: --line-cache has no effect when using --xref\n");
+    }
+
+    if(num_files > 0) {
+
+        if(input_file != NULL || output_file != NULL) {
+            fprintf(stderr, "Error: --input and --output can't be used with a list of files\n");
+            return -1;
+        }
+
+        if(index_file != NULL || make_index != NULL) {
+            fprintf(stderr, "Error: --index and --make-index can't be used with a list of files\n");
+            return -1;
+        }
+
+        if(bundle != NULL && outdir != NULL)
+            fprintf(stderr, "Warning: --outdir is ignored when using --bundle\n");
+
+        int rescode = batchconv(&conf, files, num_files, outdir, bundle, &opts, xref);
+        print_line_cache_stats(opts.line_cache);
+        c2html_line_cache_free(opts.line_cache);
+        free((char*) conf.style_data);
+        c2html_dict_free(dict);
+        free(files);
+        return rescode;
+    }
+
+    if(outdir != NULL)
+        fprintf(stderr, "Warning: --outdir is ignored when not using a list of files\n");
+
+    if(bundle != NULL)
+        fprintf(stderr, "Warning: --bundle is ignored when not using a list of files, --list or --extract\n");
+
+    // A single file is only converted while it's being read when
+    // the whole of it is converted and no previous pass over it
+    // is needed.
+    if(pipeline && (template || xref || grep != NULL || first_line > 0 || last_line > 0 
+                 || index_file != NULL || make_index != NULL)) {
+        fprintf(stderr, "Warning: --pipeline is ignored when using --template, --xref, --grep, --lines or an index with a single file\n");
+        pipeline = 0;
+    }
+
+    if(make_index != NULL && output_file != NULL) {
+        fprintf(stderr, "Warning: --output is ignored when using --make-index\n");
+        output_file = NULL;
+    }
+
+    bool use_stdin = (input_file == NULL);
+    bool use_stdout = (output_file == NULL);
+ 
+    FILE *in_fp, *out_fp;
+
+    if(use_stdin)
+        in_fp = stdin;
+    else {
+        in_fp = fopen(input_file, "rb");
+        if(in_fp == NULL) {
+            fprintf(stderr, "Error: Couldn't open file %s\n", input_file);
+            return -1;
+        }
     }
 
+    if(output_file == NULL)
+        out_fp = stdout;
+    else {
+        out_fp = fopen(output_file, "wb");
+        if(out_fp == NULL) {
+            if(!use_stdin)
+                fclose(in_fp);
+            fprintf(stderr, "Error: Couldn't open or create file %s\n", output_file);
+            return -1;
+        }
+    }
+
+    int rescode;
+    const char *err;
+    long  input_size;
+    char *input = NULL;
+    if(pipeline)
+        rescode = fileconv_pipelined(in_fp, out_fp, &conf, &opts);
+    else if((input = load_from_stream(in_fp, &input_size, &err)) == NULL) {
+        fprintf(stderr, "Error: Failed to read input (%s)\n", err);
+        rescode = -1;
+    } else if(make_index != NULL) {
+
+        rescode = save_index(make_index, input, input_size, every);
+        free(input);
+
+    } else {
+
+        c2html_state_t *checkpoints = NULL;
+        if(index_file != NULL)
+            checkpoints = load_index(index_file, input, input_size, &opts.num_checkpoints);
+
+        if(index_file != NULL && checkpoints == NULL)
+            rescode = -1;
+        else {
+
+            c2html_xref_t *table = NULL;
+            rescode = 0;
+            if(xref) {
+                table = c2html_xref_create();
+                if(table == NULL || c2html_xref_scan(table, input, input_size, "", &err)) {
+                    fprintf(stderr, "Error: %s\n", table ? err : "Out of memory");
+                    rescode = -1;
+                }
+                opts.xref = table;
+                opts.url  = "";
+            }
+
+            opts.checkpoints = checkpoints;
+            if(rescode == 0)
+                rescode = convert(&conf, input, input_size, out_fp, &opts);
+
+            c2html_xref_free(table);
+            free(checkpoints);
+        }
+        free(input);
+    }
+
+    print_line_cache_stats(opts.line_cache);
+    c2html_line_cache_free(opts.line_cache);
+    free((char*) conf.style_data);
+    c2html_dict_free(dict);
+    free(files);
+
     if(!use_stdin) fclose(in_fp);
     if(!use_stdout) fclose(out_fp);
     return rescode;
-}
\ No newline at end of file
+}
@@ -0,0 +1,610 @@
+/* Fuzz target that checks that every way of converting
+ * an input gives the output of the reference engine.
+ *
+ * Built by "make fuzz" as a standalone program that
+ * checks the files it's given, or random inputs if
+ * there aren't any. With clang, it can be built for
+ * libFuzzer by defining C2H_LIBFUZZER:
+ *
+ *   make fuzz CC=clang FUZZFLAGS="-fsanitize=fuzzer,address -DC2H_LIBFUZZER"
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include "c2html.h"
+#include "reference.h"
+
+typedef struct {
+    char *data;
+    long  used;
+    long  size;
+} sink_buff_t;
+
+static int collect(void *data, const char *str, long len)
+{
+    sink_buff_t *b = data;
+    if(b->used + len > b->size) {
+        long new_size = 2 * (b->used + len);
+        char *temp = realloc(b->data, new_size);
+        if(temp == NULL)
+            return -1;
+        b->data = temp;
+        b->size = new_size;
+    }
+    memcpy(b->data + b->used, str, len);
+    b->used += len;
+    return 0;
+}
+
+/* Copies the output of a pool job into a [sink_buff_t],
+ * whose size is set last to tell that it's done.
+ */
+static void pool_done(void *data, const char *output, long output_len,
+                      const char *error)
+{
+    (void) error;
+    sink_buff_t *b = data;
+    b->data = malloc(output_len + 1);
+    if(output == NULL || b->data == NULL)
+        abort();
+    memcpy(b->data, output, output_len);
+    b->used = output_len;
+    __atomic_store_n(&b->size, output_len + 1, __ATOMIC_RELEASE);
+}
+
+/* Aborts reporting the first differing byte. */
+static void compare(const char *what, const char *expected, long expected_len,
+                    const char *actual, long actual_len)
+{
+    long i = 0;
+    while(i < expected_len && i < actual_len && expected[i] == actual[i])
+        i += 1;
+
+    if(i == expected_len && i == actual_len)
+        return;
+
+    fprintf(stderr, "Mismatch of %s at byte %ld (of %ld and %ld)\n",
+            what, i, expected_len, actual_len);
+    fprintf(stderr, "  expected: %.40s\n", expected + (i > 20 ? i - 20 : 0));
+    fprintf(stderr, "  actual:   %.40s\n", actual + (i > 20 ? i - 20 : 0));
+    abort();
+}
+
+/* Converts [str] with [c2html_feed] in pieces of [step]
+ * bytes, each time with what wasn't consumed by the last
+ * call. Returns NULL on success, else the error.
+ */
+static const char *feed_all(const char *str, long len, long step,
+                            const c2html_opts_t *opts, sink_buff_t *b)
+{
+    b->used = 0;
+    c2html_state_t state = {0};
+    long off = 0;
+    long end = 0;
+    while(1) {
+        end += step;
+        if(end > len)
+            end = len;
+        const char *error = "No error";
+        long n = c2html_feed(&state, str + off, end - off, end == len,
+                             opts, collect, b, &error);
+        if(n < 0)
+            return error;
+        off += n;
+        if(end == len)
+            return NULL;
+    }
+}
+
+/* Reads the output of [c2html_iter_read] in pieces
+ * of [step] bytes. Returns NULL on success, else the
+ * error.
+ */
+static const char *iter_all(const char *str, long len, long step,
+                            const c2html_opts_t *opts, sink_buff_t *b)
+{
+    b->used = 0;
+    const char *error = "No error";
+    c2html_iter_t *it = c2html_iter_create(str, len, opts, &error);
+    if(it == NULL)
+        return error;
+    char chunk[97];
+    long n;
+    while((n = c2html_iter_read(it, chunk, step, &error)) > 0)
+        collect(b, chunk, n);
+    c2html_iter_free(it);
+    return n < 0 ? error : NULL;
+}
+
+/* Aborts if [error] isn't [expected], or if it's
+ * NULL and the output isn't [ref].
+ */
+static void check_result(const char *what, const char *error, const char *expected,
+                         const char *ref, long ref_len, const char *out, long out_len)
+{
+    if(error != expected) {
+        fprintf(stderr, "Expected %s to give \"%s\" but it gave \"%s\"\n",
+                what, expected ? expected : "no error", error ? error : "no error");
+        abort();
+    }
+    if(expected == NULL)
+        compare(what, ref, ref_len, out, out_len);
+}
+
+/* Converts [str] in all of the ways that take limits,
+ * which must fail with [expected], or give [ref] if
+ * it's NULL. The limits apply to each call of
+ * c2html_feed, so it gets the whole input at once.
+ */
+static void check_limits(const char *str, long len, const c2html_opts_t *opts,
+                         const char *expected, const char *ref, long ref_len)
+{
+    const char *error = "No error";
+    long out_len = 0;
+    char *out = c2html_ex(str, len, opts, &out_len, &error);
+    check_result("c2html_ex", out ? NULL : error, expected, ref, ref_len, out, out_len);
+    free(out);
+
+    sink_buff_t b = {0};
+    error = "No error";
+    if(c2html_write(str, len, opts, collect, &b, &error) == 0)
+        error = NULL;
+    check_result("c2html_write", error, expected, ref, ref_len, b.data, b.used);
+
+    error = feed_all(str, len, len + 1, opts, &b);
+    check_result("c2html_feed", error, expected, ref, ref_len, b.data, b.used);
+
+    error = iter_all(str, len, 97, opts, &b);
+    check_result("c2html_iter_read", error, expected, ref, ref_len, b.data, b.used);
+    free(b.data);
+}
+
+/* Returns the lowest [max_tokens] that [str] can
+ * be converted with.
+ */
+static long count_tokens(const char *str, long len)
+{
+    c2html_opts_t opts = { .prefix = "c2h-" };
+    long lo = 1;
+    long hi = 2 * len + 2;
+    while(lo < hi) {
+        opts.max_tokens = lo + (hi - lo) / 2;
+        const char *error = NULL;
+        char *out = c2html_ex(str, len, &opts, NULL, &error);
+        if(out != NULL)
+            hi = opts.max_tokens;
+        else if(error == c2html_err_token_limit)
+            lo = opts.max_tokens + 1;
+        else
+            abort();
+        free(out);
+    }
+    return lo;
+}
+
+static bool count_calls(void *data)
+{
+    *(long*) data += 1;
+    return false;
+}
+
+static bool cancel_now(void *data)
+{
+    (void) data;
+    return true;
+}
+
+/* Checks each limit right at the size of the conversion
+ * of [str], which gives [ref], and just below it.
+ */
+static void check_all_limits(const char *str, long len, const char *ref, long ref_len)
+{
+    // Limits equal to the size of the conversion don't
+    // change it, while lower ones make it fail.
+    c2html_opts_t limits = { .prefix = "c2h-", .max_input = len };
+    check_limits(str, len, &limits, NULL, ref, ref_len);
+    if(len > 1) {
+        limits.max_input = len - 1;
+        check_limits(str, len, &limits, c2html_err_input_limit, ref, ref_len);
+    }
+
+    limits = (c2html_opts_t) { .prefix = "c2h-", .max_output = ref_len };
+    check_limits(str, len, &limits, NULL, ref, ref_len);
+    limits.max_output = ref_len - 1;
+    check_limits(str, len, &limits, c2html_err_output_limit, ref, ref_len);
+
+    long tokens = count_tokens(str, len);
+    limits = (c2html_opts_t) { .prefix = "c2h-", .max_tokens = tokens };
+    check_limits(str, len, &limits, NULL, ref, ref_len);
+    if(tokens > 1) {
+        limits.max_tokens = tokens - 1;
+        check_limits(str, len, &limits, c2html_err_token_limit, ref, ref_len);
+    }
+
+    // Each version of a diff is scanned, then its rows
+    // are rendered again, which isn't counted. Against
+    // an empty version, all of the rows are rendered.
+    sink_buff_t b = {0};
+    limits.max_tokens = tokens;
+    if(c2html_diff("", 0, str, len, 3, &limits, collect, &b, NULL)
+        || c2html_diff(str, len, "", 0, 3, &limits, collect, &b, NULL))
+        abort();
+    if(tokens > 1) {
+        const char *error = NULL;
+        limits.max_tokens = tokens - 1;
+        if(!c2html_diff("", 0, str, len, 3, &limits, collect, &b, &error)
+            || error != c2html_err_token_limit)
+            abort();
+    }
+
+    // So are the lines that grep shows. With newlines
+    // as the pattern, all of them are.
+    if(len > 0) {
+        limits.max_tokens = tokens;
+        const char *pattern = memchr(str, '\n', len) ? "\n" : str;
+        if(c2html_grep(str, len, pattern, 1, 1, &limits, collect, &b, NULL))
+            abort();
+    }
+    free(b.data);
+
+    // The callback is only called every so many tokens,
+    // so it's checked on the input repeated a few times.
+    long long_len = 4 * len;
+    char *long_str = malloc(long_len + 1);
+    if(long_str == NULL)
+        abort();
+    for(int k = 0; k < 4; k += 1)
+        memcpy(long_str + k * len, str, len);
+    long long_ref_len;
+    char *long_ref = c2html_reference(long_str, long_len, "c2h-", &long_ref_len, NULL);
+    if(long_ref == NULL)
+        abort();
+    long calls = 0;
+    limits = (c2html_opts_t) { .prefix = "c2h-", .cancel = count_calls, .cancel_data = &calls };
+    check_limits(long_str, long_len, &limits, NULL, long_ref, long_ref_len);
+    limits.cancel = cancel_now;
+    check_limits(long_str, long_len, &limits, calls > 0 ? c2html_err_cancelled : NULL,
+                 long_ref, long_ref_len);
+    free(long_str);
+    free(long_ref);
+}
+
+/* Returns the length of the valid UTF-8 sequence of
+ * more than one byte at [s], else 0.
+ */
+static int multibyte_len(const unsigned char *s, long avail)
+{
+    int n;
+    uint32_t c;
+    if(s[0] >= 0xC2 && s[0] <= 0xDF)
+        n = 2, c = s[0] & 0x1F;
+    else if(s[0] >= 0xE0 && s[0] <= 0xEF)
+        n = 3, c = s[0] & 0x0F;
+    else if(s[0] >= 0xF0 && s[0] <= 0xF4)
+        n = 4, c = s[0] & 0x07;
+    else
+        return 0;
+    if(avail < n)
+        return 0;
+    for(int k = 1; k < n; k += 1) {
+        if((s[k] & 0xC0) != 0x80)
+            return 0;
+        c = (c << 6) | (s[k] & 0x3F);
+    }
+    if((n == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF)))
+        || (n == 4 && (c < 0x10000 || c > 0x10FFFF)))
+        return 0;
+    return n;
+}
+
+/* Copies [str] into [dst] replacing the bytes that
+ * aren't valid UTF-8 with '?'. Returns whether there
+ * was any multibyte sequence.
+ */
+static bool utf8_fix(const char *str, long len, char *dst)
+{
+    const unsigned char *s = (const unsigned char*) str;
+    bool multibyte = false;
+    long i = 0;
+    while(i < len) {
+        int n = multibyte_len(s + i, len - i);
+        if(n > 0) {
+            memcpy(dst + i, str + i, n);
+            multibyte = true;
+            i += n;
+        } else {
+            dst[i] = s[i] < 0x80 ? str[i] : '?';
+            i += 1;
+        }
+    }
+    return multibyte;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const char *str = (const char*) data;
+    long len = size;
+
+    // The sizes of the pieces are taken from the input,
+    // so that they change with it.
+    long step = 1 + (len > 0 ? (unsigned char) str[0] : 0) % 97;
+
+    long ref_len, out_len;
+    char *ref = c2html_reference(str, len, "c2h-", &ref_len, NULL);
+    char *out = c2html(str, len, "c2h-", &out_len, NULL);
+    if(ref == NULL || out == NULL)
+        abort();
+    compare("c2html", ref, ref_len, out, out_len);
+
+    c2html_opts_t opts = { .prefix = "c2h-" };
+
+    sink_buff_t b = {0};
+    if(c2html_write(str, len, &opts, collect, &b, NULL))
+        abort();
+    compare("c2html_write", ref, ref_len, b.data, b.used);
+
+    // Keywords take precedence over the dictionary, and
+    // its other word can't be formed by the pieces of
+    // the random inputs.
+    static c2html_dict_t *dict = NULL;
+    if(dict == NULL) {
+        dict = c2html_dict_create();
+        if(dict == NULL
+            || c2html_dict_load(dict, "int return char zzz_unused", -1, C2HTML_TYPE, NULL)
+            || c2html_dict_load(dict, "void while if struct", -1, C2HTML_KWORD, NULL))
+            abort();
+    }
+    c2html_opts_t dict_opts = { .prefix = "c2h-", .dict = dict };
+    char *with_dict = c2html_ex(str, len, &dict_opts, &out_len, NULL);
+    if(with_dict == NULL)
+        abort();
+    compare("dictionary", ref, ref_len, with_dict, out_len);
+    free(with_dict);
+
+    // The cache is kept across inputs, and it's small
+    // enough for conversions to be evicted. The second
+    // one is usually a hit.
+    static c2html_cache_t *cache = NULL;
+    if(cache == NULL && (cache = c2html_cache_create(64 << 10)) == NULL)
+        abort();
+    c2html_opts_t cache_opts = { .prefix = "c2h-", .cache = cache };
+    for(int k = 0; k < 2; k += 1) {
+        char *cached = c2html_ex(str, len, &cache_opts, &out_len, NULL);
+        if(cached == NULL)
+            abort();
+        compare("cache", ref, ref_len, cached, out_len);
+        free(cached);
+        b.used = 0;
+        if(c2html_write(str, len, &cache_opts, collect, &b, NULL))
+            abort();
+        compare("cache with c2html_write", ref, ref_len, b.data, b.used);
+    }
+
+    // The line cache is kept across inputs, and it's
+    // small so that lines are also evicted.
+    static c2html_line_cache_t *line_cache = NULL;
+    if(line_cache == NULL && (line_cache = c2html_line_cache_create(16 << 10)) == NULL)
+        abort();
+    for(int k = 0; k < 2; k += 1) {
+        b.used = 0;
+        c2html_opts_t cached = { .prefix = "c2h-", .line_cache = line_cache };
+        if(c2html_write(str, len, &cached, collect, &b, NULL))
+            abort();
+        compare("line cache", ref, ref_len, b.data, b.used);
+    }
+
+    // The pool is kept across inputs too, and each
+    // input goes through both a callback and collect.
+    static c2html_pool_t *pool = NULL;
+    if(pool == NULL && (pool = c2html_pool_create(2)) == NULL)
+        abort();
+    sink_buff_t pb = {0};
+    if(c2html_pool_submit(pool, str, len, &opts, pool_done, &pb, NULL))
+        abort();
+    if(c2html_pool_submit(pool, str, len, &opts, NULL, &pb, NULL))
+        abort();
+    c2html_result_t result;
+    struct pollfd pfd = { .fd = c2html_pool_fd(pool), .events = POLLIN };
+    while(c2html_pool_collect(pool, &result, 1) == 0)
+        poll(&pfd, 1, -1);
+    if(result.data != &pb || result.output == NULL)
+        abort();
+    compare("c2html_pool_collect", ref, ref_len, result.output, result.output_len);
+    free(result.output);
+    // Jobs are taken in order, but the callback may
+    // run after the other job is collected.
+    while(__atomic_load_n(&pb.size, __ATOMIC_ACQUIRE) == 0)
+        poll(NULL, 0, 1);
+    compare("c2html_pool_submit", ref, ref_len, pb.data, pb.used);
+    free(pb.data);
+
+    if(feed_all(str, len, step, &opts, &b))
+        abort();
+    compare("c2html_feed", ref, ref_len, b.data, b.used);
+
+    if(iter_all(str, len, step, &opts, &b))
+        abort();
+    compare("c2html_iter_read", ref, ref_len, b.data, b.used);
+
+    // The limits take many conversions, so they're only
+    // checked for some of the inputs.
+    if(step % 4 == 1)
+        check_all_limits(str, len, ref, ref_len);
+
+    // In UTF-8 mode, an input without multibyte sequences
+    // is converted as usual. The pieces fed to c2html_feed
+    // cut sequences, but each call checks its own lines,
+    // so it's only the same as c2html_ex for valid input.
+    c2html_opts_t u8_opts = { .prefix = "c2h-", .utf8 = true };
+    long u8_len;
+    char *u8 = c2html_ex(str, len, &u8_opts, &u8_len, NULL);
+    char *fixed = malloc(len + 1);
+    if(u8 == NULL || fixed == NULL)
+        abort();
+    if(!utf8_fix(str, len, fixed))
+        compare("utf8 without multibyte sequences", ref, ref_len, u8, u8_len);
+    b.used = 0;
+    if(c2html_write(str, len, &u8_opts, collect, &b, NULL))
+        abort();
+    compare("utf8 c2html_write", u8, u8_len, b.data, b.used);
+    if(iter_all(str, len, step, &u8_opts, &b))
+        abort();
+    compare("utf8 c2html_iter_read", u8, u8_len, b.data, b.used);
+    free(u8);
+
+    u8 = c2html_ex(fixed, len, &u8_opts, &u8_len, NULL);
+    if(u8 == NULL)
+        abort();
+    if(feed_all(fixed, len, step, &u8_opts, &b))
+        abort();
+    compare("utf8 c2html_feed", u8, u8_len, b.data, b.used);
+    if(iter_all(fixed, len, step, &u8_opts, &b))
+        abort();
+    compare("utf8 c2html_iter_read", u8, u8_len, b.data, b.used);
+    free(u8);
+    free(fixed);
+
+    // A range of lines must be the same with and
+    // without checkpoints.
+    long count;
+    c2html_state_t *checkpoints = c2html_checkpoints(str, len, step % 7 + 1, &count, NULL);
+    if(checkpoints == NULL && len > 0)
+        abort();
+    opts.first_line = step % 5 + 1;
+    opts.last_line  = opts.first_line + step % 3;
+    char *range = c2html_ex(str, len, &opts, &ref_len, NULL);
+    opts.checkpoints = checkpoints;
+    opts.num_checkpoints = count;
+    char *range2 = c2html_ex(str, len, &opts, &out_len, NULL);
+    if(range == NULL || range2 == NULL)
+        abort();
+    compare("checkpoints", range, ref_len, range2, out_len);
+
+    // The diff of the input with itself has no rows,
+    // and the one with a prefix of it must not fail.
+    b.used = 0;
+    c2html_opts_t diff_opts = { .prefix = "c2h-" };
+    if(c2html_diff(str, len, str, len, step % 4, &diff_opts, collect, &b, NULL))
+        abort();
+    if(memchr(b.data, '@', b.used) != NULL)
+        abort();
+    if(c2html_diff(str, len / 2, str, len, step % 4, &diff_opts, collect, &b, NULL))
+        abort();
+    if(c2html_diff(str + len / 3, len - len / 3, str, len, step % 4, &diff_opts, collect, &b, NULL))
+        abort();
+
+    // Matches must be the same with and without
+    // checkpoints.
+    if(len > 0) {
+        long pat_off = step % len;
+        long pat_len = 1 + step % 3;
+        if(pat_off + pat_len > len)
+            pat_len = len - pat_off;
+        opts.first_line = 0;
+        opts.last_line  = 0;
+        sink_buff_t g = {0};
+        if(c2html_grep(str, len, str + pat_off, pat_len, step % 3, &opts, collect, &g, NULL))
+            abort();
+        b.used = 0;
+        opts.checkpoints = NULL;
+        opts.num_checkpoints = 0;
+        if(c2html_grep(str, len, str + pat_off, pat_len, step % 3, &opts, collect, &b, NULL))
+            abort();
+        compare("c2html_grep", b.data, b.used, g.data, g.used);
+        free(g.data);
+    }
+
+    free(range);
+    free(range2);
+    free(checkpoints);
+    free(b.data);
+    free(ref);
+    free(out);
+    return 0;
+}
+
+#ifndef C2H_LIBFUZZER
+
+static char *load_file(const char *file, long *size)
+{
+    FILE *fp = fopen(file, "rb");
+    if(fp == NULL)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    rewind(fp);
+    char *data = malloc(*size + 1);
+    if(data != NULL && (long) fread(data, 1, *size, fp) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+static uint64_t next_random(uint64_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+/* Random inputs are made of pieces of C, so that
+ * they hit more cases than random bytes would.
+ */
+static long random_input(char *buf, long cap, uint64_t *seed)
+{
+    static const char *pieces[] = {
+        "int", "main", "(", ")", "{", "}", ";", " ", "  ", "\t", "\n",
+        "\n\n", "/*", "*/", "//", "\"", "'", "\\", "#", "#define",
+        "# include", "<", ">", "<stdio.h>", "0x1F", "1.5", "42", ".",
+        "x", "_y2", "return", "=", "+=", "&&", "f (", "g(", "\xc3\xa9",
+        "\xff", "\r",
+    };
+    const int num_pieces = sizeof(pieces) / sizeof(pieces[0]);
+
+    long len = 0;
+    long target = next_random(seed) % cap;
+    while(len < target) {
+        const char *p = pieces[next_random(seed) % num_pieces];
+        long n = strlen(p);
+        if(len + n > cap)
+            break;
+        memcpy(buf + len, p, n);
+        len += n;
+    }
+    return len;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc > 1) {
+        for(int i = 1; i < argc; i += 1) {
+            long size;
+            char *data = load_file(argv[i], &size);
+            if(data == NULL) {
+                fprintf(stderr, "Error: Couldn't open file %s\n", argv[i]);
+                return -1;
+            }
+            LLVMFuzzerTestOneInput((uint8_t*) data, size);
+            free(data);
+        }
+        fprintf(stderr, "Checked %d files\n", argc - 1);
+        return 0;
+    }
+
+    char buf[4096];
+    uint64_t seed = 88172645463325252u;
+    const int rounds = 10000;
+    for(int i = 0; i < rounds; i += 1) {
+        long len = random_input(buf, sizeof(buf), &seed);
+        LLVMFuzzerTestOneInput((uint8_t*) buf, len);
+    }
+    fprintf(stderr, "Checked %d random inputs\n", rounds);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef C2HTML_REFERENCE_H
+#define C2HTML_REFERENCE_H
+
+/* Reference implementation of [c2html], with the same
+ * arguments and output. It's slower, but simple enough
+ * to be trusted, so it's used to check the output of
+ * the optimized implementation (see fuzz.c and the
+ * --check option of the CLI).
+ */
+char *c2html_reference(const char *str, long len, const char *prefix, 
+                       long *output_len, const char **error);
+
+#endif /* C2HTML_REFERENCE_H */
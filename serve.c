@@ -0,0 +1,1131 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "serve.h"
+
+#define MAX_EVENTS  64
+#define MAX_REQUEST 8192
+
+/* Output of a conversion, stored in an unlinked
+ * temporary file. It's reference counted since
+ * it can be replaced by a newer one while some
+ * connections are still sending it.
+ */
+typedef struct {
+    int  fd;
+    long size;
+    int  refs;
+} page_t;
+
+static void page_release(page_t *page)
+{
+    if(page == NULL)
+        return;
+    page->refs -= 1;
+    if(page->refs == 0) {
+        close(page->fd);
+        free(page);
+    }
+}
+
+typedef struct conn_t  conn_t;
+typedef struct entry_t entry_t;
+
+typedef enum {
+    CONN_READING,
+    CONN_WAITING, // For the conversion of a file
+    CONN_SENDING,
+    CONN_CLOSED,  // Freed once the events are handled
+} conn_state_t;
+
+struct conn_t {
+    int          fd;
+    conn_state_t state;
+    bool         keep_alive;
+    bool         head_only;
+    bool         dead;      // The socket failed while waiting
+    char         in[MAX_REQUEST];
+    long         in_used;
+    char        *out;       // Headers and, if not a page, the body
+    long         out_used;
+    long         out_sent;
+    page_t      *page;      // Body that's sent after [out]
+    off_t        page_sent;
+    conn_t      *next_waiter;
+    conn_t      *next_closed;
+};
+
+/* Cached conversion of a source file, by its
+ * path relative to the root. Entries are in a
+ * list from the most to the least recently used,
+ * since each page holds a file descriptor and
+ * the ones at the end are dropped.
+ */
+struct entry_t {
+    entry_t *chain;
+    entry_t *lru_prev;
+    entry_t *lru_next;
+    char    *path;
+    page_t  *page;       // NULL until the first conversion
+    struct timespec mtime; // Of the source when [page] was made
+    off_t    src_size;
+    bool     converting;
+    conn_t  *waiters;
+};
+
+/* Conversion done by the workers. */
+typedef struct job_t job_t;
+struct job_t {
+    job_t   *next;
+    entry_t *entry;     // Only used by the main thread
+    char    *file;      // Absolute path of the source
+    char    *title;
+    // Result
+    page_t  *page;      // NULL on failure
+    struct timespec mtime;
+    off_t    src_size;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    job_t *head;
+    job_t *tail;
+} job_list_t;
+
+typedef struct {
+    const serve_config_t *config;
+    char       *root;      // Real path of the root
+    long        root_len;
+    char        tmpdir[PATH_MAX];
+    int         epoll_fd;
+    int         listen_fd;
+    int         event_fd;  // Signaled when jobs are done
+    job_list_t  todo;
+    job_list_t  done;
+    entry_t   **buckets;
+    size_t      num_buckets; // Power of two
+    size_t      num_entries;
+    size_t      max_entries;
+    entry_t    *lru_head;
+    entry_t    *lru_tail;
+    bool        accept_paused; // At the limit of open files
+    conn_t     *closed;    // Closed during this round of events
+} server_t;
+
+static void jobs_init(job_list_t *list)
+{
+    pthread_mutex_init(&list->lock, NULL);
+    pthread_cond_init(&list->cond, NULL);
+    list->head = NULL;
+    list->tail = NULL;
+}
+
+static void jobs_push(job_list_t *list, job_t *job)
+{
+    pthread_mutex_lock(&list->lock);
+    job->next = NULL;
+    if(list->tail)
+        list->tail->next = job;
+    else
+        list->head = job;
+    list->tail = job;
+    pthread_cond_signal(&list->cond);
+    pthread_mutex_unlock(&list->lock);
+}
+
+/* Pops a job, waiting for one if [wait] is true,
+ * else returning NULL when there are none.
+ */
+static job_t *jobs_pop(job_list_t *list, bool wait)
+{
+    pthread_mutex_lock(&list->lock);
+    while(wait && list->head == NULL)
+        pthread_cond_wait(&list->cond, &list->lock);
+    job_t *job = list->head;
+    if(job != NULL) {
+        list->head = job->next;
+        if(list->head == NULL)
+            list->tail = NULL;
+    }
+    pthread_mutex_unlock(&list->lock);
+    return job;
+}
+
+static void job_free(job_t *job)
+{
+    page_release(job->page);
+    free(job->file);
+    free(job->title);
+    free(job);
+}
+
+static char *load_fd(int fd, long *size)
+{
+    struct stat st;
+    if(fstat(fd, &st))
+        return NULL;
+
+    char *data = malloc(st.st_size + 1);
+    if(data == NULL)
+        return NULL;
+
+    long used = 0;
+    while(used < st.st_size) {
+        ssize_t n = read(fd, data + used, st.st_size - used);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        used += n;
+    }
+    *size = used;
+    return data;
+}
+
+static void print_escaped(FILE *fp, const char *str)
+{
+    for(; *str; str += 1)
+        switch(*str) {
+            case '<': fputs("&lt;", fp); break;
+            case '>': fputs("&gt;", fp); break;
+            case '&': fputs("&amp;", fp); break;
+            case '"': fputs("&quot;", fp); break;
+            default: fputc(*str, fp); break;
+        }
+}
+
+/* Returns a copy of the path [str] with the bytes
+ * that aren't allowed in a URL path percent-encoded,
+ * so that [decode_path] gives [str] back. Slashes
+ * are kept. Returns NULL if out of memory.
+ */
+static char *encode_path(const char *str)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    char *out = malloc(3 * strlen(str) + 1);
+    if(out == NULL)
+        return NULL;
+
+    long j = 0;
+    for(; *str; str += 1) {
+        unsigned char c = *str;
+        if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+            || c == '-' || c == '.' || c == '_' || c == '~' || c == '/')
+            out[j++] = c;
+        else {
+            out[j++] = '%';
+            out[j++] = hex[c >> 4];
+            out[j++] = hex[c & 15];
+        }
+    }
+    out[j] = '\0';
+    return out;
+}
+
+/* Converts the source of [job] into a page. */
+static void convert_job(server_t *server, job_t *job)
+{
+    const serve_config_t *config = server->config;
+
+    int src = open(job->file, O_RDONLY);
+    if(src < 0)
+        return;
+
+    struct stat st;
+    long  input_size;
+    char *input = NULL;
+    if(fstat(src, &st) == 0) {
+        job->mtime    = st.st_mtim;
+        job->src_size = st.st_size;
+        input = load_fd(src, &input_size);
+    }
+    close(src);
+    if(input == NULL)
+        return;
+
+    const char *err;
+    long  output_len;
+    char *output = c2html_ex(input, input_size, config->opts, &output_len, &err);
+    free(input);
+    if(output == NULL) {
+        fprintf(stderr, "Error: %s (while converting %s)\n", err, job->file);
+        return;
+    }
+
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/c2html-XXXXXX", server->tmpdir);
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        fprintf(stderr, "Error: Couldn't create a temporary file in %s\n", server->tmpdir);
+        free(output);
+        return;
+    }
+    unlink(path);
+
+    // The page is written with stdio for the header,
+    // which needs escaping, and the style.
+    FILE *fp = fdopen(dup(fd), "wb");
+    bool ok = (fp != NULL);
+    if(ok) {
+        fprintf(fp, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>");
+        print_escaped(fp, job->title);
+        fprintf(fp, "</title>\n");
+        if(config->style_data != NULL)
+            fprintf(fp, "<style>%s</style>\n", config->style_data);
+        fprintf(fp, "</head>\n<body>\n");
+        fwrite(output, 1, output_len, fp);
+        fprintf(fp, "</body>\n</html>\n");
+        ok = !ferror(fp);
+        if(fclose(fp))
+            ok = false;
+    }
+    free(output);
+
+    struct stat out_st;
+    if(!ok || fstat(fd, &out_st)) {
+        fprintf(stderr, "Error: Failed to write to %s\n", server->tmpdir);
+        close(fd);
+        return;
+    }
+
+    job->page = malloc(sizeof(page_t));
+    if(job->page == NULL) {
+        close(fd);
+        return;
+    }
+    job->page->fd   = fd;
+    job->page->size = out_st.st_size;
+    job->page->refs = 1;
+}
+
+static void *worker_main(void *arg)
+{
+    server_t *server = arg;
+    while(1) {
+        job_t *job = jobs_pop(&server->todo, true);
+        convert_job(server, job);
+        jobs_push(&server->done, job);
+
+        uint64_t one = 1;
+        while(write(server->event_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+    return NULL;
+}
+
+static unsigned long hash_path(const char *str)
+{
+    unsigned long h = 2166136261u;
+    for(; *str; str += 1) {
+        h ^= (unsigned char) *str;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void lru_unlink(server_t *server, entry_t *e)
+{
+    if(e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        server->lru_head = e->lru_next;
+    if(e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        server->lru_tail = e->lru_prev;
+}
+
+static void lru_push_front(server_t *server, entry_t *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = server->lru_head;
+    if(server->lru_head)
+        server->lru_head->lru_prev = e;
+    else
+        server->lru_tail = e;
+    server->lru_head = e;
+}
+
+/* Drops the least recently used entries, other than
+ * [keep], until there are at most [max_entries]. The
+ * ones being converted are skipped since their jobs
+ * point to them. Their pages stay open as long as
+ * some connection is still sending them.
+ */
+static void evict_entries(server_t *server, entry_t *keep)
+{
+    entry_t *e = server->lru_tail;
+    while(e && server->num_entries > server->max_entries) {
+        entry_t *prev = e->lru_prev;
+        if(e != keep && !e->converting) {
+            entry_t **p = &server->buckets[hash_path(e->path) & (server->num_buckets - 1)];
+            while(*p != e)
+                p = &(*p)->chain;
+            *p = e->chain;
+            lru_unlink(server, e);
+            page_release(e->page);
+            free(e->path);
+            free(e);
+            server->num_entries -= 1;
+        }
+        e = prev;
+    }
+}
+
+static entry_t *find_entry(server_t *server, const char *path, bool create)
+{
+    if(server->num_buckets > 0) {
+        entry_t *e = server->buckets[hash_path(path) & (server->num_buckets - 1)];
+        while(e && strcmp(e->path, path))
+            e = e->chain;
+        if(e != NULL) {
+            lru_unlink(server, e);
+            lru_push_front(server, e);
+        }
+        if(e != NULL || !create)
+            return e;
+    }
+
+    if(!create)
+        return NULL;
+
+    if(server->num_entries >= server->num_buckets) {
+        size_t new_num_buckets = server->num_buckets ? 2 * server->num_buckets : 256;
+        entry_t **new_buckets = calloc(new_num_buckets, sizeof(entry_t*));
+        if(new_buckets == NULL)
+            return NULL;
+        for(size_t i = 0; i < server->num_buckets; i += 1) {
+            entry_t *e = server->buckets[i];
+            while(e) {
+                entry_t *next = e->chain;
+                entry_t **b = &new_buckets[hash_path(e->path) & (new_num_buckets - 1)];
+                e->chain = *b;
+                *b = e;
+                e = next;
+            }
+        }
+        free(server->buckets);
+        server->buckets = new_buckets;
+        server->num_buckets = new_num_buckets;
+    }
+
+    entry_t *e = calloc(1, sizeof(entry_t));
+    if(e == NULL)
+        return NULL;
+    e->path = strdup(path);
+    if(e->path == NULL) {
+        free(e);
+        return NULL;
+    }
+
+    entry_t **b = &server->buckets[hash_path(path) & (server->num_buckets - 1)];
+    e->chain = *b;
+    *b = e;
+    server->num_entries += 1;
+    lru_push_front(server, e);
+    return e;
+}
+
+/* Closes the socket of [conn], which is only freed
+ * by [free_closed], since later events of the same
+ * round can still refer to it.
+ */
+static void conn_close(server_t *server, conn_t *conn)
+{
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    page_release(conn->page);
+    conn->page = NULL;
+    free(conn->out);
+    conn->out = NULL;
+    conn->state = CONN_CLOSED;
+    conn->next_closed = server->closed;
+    server->closed = conn;
+
+    if(server->accept_paused) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &server->listen_fd };
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, server->listen_fd, &ev);
+        server->accept_paused = false;
+    }
+}
+
+static void free_closed(server_t *server)
+{
+    while(server->closed) {
+        conn_t *next = server->closed->next_closed;
+        free(server->closed);
+        server->closed = next;
+    }
+}
+
+static void conn_watch(server_t *server, conn_t *conn, unsigned int events)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/* Appends to the output buffer of [conn]. */
+static bool conn_printf(conn_t *conn, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    char *temp = realloc(conn->out, conn->out_used + n + 1);
+    if(temp == NULL)
+        return false;
+    conn->out = temp;
+
+    va_start(args, fmt);
+    vsnprintf(conn->out + conn->out_used, n + 1, fmt, args);
+    va_end(args);
+    conn->out_used += n;
+    return true;
+}
+
+static void respond(server_t *server, conn_t *conn, int status, const char *reason,
+                    const char *body, long body_len, page_t *page);
+
+static void respond_error(server_t *server, conn_t *conn, int status, const char *reason)
+{
+    char body[128];
+    int len = snprintf(body, sizeof(body), "<h1>%d %s</h1>\n", status, reason);
+    respond(server, conn, status, reason, body, len, NULL);
+}
+
+static bool conn_flush(server_t *server, conn_t *conn);
+static void conn_process(server_t *server, conn_t *conn);
+
+/* Starts sending a response. The body is either
+ * [body] or the contents of [page].
+ */
+static void respond(server_t *server, conn_t *conn, int status, const char *reason,
+                    const char *body, long body_len, page_t *page)
+{
+    if(page != NULL)
+        body_len = page->size;
+
+    conn->out_used = 0;
+    conn->out_sent = 0;
+    bool ok = conn_printf(conn,
+                          "HTTP/1.1 %d %s\r\n"
+                          "Content-Type: text/html; charset=utf-8\r\n"
+                          "Content-Length: %ld\r\n"
+                          "Connection: %s\r\n"
+                          "\r\n",
+                          status, reason, body_len,
+                          conn->keep_alive ? "keep-alive" : "close");
+    if(ok && !conn->head_only) {
+        if(page != NULL) {
+            page->refs += 1;
+            conn->page = page;
+            conn->page_sent = 0;
+        } else
+            ok = conn_printf(conn, "%.*s", (int) body_len, body);
+    }
+
+    if(!ok) {
+        conn_close(server, conn);
+        return;
+    }
+
+    conn->state = CONN_SENDING;
+    if(conn_flush(server, conn))
+        conn_process(server, conn);
+}
+
+/* Sends as much as possible of the response. Returns
+ * true if it was all sent and the connection is ready
+ * for the next request. If the connection was closed,
+ * false is returned and [conn] is left in CONN_CLOSED
+ * until [free_closed] frees it after this round of
+ * events, so callers can still read its state.
+ */
+static bool conn_flush(server_t *server, conn_t *conn)
+{
+    while(conn->out_sent < conn->out_used) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_sent,
+                         conn->out_used - conn->out_sent, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn_watch(server, conn, EPOLLOUT);
+            return false;
+        }
+        if(n < 0) {
+            conn_close(server, conn);
+            return false;
+        }
+        conn->out_sent += n;
+    }
+
+    if(conn->page != NULL) {
+        while(conn->page_sent < conn->page->size) {
+            ssize_t n = sendfile(conn->fd, conn->page->fd, &conn->page_sent,
+                                 conn->page->size - conn->page_sent);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                conn_watch(server, conn, EPOLLOUT);
+                return false;
+            }
+            if(n <= 0) {
+                conn_close(server, conn);
+                return false;
+            }
+        }
+        page_release(conn->page);
+        conn->page = NULL;
+    }
+
+    if(!conn->keep_alive) {
+        conn_close(server, conn);
+        return false;
+    }
+
+    conn->state = CONN_READING;
+    conn_watch(server, conn, EPOLLIN);
+    return true;
+}
+
+static void start_job(server_t *server, entry_t *entry, const char *file)
+{
+    job_t *job = calloc(1, sizeof(job_t));
+    if(job == NULL)
+        return;
+    job->entry = entry;
+    job->file  = strdup(file);
+    job->title = strdup(entry->path);
+    if(job->file == NULL || job->title == NULL) {
+        job_free(job);
+        return;
+    }
+    entry->converting = true;
+    jobs_push(&server->todo, job);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char**) a, *(char**) b);
+}
+
+/* Responds with the list of the contents of
+ * the directory [file], whose URL is [path].
+ */
+static void respond_listing(server_t *server, conn_t *conn, const char *file,
+                            const char *path)
+{
+    DIR *dir = opendir(file);
+    if(dir == NULL) {
+        respond_error(server, conn, 404, "Not Found");
+        return;
+    }
+
+    char **names = NULL;
+    long count = 0, capacity = 0;
+    struct dirent *ent;
+    while((ent = readdir(dir)) != NULL) {
+        if(ent->d_name[0] == '.')
+            continue;
+        if(count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            void *temp = realloc(names, capacity * sizeof(char*));
+            if(temp == NULL)
+                break;
+            names = temp;
+        }
+        bool is_dir = (ent->d_type == DT_DIR);
+        char *name = malloc(strlen(ent->d_name) + 2);
+        if(name == NULL)
+            break;
+        sprintf(name, "%s%s", ent->d_name, is_dir ? "/" : "");
+        names[count++] = name;
+    }
+    closedir(dir);
+
+    qsort(names, count, sizeof(char*), compare_names);
+
+    char  *body = NULL;
+    size_t body_len = 0;
+    FILE *fp = open_memstream(&body, &body_len);
+    if(fp != NULL) {
+        fprintf(fp, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>");
+        print_escaped(fp, path);
+        fprintf(fp, "</title>\n</head>\n<body>\n<ul>\n");
+        for(long i = 0; i < count; i += 1) {
+            char *href = encode_path(names[i]);
+            if(href == NULL)
+                break;
+            fprintf(fp, "<li><a href=\"");
+            print_escaped(fp, href);
+            fprintf(fp, "\">");
+            free(href);
+            print_escaped(fp, names[i]);
+            fprintf(fp, "</a></li>\n");
+        }
+        fprintf(fp, "</ul>\n</body>\n</html>\n");
+        fclose(fp);
+    }
+
+    for(long i = 0; i < count; i += 1)
+        free(names[i]);
+    free(names);
+
+    if(body == NULL)
+        respond_error(server, conn, 500, "Internal Server Error");
+    else
+        respond(server, conn, 200, "OK", body, body_len, NULL);
+    free(body);
+}
+
+static int hexval(char c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Decodes the path of a request target in place,
+ * dropping the query. Returns false if it's not
+ * a valid path or it goes outside of the root.
+ */
+static bool decode_path(char *target)
+{
+    char *q = strchr(target, '?');
+    if(q != NULL)
+        *q = '\0';
+
+    if(target[0] != '/')
+        return false;
+
+    long j = 0;
+    for(long i = 0; target[i]; i += 1) {
+        char c = target[i];
+        if(c == '%') {
+            int hi = hexval(target[i+1]);
+            int lo = hi < 0 ? -1 : hexval(target[i+2]);
+            if(lo < 0)
+                return false;
+            c = hi * 16 + lo;
+            i += 2;
+            if(c == '\0')
+                return false;
+        }
+        target[j++] = c;
+    }
+    target[j] = '\0';
+
+    // Reject any ".." segment.
+    for(char *p = target; (p = strstr(p, "..")) != NULL; p += 2)
+        if(p[-1] == '/' && (p[2] == '/' || p[2] == '\0'))
+            return false;
+    return true;
+}
+
+static void handle_request(server_t *server, conn_t *conn, char *method, char *target)
+{
+    if(!strcmp(method, "HEAD"))
+        conn->head_only = true;
+    else if(strcmp(method, "GET")) {
+        respond_error(server, conn, 405, "Method Not Allowed");
+        return;
+    }
+
+    if(!decode_path(target)) {
+        respond_error(server, conn, 400, "Bad Request");
+        return;
+    }
+
+    char file[PATH_MAX];
+    char real[PATH_MAX];
+    if(snprintf(file, sizeof(file), "%s%s", server->root, target) >= (int) sizeof(file)
+        || realpath(file, real) == NULL) {
+        respond_error(server, conn, 404, "Not Found");
+        return;
+    }
+
+    // Symbolic links must not lead outside of the root.
+    if(strncmp(real, server->root, server->root_len)
+        || (real[server->root_len] != '/' && real[server->root_len] != '\0')) {
+        respond_error(server, conn, 404, "Not Found");
+        return;
+    }
+
+    struct stat st;
+    if(stat(real, &st)) {
+        respond_error(server, conn, 404, "Not Found");
+        return;
+    }
+
+    if(S_ISDIR(st.st_mode)) {
+        long len = strlen(target);
+        if(target[len-1] != '/') {
+            // Links in the listing are relative to the directory.
+            conn->out_used = 0;
+            conn->out_sent = 0;
+            char *location = encode_path(target);
+            bool ok = location != NULL
+                   && conn_printf(conn, "HTTP/1.1 301 Moved Permanently\r\n"
+                                        "Location: %s/\r\n"
+                                        "Content-Length: 0\r\n"
+                                        "Connection: %s\r\n"
+                                        "\r\n", location,
+                                        conn->keep_alive ? "keep-alive" : "close");
+            free(location);
+            if(!ok) {
+                conn_close(server, conn);
+                return;
+            }
+            conn->state = CONN_SENDING;
+            if(conn_flush(server, conn))
+                conn_process(server, conn);
+            return;
+        }
+        respond_listing(server, conn, real, target);
+        return;
+    }
+
+    if(!S_ISREG(st.st_mode)) {
+        respond_error(server, conn, 404, "Not Found");
+        return;
+    }
+
+    entry_t *entry = find_entry(server, real + server->root_len, true);
+    if(entry == NULL) {
+        respond_error(server, conn, 500, "Internal Server Error");
+        return;
+    }
+    evict_entries(server, entry);
+
+    bool fresh = entry->page != NULL
+              && entry->src_size == st.st_size
+              && entry->mtime.tv_sec  == st.st_mtim.tv_sec
+              && entry->mtime.tv_nsec == st.st_mtim.tv_nsec;
+    if(fresh) {
+        respond(server, conn, 200, "OK", NULL, 0, entry->page);
+        return;
+    }
+
+    if(!entry->converting)
+        start_job(server, entry, real);
+
+    if(!entry->converting) {
+        respond_error(server, conn, 500, "Internal Server Error");
+        return;
+    }
+
+    conn->state = CONN_WAITING;
+    conn->next_waiter = entry->waiters;
+    entry->waiters = conn;
+    conn_watch(server, conn, 0);
+}
+
+/* Handles the next request buffered in [conn], if
+ * it arrived completely.
+ */
+static void conn_process(server_t *server, conn_t *conn)
+{
+    char *end = memmem(conn->in, conn->in_used, "\r\n\r\n", 4);
+    if(end == NULL) {
+        if(conn->in_used == MAX_REQUEST) {
+            conn->keep_alive = false;
+            respond_error(server, conn, 431, "Request Header Fields Too Large");
+        }
+        return;
+    }
+
+    long head_len = end - conn->in + 4;
+
+    // The head is parsed as a string, so it can't
+    // hold zeros.
+    if(memchr(conn->in, '\0', head_len) != NULL) {
+        conn->in_used = 0;
+        conn->keep_alive = false;
+        respond_error(server, conn, 400, "Bad Request");
+        return;
+    }
+
+    char head[MAX_REQUEST + 1];
+    memcpy(head, conn->in, head_len);
+    head[head_len] = '\0';
+    memmove(conn->in, conn->in + head_len, conn->in_used - head_len);
+    conn->in_used -= head_len;
+
+    char *line_end = strstr(head, "\r\n");
+    if(line_end != NULL)
+        *line_end = '\0';
+
+    char *method  = head;
+    char *target  = strchr(method, ' ');
+    char *version = target ? strchr(target + 1, ' ') : NULL;
+    if(line_end == NULL || version == NULL) {
+        conn->keep_alive = false;
+        respond_error(server, conn, 400, "Bad Request");
+        return;
+    }
+    *target++ = '\0';
+    *version++ = '\0';
+
+    conn->head_only  = false;
+    conn->keep_alive = !strcmp(version, "HTTP/1.1");
+
+    // Requests with a body aren't supported, so the
+    // connection is closed to avoid parsing it as the
+    // next request.
+    for(char *line = line_end + 2; *line; ) {
+        char *next = strstr(line, "\r\n");
+        if(next == NULL)
+            break;
+        *next = '\0';
+        if(!strncasecmp(line, "Connection:", 11)) {
+            if(strcasestr(line + 11, "close"))
+                conn->keep_alive = false;
+            else if(strcasestr(line + 11, "keep-alive"))
+                conn->keep_alive = true;
+        } else if(!strncasecmp(line, "Content-Length:", 15)
+               || !strncasecmp(line, "Transfer-Encoding:", 18))
+            conn->keep_alive = false;
+        line = next + 2;
+    }
+
+    handle_request(server, conn, method, target);
+}
+
+static void conn_read(server_t *server, conn_t *conn)
+{
+    while(conn->in_used < MAX_REQUEST) {
+        ssize_t n = recv(conn->fd, conn->in + conn->in_used,
+                         MAX_REQUEST - conn->in_used, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(n <= 0) {
+            conn_close(server, conn);
+            return;
+        }
+        conn->in_used += n;
+    }
+    conn_process(server, conn);
+}
+
+static void accept_all(server_t *server)
+{
+    while(1) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            // Out of file descriptors the socket stays
+            // readable, so it's left alone until one
+            // of the connections is closed.
+            if(errno == EMFILE || errno == ENFILE) {
+                struct epoll_event ev = { .events = 0, .data.ptr = &server->listen_fd };
+                epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, server->listen_fd, &ev);
+                server->accept_paused = true;
+            }
+            return;
+        }
+
+        conn_t *conn = calloc(1, sizeof(conn_t));
+        if(conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->state = CONN_READING;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+        if(epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+            close(fd);
+            free(conn);
+        }
+    }
+}
+
+/* Stores the results of the workers and resumes
+ * the connections that were waiting for them.
+ */
+static void finish_jobs(server_t *server)
+{
+    // Only resets the counter, since the jobs are
+    // popped until there are none.
+    uint64_t count;
+    if(read(server->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+
+    job_t *job;
+    while((job = jobs_pop(&server->done, false)) != NULL) {
+
+        entry_t *entry = job->entry;
+        entry->converting = false;
+        if(job->page != NULL) {
+            page_release(entry->page);
+            entry->page     = job->page;
+            entry->mtime    = job->mtime;
+            entry->src_size = job->src_size;
+            job->page = NULL;
+        }
+
+        conn_t *conn = entry->waiters;
+        entry->waiters = NULL;
+        while(conn) {
+            conn_t *next = conn->next_waiter;
+            if(conn->dead)
+                conn_close(server, conn);
+            else if(entry->page == NULL)
+                respond_error(server, conn, 500, "Internal Server Error");
+            else
+                respond(server, conn, 200, "OK", NULL, 0, entry->page);
+            conn = next;
+        }
+
+        job_free(job);
+    }
+}
+
+int serve(const serve_config_t *config)
+{
+    static server_t server;
+    server.config = config;
+
+    server.root = realpath(config->root, NULL);
+    if(server.root == NULL) {
+        fprintf(stderr, "Error: Couldn't open directory %s\n", config->root);
+        return -1;
+    }
+    server.root_len = strlen(server.root);
+    if(server.root_len == 1) // The root of the file system
+        server.root_len = 0;
+
+    // Every cached page holds a file descriptor, so
+    // they're kept to half of the ones available.
+    server.max_entries = 1024;
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+        && rl.rlim_cur / 2 < server.max_entries)
+        server.max_entries = rl.rlim_cur / 2;
+
+    const char *tmpdir = getenv("TMPDIR");
+    snprintf(server.tmpdir, sizeof(server.tmpdir), "%s", tmpdir ? tmpdir : "/tmp");
+
+    signal(SIGPIPE, SIG_IGN);
+
+    server.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(server.listen_fd < 0) {
+        fprintf(stderr, "Error: Couldn't create socket (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(server.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(config->port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if(bind(server.listen_fd, (struct sockaddr*) &addr, sizeof(addr))
+        || listen(server.listen_fd, SOMAXCONN)) {
+        fprintf(stderr, "Error: Couldn't listen on port %d (%s)\n", config->port, strerror(errno));
+        close(server.listen_fd);
+        return -1;
+    }
+
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(server.epoll_fd < 0 || server.event_fd < 0) {
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // The listening socket and the event are told
+    // apart from connections by their pointers.
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &server.listen_fd };
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &ev);
+    ev = (struct epoll_event) { .events = EPOLLIN, .data.ptr = &server.event_fd };
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.event_fd, &ev);
+
+    jobs_init(&server.todo);
+    jobs_init(&server.done);
+
+    int threads = config->threads > 0 ? config->threads : 1;
+    for(int i = 0; i < threads; i += 1) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, worker_main, &server)) {
+            fprintf(stderr, "Error: Couldn't start worker threads\n");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    fprintf(stderr, "Serving %s on http://127.0.0.1:%d/\n", server.root, config->port);
+
+    struct epoll_event events[MAX_EVENTS];
+    while(1) {
+
+        int n = epoll_wait(server.epoll_fd, events, MAX_EVENTS, -1);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0) {
+            fprintf(stderr, "Error: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for(int i = 0; i < n; i += 1) {
+
+            void *ptr = events[i].data.ptr;
+            if(ptr == &server.listen_fd) {
+                accept_all(&server);
+                continue;
+            }
+            if(ptr == &server.event_fd) {
+                finish_jobs(&server);
+                continue;
+            }
+
+            conn_t *conn = ptr;
+            unsigned int e = events[i].events;
+            if(conn->state == CONN_CLOSED)
+                continue;
+            if(conn->state == CONN_WAITING) {
+                // Closed when the conversion is done.
+                if(e & (EPOLLERR | EPOLLHUP)) {
+                    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+                    conn->dead = true;
+                }
+                continue;
+            }
+
+            if(e & (EPOLLERR | EPOLLHUP))
+                conn_close(&server, conn);
+            else if(conn->state == CONN_SENDING) {
+                if(conn_flush(&server, conn))
+                    conn_process(&server, conn);
+            } else
+                conn_read(&server, conn);
+        }
+
+        free_closed(&server);
+    }
+}
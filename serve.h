@@ -0,0 +1,30 @@
+#ifndef C2HTML_SERVE_H
+#define C2HTML_SERVE_H
+
+#include "c2html.h"
+
+/* Settings of the HTTP server of the CLI. */
+typedef struct {
+    const char *root;       // Directory that's served
+    int         port;       // Port on 127.0.0.1
+    int         threads;    // Number of threads converting files
+    const char *style_data; // Added to each page, or NULL
+    const c2html_opts_t *opts;
+} serve_config_t;
+
+/* Serves the files under [config->root] as highlighted
+ * HTML pages over HTTP/1.1. Directories are served as
+ * lists of links to their contents.
+ *
+ * A file is converted the first time it's requested, by
+ * a pool of worker threads, while a single thread handles
+ * all of the connections using epoll. The output is kept
+ * in a temporary file and sent with [sendfile] until the
+ * source file changes.
+ *
+ * It only returns if the server can't be started, with
+ * the error already reported to stderr.
+ */
+int serve(const serve_config_t *config);
+
+#endif /* C2HTML_SERVE_H */
@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "watch.h"
+
+#define DIR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR)
+
+/* Watched directory. Files are watched through
+ * their directory, since editors often replace
+ * them by renaming a new file over them.
+ */
+typedef struct {
+    int   wd;
+    char *path;
+    bool  recursive; // All of the sources in it are converted
+} wdir_t;
+
+/* File that was listed by itself. */
+typedef struct {
+    int   wd;   // Of its directory
+    char *name; // In its directory
+    char *path; // As it was given
+} wfile_t;
+
+typedef struct {
+    const watch_config_t *config;
+    int      fd;
+    wdir_t  *dirs;
+    int      num_dirs;
+    int      cap_dirs;
+    wfile_t *files;
+    int      num_files;
+    int      cap_files;
+    char   **changed; // Files to convert
+    int      num_changed;
+    int      cap_changed;
+} watcher_t;
+
+/* Makes room in [*array] for at least [count+1]
+ * elements of [size] bytes.
+ */
+static bool grow(void *array, int *capacity, int count, size_t size)
+{
+    if(count < *capacity)
+        return true;
+
+    int new_capacity = *capacity ? 2 * *capacity : 16;
+    void *temp = realloc(*(void**) array, new_capacity * size);
+    if(temp == NULL)
+        return false;
+
+    *(void**) array = temp;
+    *capacity = new_capacity;
+    return true;
+}
+
+static bool is_source(const char *name)
+{
+    long len = strlen(name);
+    return len > 2 && name[len-2] == '.'
+        && (name[len-1] == 'c' || name[len-1] == 'h');
+}
+
+static char *join(const char *dir, const char *name)
+{
+    long dir_len = strlen(dir);
+    long name_len = strlen(name);
+    bool slash = dir_len > 0 && dir[dir_len-1] != '/';
+
+    char *path = malloc(dir_len + slash + name_len + 1);
+    if(path == NULL)
+        return NULL;
+    memcpy(path, dir, dir_len);
+    if(slash)
+        path[dir_len] = '/';
+    memcpy(path + dir_len + slash, name, name_len + 1);
+    return path;
+}
+
+/* Adds [path] to the files to convert. It takes
+ * ownership of it, which may be NULL if allocating
+ * it failed.
+ */
+static void mark(watcher_t *w, char *path)
+{
+    if(path == NULL || !grow(&w->changed, &w->cap_changed,
+                             w->num_changed, sizeof(char*))) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(path);
+        return;
+    }
+    w->changed[w->num_changed++] = path;
+}
+
+static wdir_t *find_dir(watcher_t *w, int wd)
+{
+    for(int i = 0; i < w->num_dirs; i += 1)
+        if(w->dirs[i].wd == wd)
+            return &w->dirs[i];
+    return NULL;
+}
+
+/* Starts watching the directory [path]. Returns
+ * its watch descriptor, or -1 on failure.
+ */
+static int add_dir(watcher_t *w, const char *path, bool recursive)
+{
+    int wd = inotify_add_watch(w->fd, path, DIR_EVENTS);
+    if(wd < 0) {
+        fprintf(stderr, "Error: Couldn't watch %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    // The same directory may be reached more than once.
+    wdir_t *dir = find_dir(w, wd);
+    if(dir != NULL) {
+        dir->recursive |= recursive;
+        return wd;
+    }
+
+    char *copy = strdup(path);
+    if(copy == NULL || !grow(&w->dirs, &w->cap_dirs, w->num_dirs, sizeof(wdir_t))) {
+        fprintf(stderr, "Error: Out of memory\n");
+        inotify_rm_watch(w->fd, wd);
+        free(copy);
+        return -1;
+    }
+    w->dirs[w->num_dirs++] = (wdir_t) {
+        .wd = wd,
+        .path = copy,
+        .recursive = recursive
+    };
+    return wd;
+}
+
+/* Watches the directory [path] and the ones in it,
+ * skipping hidden ones, and marks all of the sources
+ * in them to be converted.
+ */
+static int scan_dir(watcher_t *w, const char *path)
+{
+    if(add_dir(w, path, true) < 0)
+        return -1;
+
+    DIR *d = opendir(path);
+    if(d == NULL) {
+        fprintf(stderr, "Error: Couldn't open directory %s\n", path);
+        return -1;
+    }
+
+    int res = 0;
+    struct dirent *ent;
+    while((ent = readdir(d)) != NULL) {
+
+        if(ent->d_name[0] == '.')
+            continue;
+
+        char *sub = join(path, ent->d_name);
+        if(sub == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            res = -1;
+            break;
+        }
+
+        unsigned char type = ent->d_type;
+        if(type == DT_UNKNOWN) {
+            struct stat st;
+            if(lstat(sub, &st) == 0)
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if(type == DT_DIR) {
+            if(scan_dir(w, sub))
+                res = -1;
+            free(sub);
+        } else if(type == DT_REG && is_source(ent->d_name))
+            mark(w, sub);
+        else
+            free(sub);
+    }
+
+    closedir(d);
+    return res;
+}
+
+/* Watches the file [path] through its directory and
+ * marks it to be converted.
+ */
+static int watch_file(watcher_t *w, const char *path)
+{
+    for(int i = 0; i < w->num_files; i += 1)
+        if(!strcmp(w->files[i].path, path)) {
+            mark(w, strdup(path));
+            return 0;
+        }
+
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+
+    char *dir;
+    if(slash == NULL)
+        dir = strdup(".");
+    else if(slash == path)
+        dir = strdup("/");
+    else
+        dir = strndup(path, slash - path);
+
+    char *name_copy = strdup(name);
+    char *path_copy = strdup(path);
+    if(dir == NULL || name_copy == NULL || path_copy == NULL
+        || !grow(&w->files, &w->cap_files, w->num_files, sizeof(wfile_t))) {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto fail;
+    }
+
+    int wd = add_dir(w, dir, false);
+    if(wd < 0)
+        goto fail;
+    free(dir);
+
+    w->files[w->num_files++] = (wfile_t) {
+        .wd   = wd,
+        .name = name_copy,
+        .path = path_copy,
+    };
+    mark(w, strdup(path));
+    return 0;
+
+fail:
+    free(dir);
+    free(name_copy);
+    free(path_copy);
+    return -1;
+}
+
+/* Watches all of the paths of the configuration and
+ * marks all of the sources to be converted.
+ */
+static int scan_all(watcher_t *w)
+{
+    const watch_config_t *config = w->config;
+    for(int i = 0; i < config->num_paths; i += 1) {
+
+        const char *path = config->paths[i];
+
+        struct stat st;
+        if(stat(path, &st)) {
+            fprintf(stderr, "Error: Couldn't open %s\n", path);
+            return -1;
+        }
+
+        int res;
+        if(S_ISDIR(st.st_mode))
+            res = scan_dir(w, path);
+        else
+            res = watch_file(w, path);
+        if(res)
+            return -1;
+    }
+    return 0;
+}
+
+static void handle_event(watcher_t *w, const struct inotify_event *ev)
+{
+    if(ev->mask & IN_Q_OVERFLOW) {
+        // Some events were lost, so everything
+        // needs to be converted again.
+        scan_all(w);
+        return;
+    }
+
+    wdir_t *dir = find_dir(w, ev->wd);
+    if(dir == NULL)
+        return;
+
+    if(ev->mask & IN_IGNORED) {
+        // The directory was removed.
+        free(dir->path);
+        *dir = w->dirs[--w->num_dirs];
+        return;
+    }
+
+    if(ev->len == 0 || ev->name[0] == '.')
+        return;
+
+    if(ev->mask & IN_ISDIR) {
+        // New directories are watched like the
+        // ones that were there from the start.
+        if(dir->recursive) {
+            char *sub = join(dir->path, ev->name);
+            if(sub != NULL)
+                scan_dir(w, sub);
+            free(sub);
+        }
+        return;
+    }
+
+    // Files are only converted once they're written.
+    if(ev->mask & IN_CREATE)
+        return;
+
+    if(dir->recursive && is_source(ev->name)) {
+        mark(w, join(dir->path, ev->name));
+        return;
+    }
+
+    for(int i = 0; i < w->num_files; i += 1)
+        if(w->files[i].wd == ev->wd && !strcmp(w->files[i].name, ev->name))
+            mark(w, strdup(w->files[i].path));
+}
+
+typedef struct {
+    watcher_t      *w;
+    pthread_mutex_t lock;
+    int             next;   // Next file to convert
+    int             failed;
+} batch_t;
+
+static void *worker_main(void *arg)
+{
+    batch_t *b = arg;
+    const watch_config_t *config = b->w->config;
+
+    while(1) {
+        pthread_mutex_lock(&b->lock);
+        int i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+
+        if(i >= b->w->num_changed)
+            break;
+
+        if(config->convert(config->data, b->w->changed[i])) {
+            pthread_mutex_lock(&b->lock);
+            b->failed += 1;
+            pthread_mutex_unlock(&b->lock);
+        }
+    }
+    return NULL;
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char**) a, *(char**) b);
+}
+
+/* Converts the files that changed, each one once. */
+static void rebuild(watcher_t *w)
+{
+    qsort(w->changed, w->num_changed, sizeof(char*), compare_strings);
+    int count = 0;
+    for(int i = 0; i < w->num_changed; i += 1) {
+        if(count > 0 && !strcmp(w->changed[count-1], w->changed[i]))
+            free(w->changed[i]);
+        else
+            w->changed[count++] = w->changed[i];
+    }
+    w->num_changed = count;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    batch_t b = { .w = w };
+    pthread_mutex_init(&b.lock, NULL);
+
+    // The current thread is one of the workers.
+    int threads = w->config->threads;
+    if(threads > count)
+        threads = count;
+    pthread_t *extra = NULL;
+    int started = 0;
+    if(threads > 1)
+        extra = malloc((threads - 1) * sizeof(pthread_t));
+    if(extra != NULL)
+        while(started < threads - 1 && !pthread_create(&extra[started], NULL, worker_main, &b))
+            started += 1;
+
+    worker_main(&b);
+    for(int i = 0; i < started; i += 1)
+        pthread_join(extra[i], NULL);
+    free(extra);
+    pthread_mutex_destroy(&b.lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+    if(b.failed > 0)
+        fprintf(stderr, "Converted %d file%s in %.1f ms (%d failed)\n",
+                count - b.failed, count - b.failed == 1 ? "" : "s", ms, b.failed);
+    else
+        fprintf(stderr, "Converted %d file%s in %.1f ms\n",
+                count, count == 1 ? "" : "s", ms);
+
+    for(int i = 0; i < count; i += 1)
+        free(w->changed[i]);
+    w->num_changed = 0;
+}
+
+int watch(const watch_config_t *config)
+{
+    watcher_t w = { .config = config };
+
+    w.fd = inotify_init1(IN_CLOEXEC);
+    if(w.fd < 0) {
+        fprintf(stderr, "Error: Couldn't start watching (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    if(scan_all(&w)) {
+        close(w.fd);
+        return -1;
+    }
+    rebuild(&w);
+
+    fprintf(stderr, "Watching for changes\n");
+
+    char buffer[1 << 16] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while(1) {
+
+        // Nothing is converted until there are no
+        // changes for a while.
+        struct pollfd p = { .fd = w.fd, .events = POLLIN };
+        int n = poll(&p, 1, w.num_changed > 0 ? config->debounce : -1);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0) {
+            fprintf(stderr, "Error: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if(n == 0) {
+            rebuild(&w);
+            continue;
+        }
+
+        ssize_t len = read(w.fd, buffer, sizeof(buffer));
+        if(len < 0 && errno == EINTR)
+            continue;
+        if(len < 0) {
+            fprintf(stderr, "Error: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for(char *ptr = buffer; ptr < buffer + len; ) {
+            const struct inotify_event *ev = (struct inotify_event*) ptr;
+            handle_event(&w, ev);
+            ptr += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
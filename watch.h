@@ -0,0 +1,37 @@
+#ifndef C2HTML_WATCH_H
+#define C2HTML_WATCH_H
+
+/* Converts the source file [file]. Called by more
+ * than one thread at the same time, so it must only
+ * modify its own state. Returns 0 on success.
+ */
+typedef int (*watch_convert_t)(void *data, const char *file);
+
+/* Settings of the watch mode of the CLI. */
+typedef struct {
+    char  **paths;     // Files and directories to watch
+    int     num_paths;
+    int     threads;   // Number of threads converting files
+    int     debounce;  // Milliseconds without changes to wait
+                       // for before converting
+    watch_convert_t convert;
+    void   *data;      // Passed to [convert]
+} watch_config_t;
+
+/* Converts all of the files in [config->paths], then
+ * converts them again each time they change. The
+ * directories are watched recursively and the ".c"
+ * and ".h" files in them are converted, including
+ * the ones that are created later.
+ *
+ * Changes are detected with inotify. They usually
+ * come in bursts, so the files are converted once
+ * no change happened for [config->debounce] ms,
+ * at the same time by [config->threads] threads.
+ *
+ * It only returns if the files can't be watched,
+ * with the error already reported to stderr.
+ */
+int watch(const watch_config_t *config);
+
+#endif /* C2HTML_WATCH_H */